@@ -264,6 +264,7 @@ int main(void)
     }
 
     mandelbrot(fb_base[first_valid_connector], fb_w[first_valid_connector], fb_h[first_valid_connector], 32);
+    mandelbrot_print_stats(stdout);
 
     return 0;
 }
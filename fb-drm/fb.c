@@ -141,6 +141,7 @@ int main(void)
     }
 
     mandelbrot(fbp, vinfo.xres, vinfo.yres, vinfo.bits_per_pixel);
+    mandelbrot_print_stats(stdout);
 
     return 0;
 }
@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mandelbrot.h"
+
+/*
+ * mandelbrot() without a screen: renders into a malloc'd 32 bpp frame, so
+ * it runs on a machine with no /dev/fb0 or DRM device.
+ *
+ * A run is passes 1..-i iters over a -w x -h frame, as mandelbrot() does
+ * for 48. -W runs are thrown away first, then -n runs are timed; each
+ * prints its time, Mpixels/s (width * height per pass) and Miters/s (of z,
+ * the work actually done), and the end the best and the median.
+ *
+ *   -t threads     0 is one per CPU
+ *   -k kernel      scalar|sse2|avx2, the best the CPU has by default
+ *   -P             every pass from z = 0 instead of continuing the last
+ *   -o file.ppm    the last frame
+ *
+ * gcc -O2 mandelbrot-bench.c mandelbrot.c -o mandelbrot-bench -lpthread
+ */
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t width = 1920, height = 1080;
+    int iters = 48, threads = 0, runs = 5, warmup = 1, restart = 0;
+    const char *kernel = NULL, *out = NULL;
+    double *seconds, *mpixels, *miters;
+    mandelbrot_stats st;
+    uint8_t *frame;
+    int opt, k, r, i;
+
+    while ((opt = getopt(argc, argv, "w:h:i:t:k:n:W:Po:")) != -1) {
+        switch (opt) {
+        case 'w': width = atoi(optarg); break;
+        case 'h': height = atoi(optarg); break;
+        case 'i': iters = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'k': kernel = optarg; break;
+        case 'n': runs = atoi(optarg); break;
+        case 'W': warmup = atoi(optarg); break;
+        case 'P': restart = 1; break;
+        case 'o': out = optarg; break;
+        default:
+            goto usage;
+        }
+    }
+    if (width < 1 || height < 1 || iters < 1 || threads < 0 || runs < 1 || warmup < 0) {
+usage:
+        printf("%s [-w width] [-h height] [-i iters] [-t threads] [-k scalar|sse2|avx2] [-n runs] [-W warmup] [-P] [-o file.ppm]\n", argv[0]);
+        return 1;
+    }
+
+    if (kernel) {
+        for (k = 0; k < MANDELBROT_KERNELS; k++) {
+            if (strcmp(kernel, mandelbrot_kernel_name(k)) == 0) {
+                break;
+            }
+        }
+        if (!mandelbrot_set_kernel(k)) {
+            printf("kernel %s not supported\n", kernel);
+            return 1;
+        }
+    }
+    mandelbrot_set_threads(threads);
+    mandelbrot_set_progressive(!restart);
+
+    frame = malloc((size_t)width * height * 4);
+    seconds = malloc(runs * sizeof(double));
+    mpixels = malloc(runs * sizeof(double));
+    miters = malloc(runs * sizeof(double));
+
+    printf("%ux%u, %d passes, %s, %d threads%s\n", width, height, iters, mandelbrot_kernel_name(mandelbrot_kernel()),
+        mandelbrot_threads(), restart ? ", every pass from z = 0" : "");
+    for (r = -warmup; r < runs; r++) {
+        mandelbrot_reset_stats();
+        for (i = 1; i <= iters; i++) {
+            mandelbrot_pass(frame, width, height, 32, i);
+        }
+        if (r < 0) {
+            continue;
+        }
+        mandelbrot_get_stats(&st);
+        seconds[r] = st.seconds;
+        mpixels[r] = st.pixels / st.seconds / 1e6;
+        miters[r] = st.iterations / st.seconds / 1e6;
+        printf("run %2d %8.3f s %10.1f Mpixels/s %10.1f Miters/s, busy", r, seconds[r], mpixels[r], miters[r]);
+        for (i = 0; i < st.threads; i++) {
+            printf(" %.0f%%", 100 * st.busy[i] / st.seconds);
+        }
+        printf("\n");
+    }
+
+    qsort(seconds, runs, sizeof(double), cmp_double);
+    qsort(mpixels, runs, sizeof(double), cmp_double);
+    qsort(miters, runs, sizeof(double), cmp_double);
+    printf("best   %8.3f s %10.1f Mpixels/s %10.1f Miters/s\n", seconds[0], mpixels[runs - 1], miters[runs - 1]);
+    printf("median %8.3f s %10.1f Mpixels/s %10.1f Miters/s\n", seconds[runs / 2], mpixels[runs / 2], miters[runs / 2]);
+
+    if (out && mandelbrot_write_ppm(out, frame, width, height, 32) != 0) {
+        printf("%s: %s\n", out, strerror(errno));
+        return 1;
+    }
+    free(frame);
+    free(seconds);
+    free(mpixels);
+    free(miters);
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mandelbrot.h"
+
+/*
+ * Every kernel against the pixel at a time loop mandelbrot.c started from,
+ * byte for byte, for iters 1..48, and the time of the 48 passes, which
+ * continue each other, and once more starting every pass from z = 0. Then the
+ * fastest kernel the same way with 1, 2, 3, 4 .. one per CPU threads, with
+ * the speedup over one thread and how busy each thread was.
+ *
+ * gcc -O2 mandelbrot-cmp.c mandelbrot.c -o mandelbrot-cmp -lpthread
+ * ./mandelbrot-cmp [width height]
+ */
+
+/* as in mandelbrot.c, no FMA in the reference either */
+#pragma GCC optimize("fp-contract=off")
+
+static void reference(uint8_t *buffer, uint32_t width, uint32_t height, uint32_t bits_per_pixel, int iters)
+{
+    int i, j, c;
+    float a, b, tmp, x, y;
+    int bytes_per_pixel = bits_per_pixel / 8;
+
+    for (i = 0; i < height; i++) {
+        for (j = 0; j < width; j++) {
+            x = 0;
+            y = 0;
+            c = 0;
+
+            a = 3. * j / width - 2;
+            b = 1 - 2. * i / height;
+
+            do {
+                tmp = x;
+                x = x * x - y * y + a;
+                y = 2 * tmp * y + b;
+                if (x * x + y * y > 4) {
+                    break;
+                }
+            } while (++c < iters);
+
+            int start = i * width * bytes_per_pixel + j * bytes_per_pixel;
+            int color = c * 255 / iters;
+            buffer[start]     = color;
+            buffer[start + 1] = color;
+            buffer[start + 2] = color;
+        }
+    }
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/* 48 passes, the time and the bytes that differ from the reference */
+static long compare(uint8_t *want, uint8_t *got, uint32_t width, uint32_t height, double *t)
+{
+    size_t n, size = (size_t)width * height * 4;
+    long bad = 0;
+    int iters;
+
+    *t = 0;
+    for (iters = 1; iters <= 48; iters++) {
+        reference(want, width, height, 32, iters);
+        double t0 = now();
+        mandelbrot_pass(got, width, height, 32, iters);
+        *t += now() - t0;
+        for (n = 0; n < size; n++) {
+            bad += want[n] != got[n];
+        }
+    }
+    return bad;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t width = argc > 2 ? atoi(argv[1]) : 1021;
+    uint32_t height = argc > 2 ? atoi(argv[2]) : 767;
+    size_t size = (size_t)width * height * 4;
+    uint8_t *want = calloc(1, size), *got = calloc(1, size);
+    int k, n, best = 0, failed = 0;
+    long bad;
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double t, t1 = 0;
+
+    printf("%ux%u, 48 passes, %d threads\n", width, height, mandelbrot_threads());
+    for (k = 0; k < MANDELBROT_KERNELS; k++) {
+        if (!mandelbrot_set_kernel(k)) {
+            printf("%-8s not supported\n", mandelbrot_kernel_name(k));
+            continue;
+        }
+        best = k;
+        bad = compare(want, got, width, height, &t);
+        printf("%-8s %8.3f s %s", mandelbrot_kernel_name(k), t, bad ? "" : "identical\n");
+        if (bad) {
+            printf("%ld bytes differ\n", bad);
+            failed = 1;
+        }
+    }
+
+    mandelbrot_set_kernel(best);
+    mandelbrot_set_progressive(0);
+    bad = compare(want, got, width, height, &t);
+    printf("%-8s %8.3f s %s", "z = 0", t, bad ? "" : "identical, every pass from the start\n");
+    if (bad) {
+        printf("%ld bytes differ\n", bad);
+        failed = 1;
+    }
+    mandelbrot_set_progressive(1);
+
+    printf("%s, %d CPUs\n", mandelbrot_kernel_name(best), cpus);
+    for (n = 1; n <= (cpus > 4 ? cpus : 4); n++) {
+        mandelbrot_stats st, end;
+        int i;
+
+        mandelbrot_set_threads(n);
+        mandelbrot_pass(got, width, height, 32, 1);     /* start the threads */
+        mandelbrot_get_stats(&st);
+        bad = compare(want, got, width, height, &t);
+        if (n == 1) {
+            t1 = t;
+        }
+        printf("%3d threads %8.3f s x%.2f %s", n, t, t1 / t, bad ? "" : "identical, busy");
+        if (bad) {
+            printf("%ld bytes differ\n", bad);
+            failed = 1;
+            continue;
+        }
+        mandelbrot_get_stats(&end);
+        for (i = 0; i < end.threads; i++) {
+            double busy = end.busy[i] - st.busy[i];
+            printf(" %.0f%%(%ld)", 100 * busy / (end.seconds - st.seconds), end.steals[i] - st.steals[i]);
+        }
+        printf("\n");
+    }
+    free(want);
+    free(got);
+    return failed;
+}
@@ -1,49 +1,606 @@
-#include <sys/time.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "mandelbrot.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MANDELBROT_X86
+#endif
+
+/* with -march=native gcc would fuse x * x - y * y + a into an FMA */
+#pragma GCC optimize("fp-contract=off")
+
+/*
+ * A pixel's count c is the first iteration at which |z| > 2, or iters if
+ * it stays inside. The SIMD kernels do the same float operations in the
+ * same order as the scalar one, lane by lane, so all three give the same
+ * bytes (no FMA, it rounds differently). A lane that escaped keeps being
+ * computed with the others but no longer counts.
+ *
+ * The passes are progressive: x, y and c of every pixel stay in the
+ * frame's state (one array each), and a kernel continues the pixels that
+ * have not escaped from where the last pass left them, up to iters. z is
+ * the same float sequence as from 0, so the pass is the same as a fresh
+ * one, only iters 1..48 cost 48 iterations a pixel instead of 48 * 49 / 2.
+ * An escaped pixel keeps ~c, negative; the ones that have not all have
+ * c == the last pass's iters.
+ */
+
+typedef void (*row_kernel)(float *xs, float *ys, int *cs, const float *a, float b, uint32_t width, int iters);
+
+static void row_scalar(float *xs, float *ys, int *cs, const float *a, float b, uint32_t width, int iters)
+{
+    uint32_t j;
+
+    for (j = 0; j < width; j++) {
+        float x = xs[j], y = ys[j], tmp;
+        int c = cs[j];
+
+        if (c < 0) {
+            continue;
+        }
+        while (c < iters) {
+            tmp = x;
+            x = x * x - y * y + a[j];
+            y = 2 * tmp * y + b;
+            if (x * x + y * y > 4) {
+                c = ~c;
+                break;
+            }
+            c++;
+        }
+        xs[j] = x;
+        ys[j] = y;
+        cs[j] = c;
+    }
+}
+
+#ifdef MANDELBROT_X86
+
+__attribute__((target("sse2")))
+static void row_sse2(float *xs, float *ys, int *cs, const float *a, float b, uint32_t width, int iters)
+{
+    const __m128 two = _mm_set1_ps(2), four = _mm_set1_ps(4), vb = _mm_set1_ps(b);
+    uint32_t j;
+    int k;
+
+    for (j = 0; j + 4 <= width; j += 4) {
+        __m128i c = _mm_loadu_si128((__m128i *)(cs + j));
+        __m128i start = _mm_cmpgt_epi32(c, _mm_set1_epi32(-1));
+        __m128i active = start;
+
+        if (!_mm_movemask_epi8(active)) {
+            continue;
+        }
+        __m128 va = _mm_loadu_ps(a + j);
+        __m128 x = _mm_loadu_ps(xs + j), y = _mm_loadu_ps(ys + j);
+
+        /* the active lanes are all at the same c */
+        for (k = cs[j + __builtin_ctz(_mm_movemask_epi8(active)) / 4]; k < iters; k++) {
+            __m128 tmp = x;
+            x = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), va);
+            y = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(two, tmp), y), vb);
+            __m128 out = _mm_cmpgt_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), four);
+            active = _mm_andnot_si128(_mm_castps_si128(out), active);
+            if (!_mm_movemask_epi8(active)) {
+                break;
+            }
+            /* active is -1 per lane */
+            c = _mm_sub_epi32(c, active);
+        }
+        /* ~c for the lanes that escaped in this call */
+        c = _mm_xor_si128(c, _mm_andnot_si128(active, start));
+        _mm_storeu_ps(xs + j, x);
+        _mm_storeu_ps(ys + j, y);
+        _mm_storeu_si128((__m128i *)(cs + j), c);
+    }
+    row_scalar(xs + j, ys + j, cs + j, a + j, b, width - j, iters);
+}
+
+__attribute__((target("avx2")))
+static void row_avx2(float *xs, float *ys, int *cs, const float *a, float b, uint32_t width, int iters)
+{
+    const __m256 two = _mm256_set1_ps(2), four = _mm256_set1_ps(4), vb = _mm256_set1_ps(b);
+    uint32_t j;
+    int k;
+
+    for (j = 0; j + 8 <= width; j += 8) {
+        __m256i c = _mm256_loadu_si256((__m256i *)(cs + j));
+        __m256i start = _mm256_cmpgt_epi32(c, _mm256_set1_epi32(-1));
+        __m256i active = start;
+
+        if (_mm256_testz_si256(active, active)) {
+            continue;
+        }
+        __m256 va = _mm256_loadu_ps(a + j);
+        __m256 x = _mm256_loadu_ps(xs + j), y = _mm256_loadu_ps(ys + j);
+
+        for (k = cs[j + __builtin_ctz(_mm256_movemask_epi8(active)) / 4]; k < iters; k++) {
+            __m256 tmp = x;
+            x = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), va);
+            y = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(two, tmp), y), vb);
+            __m256 out = _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), four, _CMP_GT_OQ);
+            active = _mm256_andnot_si256(_mm256_castps_si256(out), active);
+            if (_mm256_testz_si256(active, active)) {
+                break;
+            }
+            c = _mm256_sub_epi32(c, active);
+        }
+        c = _mm256_xor_si256(c, _mm256_andnot_si256(active, start));
+        _mm256_storeu_ps(xs + j, x);
+        _mm256_storeu_ps(ys + j, y);
+        _mm256_storeu_si256((__m256i *)(cs + j), c);
+    }
+    row_scalar(xs + j, ys + j, cs + j, a + j, b, width - j, iters);
+}
+
+#endif
+
+static const char *kernel_names[] = { "scalar", "sse2", "avx2" };
+
+static const row_kernel kernels[] = {
+    row_scalar,
+#ifdef MANDELBROT_X86
+    row_sse2,
+    row_avx2,
+#endif
+};
+
+static int kernel = -1;
+
+int mandelbrot_kernel_supported(int k)
+{
+    switch (k) {
+    case MANDELBROT_SCALAR:
+        return 1;
+#ifdef MANDELBROT_X86
+    case MANDELBROT_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+    case MANDELBROT_AVX2:
+        /* cpuid, and xgetbv for the OS saving the ymm registers */
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+const char *mandelbrot_kernel_name(int k)
+{
+    return k >= 0 && k < MANDELBROT_KERNELS ? kernel_names[k] : "?";
+}
+
+int mandelbrot_set_kernel(int k)
+{
+    if (!mandelbrot_kernel_supported(k)) {
+        return 0;
+    }
+    kernel = k;
+    return 1;
+}
+
+int mandelbrot_kernel(void)
+{
+    if (kernel < 0) {
+        const char *env = getenv("MANDELBROT_KERNEL");
+        int k;
+
+        for (k = MANDELBROT_KERNELS - 1; k > MANDELBROT_SCALAR; k--) {
+            if (env && strcmp(env, kernel_names[k]) != 0) {
+                continue;
+            }
+            if (mandelbrot_kernel_supported(k)) {
+                break;
+            }
+        }
+        kernel = k;
+    }
+    return kernel;
+}
+
+/*
+ * Tiles and threads
+ *
+ * A pass is cut into TILE_W x TILE_H tiles, numbered row by row. Each
+ * worker starts with a contiguous share of them, a range lo..hi in one
+ * 64 bit word: it takes tiles from lo, and a worker that ran out steals
+ * the upper half of another one's range, both with a CAS. The rows around
+ * the set take far longer than the rest, so the shares end up uneven and
+ * stealing evens them out. The calling thread is worker 0, the others
+ * wait for the next pass.
+ */
+#define TILE_W          256
+#define TILE_H          8
+
+typedef struct {
+    uint64_t range;         /* lo | hi << 32 */
+    pthread_t th;
+    uint64_t busy_ns;
+    uint64_t iterations;
+    long tiles;
+    long steals;
+} __attribute__((aligned(64))) worker_t;
+
+static struct {
+    uint8_t *buffer;
+    uint32_t width, height;
+    int bytes_per_pixel;
+    int iters;
+    int from;               /* the iters the state is at */
+    row_kernel row;
+    uint32_t tiles_x;
+} job;
+
+/* the state the passes continue, for one width x height */
+static struct {
+    uint32_t width, height;
+    int iters;              /* of the last pass */
+    float *a;
+    float *x, *y;
+    int *c;
+} frame;
+
+static int progressive = 1;
+
+static worker_t *workers;
+static int nworkers;
+static int threads_wanted;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static unsigned pass_gen;
+static int running;
+static int quit;
+
+static mandelbrot_stats stats;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void render_tile(worker_t *w, uint32_t tile)
+{
+    uint64_t n = 0;
+    uint32_t x0 = tile % job.tiles_x * TILE_W, y0 = tile / job.tiles_x * TILE_H;
+    uint32_t tw = job.width - x0 < TILE_W ? job.width - x0 : TILE_W;
+    uint32_t i, j;
+
+    for (i = y0; i < y0 + TILE_H && i < job.height; i++) {
+        float b = 1 - 2. * i / job.height;
+        size_t off = (size_t)i * job.width + x0;
+        uint8_t *p = job.buffer + off * job.bytes_per_pixel;
+
+        job.row(frame.x + off, frame.y + off, frame.c + off, frame.a + x0, b, tw, job.iters);
+        for (j = 0; j < tw; j++, p += job.bytes_per_pixel) {
+            int c = frame.c[off + j];
+
+            /* c - from, and the one that escaped */
+            if (c < 0) {
+                c = ~c;
+                n += c >= job.from ? c - job.from + 1 : 0;
+            } else {
+                n += c - job.from;
+            }
+            int color = c * 255 / job.iters;
+            p[0] = color;
+            p[1] = color;
+            p[2] = color;
+        }
+    }
+    w->iterations += n;
+}
+
+/* the next tile of w's own range, -1 if it is empty */
+static int64_t take(worker_t *w)
+{
+    uint64_t r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        uint32_t lo = (uint32_t)r, hi = (uint32_t)(r >> 32);
+
+        if (lo >= hi) {
+            return -1;
+        }
+        if (__atomic_compare_exchange_n(&w->range, &r, (uint64_t)(lo + 1) | (uint64_t)hi << 32, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return lo;
+        }
+    }
+}
+
+/* move the upper half of someone's range into w's, 0 if there is nothing left */
+static int steal(int self)
+{
+    worker_t *w = &workers[self];
+    int n;
+
+    for (n = 1; n < nworkers; n++) {
+        worker_t *v = &workers[(self + n) % nworkers];
+        uint64_t r = __atomic_load_n(&v->range, __ATOMIC_ACQUIRE);
+
+        for (;;) {
+            uint32_t lo = (uint32_t)r, hi = (uint32_t)(r >> 32), mid;
+
+            if (lo >= hi) {
+                break;
+            }
+            mid = hi - (hi - lo + 1) / 2;
+            if (__atomic_compare_exchange_n(&v->range, &r, (uint64_t)lo | (uint64_t)mid << 32, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&w->range, (uint64_t)mid | (uint64_t)hi << 32, __ATOMIC_RELEASE);
+                w->steals++;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void run_tiles(int self)
+{
+    worker_t *w = &workers[self];
+
+    for (;;) {
+        int64_t tile = take(w);
+
+        if (tile < 0) {
+            if (!steal(self)) {
+                break;
+            }
+            continue;
+        }
+        uint64_t t0 = now_ns();
+        render_tile(w, tile);
+        w->busy_ns += now_ns() - t0;
+        w->tiles++;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    unsigned seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool_mutex);
+        while (pass_gen == seen && !quit) {
+            pthread_cond_wait(&pool_start, &pool_mutex);
+        }
+        seen = pass_gen;
+        pthread_mutex_unlock(&pool_mutex);
+        if (quit) {
+            return NULL;
+        }
+
+        run_tiles(self);
+
+        pthread_mutex_lock(&pool_mutex);
+        if (--running == 0) {
+            pthread_cond_signal(&pool_done);
+        }
+        pthread_mutex_unlock(&pool_mutex);
+    }
+}
+
+static void pool_stop(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool_mutex);
+    quit = 1;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_mutex);
+    for (i = 1; i < nworkers; i++) {
+        pthread_join(workers[i].th, NULL);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+    pass_gen = 0;   /* new workers wait for pass 1 */
+    quit = 0;
+}
+
+static void pool_start_threads(void)
+{
+    int i, n = mandelbrot_threads();
+
+    workers = aligned_alloc(64, n * sizeof(worker_t));
+    memset(workers, 0, n * sizeof(worker_t));
+    nworkers = n;
+    for (i = 1; i < n; i++) {
+        if (pthread_create(&workers[i].th, NULL, worker_main, (void *)(intptr_t)i) != 0) {
+            perror("pthread_create");
+            nworkers = i;
+            break;
+        }
+    }
+}
+
+void mandelbrot_set_threads(int threads)
+{
+    if (workers) {
+        pool_stop();
+    }
+    threads_wanted = threads;
+}
+
+int mandelbrot_threads(void)
+{
+    if (nworkers) {
+        return nworkers;
+    }
+    if (threads_wanted > 0) {
+        return threads_wanted < MANDELBROT_MAX_THREADS ? threads_wanted : MANDELBROT_MAX_THREADS;
+    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n < MANDELBROT_MAX_THREADS ? n : MANDELBROT_MAX_THREADS;
+}
+
+/* z = 0 for every pixel, and a for a new size */
+static void frame_reset(uint32_t width, uint32_t height)
+{
+    size_t n = (size_t)width * height;
+    uint32_t j;
+
+    if (frame.width != width || frame.height != height) {
+        free(frame.a);
+        free(frame.x);
+        free(frame.y);
+        free(frame.c);
+        frame.width = width;
+        frame.height = height;
+        frame.a = malloc(width * sizeof(float));
+        frame.x = malloc(n * sizeof(float));
+        frame.y = malloc(n * sizeof(float));
+        frame.c = malloc(n * sizeof(int));
+
+        /* the divisions once per column and row, not per pixel */
+        for (j = 0; j < width; j++) {
+            frame.a[j] = 3. * j / width - 2;
+        }
+    }
+    memset(frame.x, 0, n * sizeof(float));
+    memset(frame.y, 0, n * sizeof(float));
+    memset(frame.c, 0, n * sizeof(int));
+    frame.iters = 0;
+}
+
+void mandelbrot_set_progressive(int on)
+{
+    progressive = on;
+    frame.iters = -1;
+}
+
+void mandelbrot_get_stats(mandelbrot_stats *st)
+{
+    *st = stats;
+}
+
+void mandelbrot_pass(uint8_t *buffer, uint32_t width, uint32_t height, uint32_t bits_per_pixel, int iters)
+{
+    uint32_t ntiles;
+    uint64_t t0 = now_ns();
+    int i;
+
+    if (!workers) {
+        pool_start_threads();
+    }
+
+    job.buffer = buffer;
+    job.width = width;
+    job.height = height;
+    job.bytes_per_pixel = bits_per_pixel / 8;
+    job.iters = iters;
+    job.row = kernels[mandelbrot_kernel()];
+    job.tiles_x = (width + TILE_W - 1) / TILE_W;
+    /* a pass with fewer iters, or a frame of another size, starts over */
+    if (!progressive || frame.iters < 0 || iters < frame.iters
+            || frame.width != width || frame.height != height) {
+        frame_reset(width, height);
+    }
+    job.from = frame.iters;
+    ntiles = job.tiles_x * ((height + TILE_H - 1) / TILE_H);
+    for (i = 0; i < nworkers; i++) {
+        uint64_t lo = (uint64_t)ntiles * i / nworkers, hi = (uint64_t)ntiles * (i + 1) / nworkers;
+
+        workers[i].range = lo | hi << 32;
+        workers[i].busy_ns = 0;
+        workers[i].iterations = 0;
+        workers[i].tiles = 0;
+        workers[i].steals = 0;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    running = nworkers - 1;
+    pass_gen++;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_mutex);
+
+    run_tiles(0);
+
+    pthread_mutex_lock(&pool_mutex);
+    while (running > 0) {
+        pthread_cond_wait(&pool_done, &pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    frame.iters = iters;
+
+    stats.threads = nworkers;
+    stats.seconds += (now_ns() - t0) / 1e9;
+    stats.passes++;
+    stats.pixels += (uint64_t)width * height;
+    for (i = 0; i < nworkers; i++) {
+        stats.iterations += workers[i].iterations;
+        stats.busy[i] += workers[i].busy_ns / 1e9;
+        stats.tiles[i] += workers[i].tiles;
+        stats.steals[i] += workers[i].steals;
+    }
+}
+
+void mandelbrot_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+void mandelbrot_print_stats(FILE *out)
+{
+    int i;
+
+    fprintf(out, "mandelbrot %ld passes, %s, %d threads: %.2f seconds, busy", stats.passes,
+        mandelbrot_kernel_name(mandelbrot_kernel()), stats.threads, stats.seconds);
+    for (i = 0; i < stats.threads; i++) {
+        fprintf(out, " %.0f%%", 100 * stats.busy[i] / stats.seconds);
+    }
+    fprintf(out, "\n");
+}
+
 void mandelbrot(uint8_t *buffer, uint32_t width, uint32_t height, uint32_t bits_per_pixel)
 {
-    struct timeval start, stop;
-    gettimeofday(&start, NULL);
+    mandelbrot_reset_stats();
 
     int iters = 1;
-    int i, j, c;
-    float a, b, tmp, x, y;
-    int bytes_per_pixel = bits_per_pixel / 8;
     while (iters <= 48) {
-        for (i = 0; i < height; i++) {
-            for (j = 0; j < width; j++) {
-                x = 0;
-                y = 0;
-                c = 0;
-
-                a = 3. * j / width - 2;
-                b = 1 - 2. * i / height;
-
-                do {
-                    tmp = x;
-                    x = x * x - y * y + a;
-                    y = 2 * tmp * y + b;
-                    if (x * x + y * y > 4) {
-                        break;
-                    }
-                } while (++c < iters);
-
-                int start = i * width * bytes_per_pixel + j * bytes_per_pixel;
-                int color = c * 255 / iters;
-                buffer[start]     = color;
-                buffer[start + 1] = color;
-                buffer[start + 2] = color;
-            }
-        }
+        mandelbrot_pass(buffer, width, height, bits_per_pixel, iters);
         iters++;
     }
+}
+
+int mandelbrot_write_ppm(const char *path, const uint8_t *buffer, uint32_t width, uint32_t height, uint32_t bits_per_pixel)
+{
+    int bytes_per_pixel = bits_per_pixel / 8;
+    FILE *f = fopen(path, "wb");
+    uint8_t *line;
+    uint32_t i, j;
 
-    gettimeofday(&stop, NULL);
-    printf(
-        "mandelbrot 48 iters: %.2f seconds\n",
-        (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1000000.
-    );
+    if (!f) {
+        return -1;
+    }
+    line = malloc((size_t)width * 3);
+    fprintf(f, "P6\n%u %u\n255\n", width, height);
+    for (i = 0; i < height; i++) {
+        const uint8_t *p = buffer + (size_t)i * width * bytes_per_pixel;
+
+        /* xrgb8888 is b, g, r in memory */
+        for (j = 0; j < width; j++, p += bytes_per_pixel) {
+            line[j * 3] = p[2];
+            line[j * 3 + 1] = p[1];
+            line[j * 3 + 2] = p[0];
+        }
+        fwrite(line, 3, width, f);
+    }
+    free(line);
+    if (ferror(f)) {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f) == 0 ? 0 : -1;
 }
@@ -2,7 +2,56 @@
 #define MANDELBROT_H
 
 #include <stdint.h>
+#include <stdio.h>
 
+/* 48 passes, iters 1..48, with the kernel below; mandelbrot_print_stats() for the time */
 void mandelbrot(uint8_t *buffer, uint32_t width, uint32_t height, uint32_t bits_per_pixel);
 
+/*
+ * one pass of iters iterations over the frame, mandelbrot_stats add up;
+ * continues the last pass if it was the same size with fewer iters
+ */
+void mandelbrot_pass(uint8_t *buffer, uint32_t width, uint32_t height, uint32_t bits_per_pixel, int iters);
+/* 0: every pass from z = 0, as before (1 is the default) */
+void mandelbrot_set_progressive(int on);
+
+/* the kernels give the same bytes, scalar is the reference */
+#define MANDELBROT_SCALAR   0
+#define MANDELBROT_SSE2     1   /* 4 lanes */
+#define MANDELBROT_AVX2     2   /* 8 lanes */
+#define MANDELBROT_KERNELS  3
+
+/* the one in use: MANDELBROT_KERNEL=scalar|sse2|avx2 or the best the CPU has */
+int mandelbrot_kernel(void);
+int mandelbrot_kernel_supported(int kernel);
+/* 0 if the CPU does not have it */
+int mandelbrot_set_kernel(int kernel);
+const char *mandelbrot_kernel_name(int kernel);
+
+#define MANDELBROT_MAX_THREADS  256
+
+/* the calling thread and threads - 1 more; 0 is one per online CPU (default) */
+void mandelbrot_set_threads(int threads);
+int mandelbrot_threads(void);
+
+/* of the last mandelbrot(), or the passes since mandelbrot_reset_stats() */
+typedef struct {
+    double seconds;
+    long passes;
+    uint64_t pixels;        /* width * height of every pass */
+    uint64_t iterations;    /* of z, those a pass continued from the last one not counted */
+    int threads;
+    double busy[MANDELBROT_MAX_THREADS];    /* seconds on tiles, / seconds is the utilization */
+    long tiles[MANDELBROT_MAX_THREADS];
+    long steals[MANDELBROT_MAX_THREADS];
+} mandelbrot_stats;
+
+void mandelbrot_get_stats(mandelbrot_stats *st);
+void mandelbrot_reset_stats(void);
+/* time, kernel, threads and how busy each was, one line */
+void mandelbrot_print_stats(FILE *out);
+
+/* a frame mandelbrot() drew (b, g, r in memory) as a binary PPM, -1 and errno if it fails */
+int mandelbrot_write_ppm(const char *path, const uint8_t *buffer, uint32_t width, uint32_t height, uint32_t bits_per_pixel);
+
 #endif
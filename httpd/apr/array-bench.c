@@ -0,0 +1,167 @@
+#include <apr-1.0/apr_general.h>
+#include <apr-1.0/apr_tables.h>
+#include <stdio.h>
+#include <time.h>
+#include "array_ext.h"
+
+/*
+ * ns per push and pool bytes wasted, for 1e3 .. 1e7 uint64_t elements
+ *
+ * wasted = blocks abandoned in the pool by growth + unused tail capacity
+ *
+ * gcc -O2 array-bench.c array_ext.c -o array-bench -lapr-1
+ */
+
+#define CHUNK	64
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct {
+	const char *name;
+	double ns;
+	apr_size_t abandoned;
+	apr_size_t unused;
+} result_t;
+
+static void print_result(int n, result_t *r)
+{
+	printf("%-10d %-22s %8.2f %14zu %14zu %14zu\n",
+		n, r->name, r->ns, r->abandoned, r->unused, r->abandoned + r->unused);
+}
+
+/* apr_array_make(pool, 10, ...) like array.c, then one apr_array_push() per element */
+static void bench_push(apr_pool_t *pool, int n, result_t *r)
+{
+	apr_array_header_t *arr = apr_array_make(pool, 10, sizeof(uint64_t));
+	char *elts = arr->elts;
+	int nalloc = arr->nalloc;
+	double t = now_ns();
+	int i;
+
+	r->abandoned = 0;
+	for (i = 0; i < n; i++) {
+		APR_ARRAY_PUSH(arr, uint64_t) = i;
+		if (arr->elts != elts) {
+			r->abandoned += (apr_size_t)nalloc * arr->elt_size;
+			elts = arr->elts;
+			nalloc = arr->nalloc;
+		}
+	}
+	r->ns = (now_ns() - t) / n;
+	r->unused = (apr_size_t)(arr->nalloc - arr->nelts) * arr->elt_size;
+	r->name = "apr_array_push";
+}
+
+static void bench_push_n(apr_pool_t *pool, int n, result_t *r)
+{
+	apr_array_header_t *arr = apr_array_make(pool, 10, sizeof(uint64_t));
+	char *elts = arr->elts;
+	int nalloc = arr->nalloc;
+	double t = now_ns();
+	int i, j;
+
+	r->abandoned = 0;
+	for (i = 0; i < n; i += CHUNK) {
+		int m = n - i < CHUNK ? n - i : CHUNK;
+		uint64_t *p = apr_array_push_n(arr, m);
+		for (j = 0; j < m; j++) {
+			p[j] = i + j;
+		}
+		if (arr->elts != elts) {
+			r->abandoned += (apr_size_t)nalloc * arr->elt_size;
+			elts = arr->elts;
+			nalloc = arr->nalloc;
+		}
+	}
+	r->ns = (now_ns() - t) / n;
+	r->unused = (apr_size_t)(arr->nalloc - arr->nelts) * arr->elt_size;
+	r->name = "apr_array_push_n(64)";
+}
+
+static void bench_reserve(apr_pool_t *pool, int n, result_t *r)
+{
+	apr_array_header_t *arr = apr_array_make(pool, 10, sizeof(uint64_t));
+	double t = now_ns();
+	int i;
+
+	r->abandoned = (apr_size_t)arr->nalloc * arr->elt_size;
+	apr_array_reserve(arr, n);
+	for (i = 0; i < n; i++) {
+		APR_ARRAY_PUSH(arr, uint64_t) = i;
+	}
+	r->ns = (now_ns() - t) / n;
+	r->unused = (apr_size_t)(arr->nalloc - arr->nelts) * arr->elt_size;
+	r->name = "apr_array_reserve+push";
+}
+
+static void bench_seg_push(apr_pool_t *pool, int n, result_t *r)
+{
+	seg_array_t *arr = seg_array_make(pool, 10, sizeof(uint64_t));
+	double t = now_ns();
+	int i;
+
+	for (i = 0; i < n; i++) {
+		SEG_ARRAY_PUSH(arr, uint64_t) = i;
+	}
+	r->ns = (now_ns() - t) / n;
+	r->abandoned = 0;
+	r->unused = (apr_size_t)(arr->nalloc - arr->nelts) * arr->elt_size;
+	r->name = "seg_array_push";
+}
+
+static void bench_seg_append(apr_pool_t *pool, int n, result_t *r)
+{
+	seg_array_t *arr = seg_array_make(pool, 10, sizeof(uint64_t));
+	uint64_t chunk[CHUNK];
+	double t = now_ns();
+	int i, j;
+
+	for (i = 0; i < n; i += CHUNK) {
+		int m = n - i < CHUNK ? n - i : CHUNK;
+		for (j = 0; j < m; j++) {
+			chunk[j] = i + j;
+		}
+		seg_array_append(arr, chunk, m);
+	}
+	r->ns = (now_ns() - t) / n;
+	r->abandoned = 0;
+	r->unused = (apr_size_t)(arr->nalloc - arr->nelts) * arr->elt_size;
+	r->name = "seg_array_append(64)";
+}
+
+int main(void)
+{
+	void (*benches[])(apr_pool_t *, int, result_t *) = {
+		bench_push, bench_push_n, bench_reserve, bench_seg_push, bench_seg_append
+	};
+	int n, b;
+
+	apr_initialize();
+
+	apr_pool_t *pool;
+	apr_pool_create(&pool, NULL);
+
+	printf("%-10s %-22s %8s %14s %14s %14s\n",
+		"elements", "strategy", "ns/push", "abandoned", "unused tail", "wasted bytes");
+
+	for (n = 1000; n <= 10000000; n *= 10) {
+		for (b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+			apr_pool_t *sub;
+			result_t r;
+
+			apr_pool_create(&sub, pool);
+			benches[b](sub, n, &r);
+			print_result(n, &r);
+			apr_pool_destroy(sub);
+		}
+	}
+
+	apr_pool_destroy(pool);
+	apr_terminate();
+	return 0;
+}
@@ -0,0 +1,127 @@
+#include "array_ext.h"
+#include <string.h>
+
+void apr_array_reserve(apr_array_header_t *arr, int n)
+{
+	int need = arr->nelts + n;
+	int new_size;
+	char *new_data;
+
+	if (need <= arr->nalloc) {
+		return;
+	}
+
+	new_size = arr->nalloc ? arr->nalloc * 2 : 1;
+	while (new_size < need) {
+		new_size *= 2;
+	}
+
+	new_data = apr_palloc(arr->pool, (apr_size_t)arr->elt_size * new_size);
+	memcpy(new_data, arr->elts, (apr_size_t)arr->nalloc * arr->elt_size);
+	arr->elts = new_data;
+	arr->nalloc = new_size;
+}
+
+void *apr_array_push_n(apr_array_header_t *arr, int n)
+{
+	char *res;
+
+	apr_array_reserve(arr, n);
+	res = arr->elts + (apr_size_t)arr->elt_size * arr->nelts;
+	memset(res, 0, (apr_size_t)arr->elt_size * n);
+	arr->nelts += n;
+	return res;
+}
+
+void *apr_array_pop_n(apr_array_header_t *arr, int n)
+{
+	if (arr->nelts < n) {
+		return NULL;
+	}
+	arr->nelts -= n;
+	return arr->elts + (apr_size_t)arr->elt_size * arr->nelts;
+}
+
+seg_array_t *seg_array_make(apr_pool_t *p, int nelts, int elt_size)
+{
+	seg_array_t *arr = apr_pcalloc(p, sizeof(seg_array_t));
+
+	arr->pool = p;
+	arr->elt_size = elt_size;
+	while ((1 << arr->shift) < nelts) {
+		arr->shift++;
+	}
+	arr->segs[0] = apr_palloc(p, (apr_size_t)elt_size << arr->shift);
+	arr->nalloc = 1 << arr->shift;
+	arr->nsegs = 1;
+	return arr;
+}
+
+static void add_segment(seg_array_t *arr)
+{
+	apr_size_t n = (apr_size_t)1 << (arr->shift + arr->nsegs);
+
+	arr->segs[arr->nsegs++] = apr_palloc(arr->pool, n * arr->elt_size);
+	arr->nalloc += n;
+}
+
+void seg_array_reserve(seg_array_t *arr, int n)
+{
+	while (arr->nalloc - arr->nelts < n) {
+		add_segment(arr);
+	}
+}
+
+void *seg_array_push(seg_array_t *arr)
+{
+	void *res;
+
+	if (arr->nelts == arr->nalloc) {
+		add_segment(arr);
+	}
+	res = seg_array_idx(arr, arr->nelts++);
+	memset(res, 0, arr->elt_size);
+	return res;
+}
+
+void *seg_array_pop(seg_array_t *arr)
+{
+	if (arr->nelts == 0) {
+		return NULL;
+	}
+	return seg_array_idx(arr, --arr->nelts);
+}
+
+/* copy segment by segment, one memcpy per segment touched */
+void seg_array_append(seg_array_t *arr, const void *elts, int n)
+{
+	const char *src = elts;
+
+	seg_array_reserve(arr, n);
+	while (n > 0) {
+		unsigned int q = ((unsigned int)arr->nelts >> arr->shift) + 1;
+		int k = 31 - __builtin_clz(q);
+		int seg_end = ((1 << (k + 1)) - 1) << arr->shift;
+		int chunk = seg_end - arr->nelts < n ? seg_end - arr->nelts : n;
+
+		memcpy(seg_array_idx(arr, arr->nelts), src, (apr_size_t)chunk * arr->elt_size);
+		src += (apr_size_t)chunk * arr->elt_size;
+		arr->nelts += chunk;
+		n -= chunk;
+	}
+}
+
+apr_array_header_t *seg_array_flatten(apr_pool_t *p, const seg_array_t *arr)
+{
+	apr_array_header_t *res = apr_array_make(p, arr->nelts ? arr->nelts : 1, arr->elt_size);
+	char *dst = apr_array_push_n(res, arr->nelts);
+	int k, left = arr->nelts;
+
+	for (k = 0; k < arr->nsegs && left > 0; k++) {
+		int n = (1 << (arr->shift + k)) < left ? (1 << (arr->shift + k)) : left;
+		memcpy(dst, arr->segs[k], (apr_size_t)n * arr->elt_size);
+		dst += (apr_size_t)n * arr->elt_size;
+		left -= n;
+	}
+	return res;
+}
@@ -0,0 +1,68 @@
+#ifndef ARRAY_EXT_H
+#define ARRAY_EXT_H
+
+#include <apr-1.0/apr_pools.h>
+#include <apr-1.0/apr_tables.h>
+
+/*
+ * Bulk operations for apr_array_header_t.
+ *
+ * apr_array_push() doubles nalloc when the array is full: it allocates a new
+ * block from arr->pool, copies the old one and abandons it, because a pool
+ * can not free. Pushing n elements one at a time abandons about n elements
+ * worth of blocks. Reserving the final size up front abandons at most one.
+ */
+
+/* make room for n more elements, growing nalloc geometrically */
+void apr_array_reserve(apr_array_header_t *arr, int n);
+
+/* append n zeroed elements and return a pointer to the first one */
+void *apr_array_push_n(apr_array_header_t *arr, int n);
+
+/* remove the last n elements and return a pointer to the first removed one,
+ * or NULL if the array holds less than n elements */
+void *apr_array_pop_n(apr_array_header_t *arr, int n);
+
+/*
+ * Segmented array: grows by chaining a new segment twice the size of the
+ * previous one instead of copying, so nothing is ever abandoned in the pool
+ * and element addresses stay stable.
+ *
+ * Segment k holds (first << k) elements, first is a power of 2, so an index
+ * maps to its segment with one clz.
+ */
+
+#define SEG_ARRAY_MAX_SEGS	32
+
+typedef struct {
+	apr_pool_t *pool;
+	int elt_size;
+	int nelts;
+	int nalloc;
+	int shift;		/* first segment holds 1 << shift elements */
+	int nsegs;
+	char *segs[SEG_ARRAY_MAX_SEGS];
+} seg_array_t;
+
+seg_array_t *seg_array_make(apr_pool_t *p, int nelts, int elt_size);
+void seg_array_reserve(seg_array_t *arr, int n);
+void *seg_array_push(seg_array_t *arr);
+void *seg_array_pop(seg_array_t *arr);
+void seg_array_append(seg_array_t *arr, const void *elts, int n);
+
+/* copy into one apr_array_header_t for code that wants arr->elts */
+apr_array_header_t *seg_array_flatten(apr_pool_t *p, const seg_array_t *arr);
+
+static APR_INLINE void *seg_array_idx(const seg_array_t *arr, int i)
+{
+	unsigned int q = ((unsigned int)i >> arr->shift) + 1;
+	int k = 31 - __builtin_clz(q);
+	unsigned int off = (unsigned int)i - (((1U << k) - 1) << arr->shift);
+
+	return arr->segs[k] + (apr_size_t)off * arr->elt_size;
+}
+
+#define SEG_ARRAY_IDX(ary,i,type)	(*((type *)seg_array_idx(ary, i)))
+#define SEG_ARRAY_PUSH(ary,type)	(*((type *)seg_array_push(ary)))
+
+#endif
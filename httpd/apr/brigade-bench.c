@@ -0,0 +1,150 @@
+#include <apr-1.0/apr_general.h>
+#include <apr-1.0/apr_buckets.h>
+#include <apr-1.0/apr_strings.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "brigade_vec.h"
+
+/*
+ * header (heap) + file + trailer (immortal) per response, written to a
+ * socketpair that a child process drains:
+ *
+ *   pflatten: apr_brigade_pflatten() + write(), like brigade.c, with the
+ *             file read() and not mmap()ed (APR would below APR_MMAP_LIMIT)
+ *   writev:   brigade_writev(), writev() for memory and sendfile() for the file
+ *
+ * gcc -O2 brigade-bench.c brigade_vec.c -o brigade-bench -laprutil-1 -lapr-1
+ * ./brigade-bench [file-bytes] [responses]
+ */
+
+#define HEADER	"HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n" \
+				"Connection: keep-alive\r\n\r\n"
+#define TRAILER	"\r\n"
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static apr_status_t write_all(int sock, const char *buf, apr_size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(sock, buf, len);
+		if (n < 0) {
+			return APR_FROM_OS_ERROR(errno);
+		}
+		buf += n;
+		len -= n;
+	}
+	return APR_SUCCESS;
+}
+
+static apr_bucket_brigade *make_response(apr_pool_t *p, apr_bucket_alloc_t *list, apr_file_t *fd, apr_size_t file_len,
+										 int enable_mmap)
+{
+	apr_bucket_brigade *bb = apr_brigade_create(p, list);
+	char *header = apr_pstrdup(p, HEADER);
+	apr_bucket *file;
+
+	APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_heap_create(header, strlen(header), NULL, list));
+	file = apr_bucket_file_create(fd, 0, file_len, p, list);
+	apr_bucket_file_enable_mmap(file, enable_mmap);
+	APR_BRIGADE_INSERT_TAIL(bb, file);
+	APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create(TRAILER, strlen(TRAILER), list));
+	APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(list));
+	return bb;
+}
+
+static void run(const char *name, int use_writev, int sock, apr_pool_t *pool,
+				apr_file_t *fd, apr_size_t file_len, int responses)
+{
+	apr_size_t total = 0, copied = 0;
+	double t = now_ns();
+	int i;
+
+	for (i = 0; i < responses; i++) {
+		apr_pool_t *p;
+		apr_bucket_alloc_t *list;
+		apr_bucket_brigade *bb;
+		apr_size_t len, c;
+
+		apr_pool_create(&p, pool);
+		list = apr_bucket_alloc_create(p);
+		/* pflatten counts a read() of the file, so it must not be mmap()ed */
+		bb = make_response(p, list, fd, file_len, use_writev);
+
+		if (use_writev) {
+			brigade_writev(sock, bb, p, &len, &c);
+			copied += c;
+		} else {
+			char *all;
+			apr_brigade_pflatten(bb, &all, &len, p);
+			write_all(sock, all, len);
+			/* read() of the file into heap buckets, then memcpy() of everything */
+			copied += file_len + len;
+		}
+		total += len;
+		apr_pool_destroy(p);
+	}
+
+	t = now_ns() - t;
+	printf("%-10s %12zu %16zu %12.1f %10.1f\n", name, total / responses, copied / responses,
+		t / responses / 1000, total / t * 1e9 / (1 << 20));
+}
+
+int main(int argc, char *argv[])
+{
+	apr_size_t file_len = argc > 1 ? atol(argv[1]) : 1 << 20;
+	int responses = argc > 2 ? atoi(argv[2]) : 1000;
+	char path[] = "/tmp/brigade-bench-XXXXXX";
+	int sv[2];
+	pid_t pid;
+
+	/* the body file */
+	int tmp = mkstemp(path);
+	char *data = malloc(file_len);
+	memset(data, 'x', file_len);
+	write_all(tmp, data, file_len);
+	close(tmp);
+	free(data);
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	pid = fork();
+	if (pid == 0) {
+		char buf[65536];
+		close(sv[0]);
+		while (read(sv[1], buf, sizeof(buf)) > 0);
+		_exit(0);
+	}
+	close(sv[1]);
+
+	apr_initialize();
+
+	apr_pool_t *pool;
+	apr_pool_create(&pool, NULL);
+
+	apr_file_t *fd;
+	if (apr_file_open(&fd, path, APR_READ | APR_BINARY | APR_SENDFILE_ENABLED, 0, pool) != APR_SUCCESS) {
+		perror("apr_file_open");
+		return 1;
+	}
+
+	printf("%-10s %12s %16s %12s %10s\n", "path", "bytes/resp", "copied/resp", "us/resp", "MB/s");
+	run("pflatten", 0, sv[0], pool, fd, file_len, responses);
+	run("writev", 1, sv[0], pool, fd, file_len, responses);
+
+	close(sv[0]);
+	waitpid(pid, NULL, 0);
+	unlink(path);
+
+	apr_pool_destroy(pool);
+	apr_terminate();
+	return 0;
+}
@@ -0,0 +1,183 @@
+#include "brigade_vec.h"
+#include <apr-1.0/apr_portable.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_IOVEC_TO_WRITE	64
+
+apr_status_t brigade_vec_gather(apr_bucket_brigade *bb, apr_pool_t *p,
+								brigade_vec_t **vec, int *nvec, apr_size_t *copied)
+{
+	apr_bucket *e;
+	int n = 0, nalloc = 0;
+
+	*copied = 0;
+	for (e = APR_BRIGADE_FIRST(bb); e != APR_BRIGADE_SENTINEL(bb); e = APR_BUCKET_NEXT(e)) {
+		nalloc++;
+	}
+	nalloc = nalloc ? nalloc : 1;
+	*vec = apr_palloc(p, sizeof(brigade_vec_t) * nalloc);
+
+	for (e = APR_BRIGADE_FIRST(bb); e != APR_BRIGADE_SENTINEL(bb); e = APR_BUCKET_NEXT(e)) {
+		brigade_vec_t *v;
+		apr_status_t rv;
+		const char *str;
+		apr_size_t len;
+		int in_memory;
+
+		if (APR_BUCKET_IS_EOS(e)) {
+			break;
+		}
+		if (APR_BUCKET_IS_METADATA(e)) {
+			continue;
+		}
+
+		/* reading a pipe or socket bucket inserts the rest of it as a new bucket */
+		if (n == nalloc) {
+			brigade_vec_t *grown = apr_palloc(p, sizeof(brigade_vec_t) * nalloc * 2);
+			memcpy(grown, *vec, sizeof(brigade_vec_t) * nalloc);
+			*vec = grown;
+			nalloc *= 2;
+		}
+		v = &(*vec)[n];
+
+		if (APR_BUCKET_IS_FILE(e)) {
+			apr_bucket_file *f = e->data;
+			apr_os_file_t fd;
+
+			if (e->length == 0) {
+				continue;
+			}
+			rv = apr_os_file_get(&fd, f->fd);
+			if (rv != APR_SUCCESS) {
+				return rv;
+			}
+			v->type = BRIGADE_VEC_FILE;
+			v->u.file.fd = fd;
+			v->u.file.offset = e->start;
+			v->u.file.len = e->length;
+			n++;
+			continue;
+		}
+
+		/* these hand out their own memory; anything else morphs into a heap
+		 * bucket on read, which is a copy */
+		in_memory = APR_BUCKET_IS_HEAP(e) || APR_BUCKET_IS_IMMORTAL(e) || APR_BUCKET_IS_POOL(e)
+					|| APR_BUCKET_IS_TRANSIENT(e) || APR_BUCKET_IS_MMAP(e);
+
+		rv = apr_bucket_read(e, &str, &len, APR_BLOCK_READ);
+		if (rv != APR_SUCCESS) {
+			return rv;
+		}
+		if (!in_memory) {
+			*copied += len;
+		}
+		if (len == 0) {
+			continue;
+		}
+		v->type = BRIGADE_VEC_MEM;
+		v->u.iov.iov_base = (void *)str;
+		v->u.iov.iov_len = len;
+		n++;
+	}
+
+	*nvec = n;
+	return APR_SUCCESS;
+}
+
+static apr_status_t write_iovec(int sock, struct iovec *iov, int niov, apr_size_t *written)
+{
+	while (niov > 0) {
+		ssize_t n = writev(sock, iov, niov);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return APR_FROM_OS_ERROR(errno);
+		}
+		*written += n;
+
+		/* skip what went out, a partial write leaves us inside an iovec */
+		while (niov > 0 && (apr_size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if (niov > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return APR_SUCCESS;
+}
+
+static apr_status_t write_file(int sock, int fd, apr_off_t offset, apr_size_t len, apr_size_t *written)
+{
+	off_t off = offset;
+
+	while (len > 0) {
+		ssize_t n = sendfile(sock, fd, &off, len);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return APR_FROM_OS_ERROR(errno);
+		}
+		if (n == 0) {
+			/* file shorter than the bucket says */
+			return APR_EOF;
+		}
+		*written += n;
+		len -= n;
+	}
+	return APR_SUCCESS;
+}
+
+apr_status_t brigade_vec_write(int sock, const brigade_vec_t *vec, int nvec, apr_size_t *written)
+{
+	struct iovec iov[MAX_IOVEC_TO_WRITE];
+	apr_status_t rv;
+	int i = 0;
+
+	*written = 0;
+	while (i < nvec) {
+		if (vec[i].type == BRIGADE_VEC_FILE) {
+			rv = write_file(sock, vec[i].u.file.fd, vec[i].u.file.offset, vec[i].u.file.len, written);
+			if (rv != APR_SUCCESS) {
+				return rv;
+			}
+			i++;
+			continue;
+		}
+
+		/* one writev() for a run of memory entries */
+		int niov = 0;
+		while (i < nvec && vec[i].type == BRIGADE_VEC_MEM && niov < MAX_IOVEC_TO_WRITE) {
+			iov[niov++] = vec[i++].u.iov;
+		}
+		rv = write_iovec(sock, iov, niov, written);
+		if (rv != APR_SUCCESS) {
+			return rv;
+		}
+	}
+	return APR_SUCCESS;
+}
+
+apr_status_t brigade_writev(int sock, apr_bucket_brigade *bb, apr_pool_t *p,
+							apr_size_t *written, apr_size_t *copied)
+{
+	brigade_vec_t *vec;
+	int nvec;
+	apr_status_t rv;
+
+	*written = 0;
+	rv = brigade_vec_gather(bb, p, &vec, &nvec, copied);
+	if (rv != APR_SUCCESS) {
+		return rv;
+	}
+	return brigade_vec_write(sock, vec, nvec, written);
+}
@@ -0,0 +1,51 @@
+#ifndef BRIGADE_VEC_H
+#define BRIGADE_VEC_H
+
+#include <apr-1.0/apr_buckets.h>
+#include <sys/uio.h>
+
+/*
+ * Gather a brigade into iovecs and file ranges instead of flattening it.
+ *
+ * apr_brigade_pflatten() copies every bucket into one pool buffer. A file
+ * bucket is mmap()ed first if it is below APR_MMAP_LIMIT and mmap is
+ * enabled on it (the default), else read() into a heap bucket, so file
+ * bytes are copied once or twice before the write. Here heap / immortal / pool / transient / mmap
+ * buckets are pointed to as they are, file buckets stay (fd, offset, len)
+ * and go out with sendfile(). Only buckets that have to be read to know
+ * their content (pipe, socket, ...) are copied, and those bytes are counted.
+ */
+
+typedef enum {
+	BRIGADE_VEC_MEM,
+	BRIGADE_VEC_FILE
+} brigade_vec_type_e;
+
+typedef struct {
+	brigade_vec_type_e type;
+	union {
+		struct iovec iov;
+		struct {
+			int fd;
+			apr_off_t offset;
+			apr_size_t len;
+		} file;
+	} u;
+} brigade_vec_t;
+
+/*
+ * Map the brigade up to the first EOS into *vec (allocated from p).
+ * *copied is the number of bytes that had to go through a read() or
+ * memcpy() to get there.
+ */
+apr_status_t brigade_vec_gather(apr_bucket_brigade *bb, apr_pool_t *p,
+								brigade_vec_t **vec, int *nvec, apr_size_t *copied);
+
+/* writev() runs of memory entries, sendfile() file entries, until all is written */
+apr_status_t brigade_vec_write(int sock, const brigade_vec_t *vec, int nvec, apr_size_t *written);
+
+/* brigade_vec_gather() + brigade_vec_write() */
+apr_status_t brigade_writev(int sock, apr_bucket_brigade *bb, apr_pool_t *p,
+							apr_size_t *written, apr_size_t *copied);
+
+#endif
@@ -0,0 +1,97 @@
+#include <apr-1.0/apr_general.h>
+#include <apr-1.0/apr_buckets.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "bucket_cache.h"
+
+/*
+ * N threads, each with its own pool and apr_bucket_alloc_t like an httpd
+ * worker with its connection, create brigades of heap buckets + EOS and
+ * clean them up, over and over. Run once with the cache off, once on.
+ *
+ * gcc -O2 bucket-cache-bench.c bucket_cache.c -o bucket-cache-bench -laprutil-1 -lapr-1 -lpthread -ldl
+ * ./bucket-cache-bench [threads] [rounds-per-thread]
+ */
+
+#define BUCKETS_PER_BRIGADE	16
+
+static int rounds;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *worker(void *arg)
+{
+	static const char data[512] = "0123456789";
+	apr_pool_t *pool;
+	apr_bucket_alloc_t *list;
+	apr_bucket_brigade *bb;
+	int i, k;
+
+	apr_pool_create(&pool, NULL);
+	list = apr_bucket_alloc_create(pool);
+	bb = apr_brigade_create(pool, list);
+
+	for (i = 0; i < rounds; i++) {
+		for (k = 0; k < BUCKETS_PER_BRIGADE; k++) {
+			/* header sized copies, from a few bytes up to a few hundred */
+			apr_size_t len = (i + k * 37) % sizeof(data) + 1;
+			APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_heap_create(data, len, NULL, list));
+		}
+		APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(list));
+		apr_brigade_cleanup(bb);
+	}
+
+	apr_pool_destroy(pool);
+	return NULL;
+}
+
+static void run(const char *name, int nthreads)
+{
+	pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+	double buckets = (double)nthreads * rounds * (BUCKETS_PER_BRIGADE + 1);
+	bucket_cache_stats_t st;
+	double t = now_ns();
+	int i;
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], NULL, worker, NULL);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	t = now_ns() - t;
+
+	bucket_cache_stats(&st);
+	printf("%-6s %8d %12.2f %10.1f %12llu %12llu %12llu %10llu\n",
+		name, nthreads, buckets / t * 1e3, t / buckets,
+		(unsigned long long)st.hits, (unsigned long long)st.misses,
+		(unsigned long long)st.passthrough, (unsigned long long)st.released);
+	free(threads);
+}
+
+int main(int argc, char *argv[])
+{
+	int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+	rounds = argc > 2 ? atoi(argv[2]) : 200000;
+
+	apr_initialize();
+
+	printf("%-6s %8s %12s %10s %12s %12s %12s %10s\n",
+		"cache", "threads", "Mbuckets/s", "ns/bucket", "hits", "misses", "passthrough", "released");
+
+	/* counters are cumulative: "off" only counts passthrough */
+	bucket_cache_enable(0);
+	run("off", nthreads);
+	bucket_cache_enable(1);
+	run("on", nthreads);
+
+	apr_terminate();
+	return 0;
+}
@@ -0,0 +1,171 @@
+#include <apr-1.0/apr_general.h>
+#include <apr-1.0/apr_buckets.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "bucket_mmap.h"
+#include "brigade_vec.h"
+
+/*
+ * CPU seconds per GB served from one large file, written to a socketpair
+ * that a child process drains:
+ *
+ *   read:     apr_bucket_read() on the file bucket, 8 KB heap buckets
+ *   mmap:     brigade_mmap_files(), then apr_bucket_read() on mmap buckets
+ *   sendfile: brigade_writev() (see brigade_vec.c)
+ *
+ * gcc -O2 bucket-mmap-bench.c bucket_mmap.c brigade_vec.c -o bucket-mmap-bench -laprutil-1 -lapr-1
+ * ./bucket-mmap-bench [file-MB] [passes]
+ */
+
+typedef enum { MODE_READ, MODE_MMAP, MODE_SENDFILE } mode_e;
+
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_all(int sock, const char *buf, apr_size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(sock, buf, len);
+		if (n < 0 && errno != EINTR) {
+			perror("write");
+			exit(1);
+		}
+		if (n > 0) {
+			buf += n;
+			len -= n;
+		}
+	}
+}
+
+/* what the core output filter does with a brigade: read, write, delete */
+static apr_size_t serve_by_read(int sock, apr_bucket_brigade *bb)
+{
+	apr_size_t total = 0;
+
+	while (!APR_BRIGADE_EMPTY(bb)) {
+		apr_bucket *e = APR_BRIGADE_FIRST(bb);
+		const char *str;
+		apr_size_t len;
+
+		if (apr_bucket_read(e, &str, &len, APR_BLOCK_READ) != APR_SUCCESS) {
+			break;
+		}
+		write_all(sock, str, len);
+		total += len;
+		apr_bucket_delete(e);
+	}
+	return total;
+}
+
+static void run(const char *name, mode_e mode, int sock, apr_pool_t *pool,
+				apr_file_t *fd, apr_size_t file_len, int passes)
+{
+	apr_size_t total = 0;
+	double cpu = cpu_seconds();
+	double wall = now_seconds();
+	int i;
+
+	for (i = 0; i < passes; i++) {
+		apr_pool_t *p;
+		apr_bucket_alloc_t *list;
+		apr_bucket_brigade *bb;
+		apr_size_t written, copied;
+
+		apr_pool_create(&p, pool);
+		list = apr_bucket_alloc_create(p);
+		bb = apr_brigade_create(p, list);
+		APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_file_create(fd, 0, file_len, p, list));
+
+		switch (mode) {
+		case MODE_READ:
+			/* APR would mmap files below APR_MMAP_LIMIT itself */
+			apr_bucket_file_enable_mmap(APR_BRIGADE_FIRST(bb), 0);
+			total += serve_by_read(sock, bb);
+			break;
+		case MODE_MMAP:
+			brigade_mmap_files(bb, BUCKET_MMAP_MIN_LEN, BUCKET_MMAP_CHUNK);
+			total += serve_by_read(sock, bb);
+			break;
+		case MODE_SENDFILE:
+			brigade_writev(sock, bb, p, &written, &copied);
+			total += written;
+			break;
+		}
+		apr_pool_destroy(p);
+	}
+
+	cpu = cpu_seconds() - cpu;
+	wall = now_seconds() - wall;
+	printf("%-10s %10.2f %14.3f %10.1f\n", name, total / 1e9, cpu / (total / 1e9), total / wall / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	apr_size_t file_len = (argc > 1 ? atol(argv[1]) : 64) << 20;
+	int passes = argc > 2 ? atoi(argv[2]) : 16;
+	char path[] = "/tmp/bucket-mmap-bench-XXXXXX";
+	char block[65536];
+	apr_size_t left;
+	int sv[2];
+	pid_t pid;
+
+	int tmp = mkstemp(path);
+	memset(block, 'x', sizeof(block));
+	for (left = file_len; left > 0; left -= left < sizeof(block) ? left : sizeof(block)) {
+		write_all(tmp, block, left < sizeof(block) ? left : sizeof(block));
+	}
+	close(tmp);
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		while (read(sv[1], block, sizeof(block)) > 0);
+		_exit(0);
+	}
+	close(sv[1]);
+
+	apr_initialize();
+
+	apr_pool_t *pool;
+	apr_pool_create(&pool, NULL);
+
+	apr_file_t *fd;
+	if (apr_file_open(&fd, path, APR_READ | APR_BINARY | APR_SENDFILE_ENABLED, 0, pool) != APR_SUCCESS) {
+		perror("apr_file_open");
+		return 1;
+	}
+
+	printf("%-10s %10s %14s %10s\n", "mode", "GB", "cpu s/GB", "MB/s");
+	/* page cache warm for every mode */
+	run("warmup", MODE_READ, sv[0], pool, fd, file_len, 1);
+	run("read", MODE_READ, sv[0], pool, fd, file_len, passes);
+	run("mmap", MODE_MMAP, sv[0], pool, fd, file_len, passes);
+	run("sendfile", MODE_SENDFILE, sv[0], pool, fd, file_len, passes);
+
+	close(sv[0]);
+	waitpid(pid, NULL, 0);
+	unlink(path);
+
+	apr_pool_destroy(pool);
+	apr_terminate();
+	return 0;
+}
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include "bucket_cache.h"
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#define HEADER_SIZE			16		/* keeps blocks 16 byte aligned */
+#define CLASS_PASSTHROUGH	(-1)
+#define CLASS_SIZE(cls)		((apr_size_t)64 << (cls))
+
+/* written by the owning thread only, read by bucket_cache_stats() */
+#define COUNT(field)		__atomic_store_n(&(field), (field) + 1, __ATOMIC_RELAXED)
+#define SET(field, v)		__atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+#define GET(field)			__atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+typedef union {
+	int cls;
+	char pad[HEADER_SIZE];
+} header_t;
+
+/* a cached block reuses its payload as the list link */
+typedef struct block_t {
+	struct block_t *next;
+} block_t;
+
+typedef struct cache_t {
+	block_t *free[BUCKET_CACHE_CLASSES];
+	int depth[BUCKET_CACHE_CLASSES];
+	apr_uint64_t hits;
+	apr_uint64_t misses;
+	apr_uint64_t passthrough;
+	apr_uint64_t released;
+	struct cache_t *prev, *next;
+} cache_t;
+
+static void *(*real_alloc)(apr_size_t size, apr_bucket_alloc_t *list);
+static void (*real_free)(void *block);
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_t *caches;					/* live threads */
+static bucket_cache_stats_t retired;	/* counters of exited threads */
+
+static int enabled = 1;
+static int max_depth = BUCKET_CACHE_DEPTH;
+
+static __thread cache_t *tls_cache;
+
+static void flush(cache_t *c)
+{
+	int cls;
+
+	for (cls = 0; cls < BUCKET_CACHE_CLASSES; cls++) {
+		while (c->free[cls]) {
+			block_t *b = c->free[cls];
+			c->free[cls] = b->next;
+			free((header_t *)b - 1);
+		}
+		SET(c->depth[cls], 0);
+	}
+}
+
+static void cache_destroy(void *data)
+{
+	cache_t *c = data;
+
+	pthread_mutex_lock(&caches_lock);
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		caches = c->next;
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	}
+	retired.hits += c->hits;
+	retired.misses += c->misses;
+	retired.passthrough += c->passthrough;
+	retired.released += c->released;
+	pthread_mutex_unlock(&caches_lock);
+
+	flush(c);
+	free(c);
+	tls_cache = NULL;
+}
+
+static void init(void)
+{
+	real_alloc = dlsym(RTLD_NEXT, "apr_bucket_alloc");
+	real_free = dlsym(RTLD_NEXT, "apr_bucket_free");
+	pthread_key_create(&cache_key, cache_destroy);
+}
+
+static cache_t *get_cache(void)
+{
+	cache_t *c = tls_cache;
+
+	if (c) {
+		return c;
+	}
+
+	pthread_once(&init_once, init);
+	c = calloc(1, sizeof(cache_t));
+
+	pthread_mutex_lock(&caches_lock);
+	c->next = caches;
+	if (caches) {
+		caches->prev = c;
+	}
+	caches = c;
+	pthread_mutex_unlock(&caches_lock);
+
+	pthread_setspecific(cache_key, c);
+	tls_cache = c;
+	return c;
+}
+
+static APR_INLINE int size_class(apr_size_t size)
+{
+	return size <= 64 ? 0 : 64 - __builtin_clzll(size - 1) - 6;
+}
+
+void *apr_bucket_alloc(apr_size_t size, apr_bucket_alloc_t *list)
+{
+	cache_t *c = get_cache();
+	header_t *h;
+	int cls;
+
+	if (!enabled || size > BUCKET_CACHE_MAX_SIZE) {
+		h = real_alloc(size + HEADER_SIZE, list);
+		if (!h) {
+			return NULL;
+		}
+		h->cls = CLASS_PASSTHROUGH;
+		COUNT(c->passthrough);
+		return h + 1;
+	}
+
+	cls = size_class(size);
+	if (c->free[cls]) {
+		block_t *b = c->free[cls];
+		c->free[cls] = b->next;
+		SET(c->depth[cls], c->depth[cls] - 1);
+		COUNT(c->hits);
+		return b;
+	}
+
+	h = malloc(HEADER_SIZE + CLASS_SIZE(cls));
+	if (!h) {
+		return NULL;
+	}
+	h->cls = cls;
+	COUNT(c->misses);
+	return h + 1;
+}
+
+void apr_bucket_free(void *mem)
+{
+	header_t *h = (header_t *)mem - 1;
+	cache_t *c;
+	int cls = h->cls;
+
+	if (cls == CLASS_PASSTHROUGH) {
+		real_free(h);
+		return;
+	}
+
+	c = get_cache();
+	if (c->depth[cls] < max_depth) {
+		block_t *b = mem;
+		b->next = c->free[cls];
+		c->free[cls] = b;
+		SET(c->depth[cls], c->depth[cls] + 1);
+		return;
+	}
+	COUNT(c->released);
+	free(h);
+}
+
+void bucket_cache_enable(int on)
+{
+	enabled = on;
+}
+
+void bucket_cache_set_depth(int depth)
+{
+	max_depth = depth;
+}
+
+void bucket_cache_flush(void)
+{
+	if (tls_cache) {
+		flush(tls_cache);
+	}
+}
+
+void bucket_cache_stats(bucket_cache_stats_t *stats)
+{
+	cache_t *c;
+	int cls;
+
+	pthread_mutex_lock(&caches_lock);
+	*stats = retired;
+	stats->bytes_cached = 0;
+	stats->blocks_cached = 0;
+	stats->threads = 0;
+	for (c = caches; c; c = c->next) {
+		stats->hits += GET(c->hits);
+		stats->misses += GET(c->misses);
+		stats->passthrough += GET(c->passthrough);
+		stats->released += GET(c->released);
+		for (cls = 0; cls < BUCKET_CACHE_CLASSES; cls++) {
+			int depth = GET(c->depth[cls]);
+			stats->blocks_cached += depth;
+			stats->bytes_cached += depth * CLASS_SIZE(cls);
+		}
+		stats->threads++;
+	}
+	pthread_mutex_unlock(&caches_lock);
+}
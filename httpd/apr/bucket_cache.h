@@ -0,0 +1,46 @@
+#ifndef BUCKET_CACHE_H
+#define BUCKET_CACHE_H
+
+#include <apr-1.0/apr_buckets.h>
+
+/*
+ * Per-thread caching front end for apr_bucket_alloc() / apr_bucket_free().
+ *
+ * Linking bucket_cache.c into a program interposes both functions, so every
+ * bucket, brigade helper and heap bucket buffer that aprutil allocates goes
+ * through here. Requests up to BUCKET_CACHE_MAX_SIZE are served from
+ * size-classed free lists owned by the calling thread (no lock); a miss
+ * mallocs a new block. A freed block goes back on the current thread's list
+ * unless that list already holds the depth limit, then it is free()d.
+ * Larger requests are passed to the real apr_bucket_alloc().
+ *
+ * Cached blocks do not belong to any apr_bucket_alloc_t, so buckets must be
+ * deleted (apr_brigade_cleanup() / apr_bucket_delete()) rather than left for
+ * apr_bucket_alloc_destroy(), which is what brigades do on pool cleanup.
+ */
+
+#define BUCKET_CACHE_CLASSES	8		/* 64, 128, ... 8192 bytes */
+#define BUCKET_CACHE_MAX_SIZE	8192
+#define BUCKET_CACHE_DEPTH		64		/* default blocks kept per class per thread */
+
+typedef struct {
+	apr_uint64_t hits;			/* served from a free list */
+	apr_uint64_t misses;		/* malloc()ed */
+	apr_uint64_t passthrough;	/* larger than BUCKET_CACHE_MAX_SIZE */
+	apr_uint64_t released;		/* free()d because the list was full */
+	apr_uint64_t bytes_cached;	/* currently sitting on free lists */
+	apr_uint64_t blocks_cached;
+	int threads;				/* threads with a live cache */
+} bucket_cache_stats_t;
+
+/* 0 turns the cache off: everything is passed to aprutil, for comparison */
+void bucket_cache_enable(int on);
+void bucket_cache_set_depth(int depth);
+
+/* sum over live threads and threads that already exited (counters only) */
+void bucket_cache_stats(bucket_cache_stats_t *stats);
+
+/* free the calling thread's cached blocks now instead of at thread exit */
+void bucket_cache_flush(void);
+
+#endif
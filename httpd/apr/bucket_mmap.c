@@ -0,0 +1,83 @@
+#include "bucket_mmap.h"
+#include <apr-1.0/apr_mmap.h>
+#include <apr-1.0/apr_portable.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void advise_read(apr_bucket *e)
+{
+	apr_bucket_file *f = e->data;
+	apr_os_file_t fd;
+
+	if (apr_os_file_get(&fd, f->fd) == APR_SUCCESS) {
+		posix_fadvise(fd, e->start, e->length, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(fd, e->start, e->length, POSIX_FADV_WILLNEED);
+	}
+}
+
+/*
+ * Insert mmap buckets before e, one per chunk-aligned window of the file,
+ * and shrink e by what got mapped. On failure e keeps the unmapped rest.
+ */
+static apr_status_t map_file_bucket(apr_bucket *e, apr_size_t chunk)
+{
+	apr_bucket_file *f = e->data;
+
+	while (e->length > 0) {
+		apr_off_t map_off = e->start - e->start % chunk;
+		apr_size_t len = map_off + chunk - e->start;
+		apr_size_t map_len;
+		apr_mmap_t *mm;
+		apr_bucket *b;
+		apr_status_t rv;
+
+		if (len > e->length) {
+			len = e->length;
+		}
+		map_len = e->start - map_off + len;
+
+		rv = apr_mmap_create(&mm, f->fd, map_off, map_len, APR_MMAP_READ, f->readpool);
+		if (rv != APR_SUCCESS) {
+			return rv;
+		}
+		madvise(mm->mm, map_len, MADV_SEQUENTIAL);
+		madvise(mm->mm, map_len, MADV_WILLNEED);
+
+		/* the mmap bucket owns mm and apr_mmap_delete()s it when destroyed */
+		b = apr_bucket_mmap_create(mm, e->start - map_off, len, e->list);
+		APR_BUCKET_INSERT_BEFORE(e, b);
+
+		e->start += len;
+		e->length -= len;
+	}
+	return APR_SUCCESS;
+}
+
+apr_status_t brigade_mmap_files(apr_bucket_brigade *bb, apr_size_t min_len, apr_size_t chunk)
+{
+	apr_size_t page = sysconf(_SC_PAGESIZE);
+	apr_bucket *e, *next;
+
+	chunk = (chunk + page - 1) / page * page;
+
+	for (e = APR_BRIGADE_FIRST(bb); e != APR_BRIGADE_SENTINEL(bb); e = next) {
+		apr_bucket_file *f;
+
+		next = APR_BUCKET_NEXT(e);
+		if (!APR_BUCKET_IS_FILE(e) || e->length < min_len) {
+			continue;
+		}
+
+		f = e->data;
+		if (f->can_mmap) {
+			map_file_bucket(e, chunk);
+		}
+		if (e->length == 0) {
+			apr_bucket_delete(e);
+		} else {
+			advise_read(e);
+		}
+	}
+	return APR_SUCCESS;
+}
@@ -0,0 +1,26 @@
+#ifndef BUCKET_MMAP_H
+#define BUCKET_MMAP_H
+
+#include <apr-1.0/apr_buckets.h>
+
+/*
+ * Serve large file buckets from mmap() instead of read().
+ *
+ * A file bucket read() pulls APR_BUCKET_BUFF_SIZE bytes at a time into a new
+ * heap bucket, and APR's own mmap path stops at APR_MMAP_LIMIT (4 MB).
+ * brigade_mmap_files() replaces every file bucket of at least min_len bytes
+ * with mmap buckets of at most chunk bytes, split on chunk-aligned file
+ * offsets (chunk is rounded to the page size), with MADV_SEQUENTIAL and
+ * MADV_WILLNEED on each mapping.
+ *
+ * Buckets that can not be mapped (can_mmap off, mmap() failing) stay file
+ * buckets, with POSIX_FADV_SEQUENTIAL / POSIX_FADV_WILLNEED so the read()
+ * fallback gets readahead too.
+ */
+
+#define BUCKET_MMAP_MIN_LEN		(256 * 1024)
+#define BUCKET_MMAP_CHUNK		(4 * 1024 * 1024)
+
+apr_status_t brigade_mmap_files(apr_bucket_brigade *bb, apr_size_t min_len, apr_size_t chunk);
+
+#endif
@@ -0,0 +1,145 @@
+#include <apr-1.0/apr_general.h>
+#include <apr-1.0/apr_hash.h>
+#include <apr-1.0/apr_strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "swiss_hash.h"
+
+/*
+ * insert / lookup hit / lookup miss / iterate, apr_hash_t vs swiss_hash_t
+ *
+ * gcc -O2 -msse2 hash-bench.c swiss_hash.c -o hash-bench -lapr-1
+ * ./hash-bench [total-ops]
+ */
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int count_item(void *rec, const void *key, apr_ssize_t klen, const void *value)
+{
+	(*(apr_size_t *)rec) += klen;
+	return 1;
+}
+
+typedef struct {
+	double insert, hit, miss, iterate;
+	unsigned int count;
+} result_t;
+
+/* same body for both tables, so the only difference is the table itself */
+#define DEFINE_BENCH(prefix, type)												\
+static void bench_##prefix(apr_pool_t *pool, char **keys, char **hits, char **misses, int n, int reps, result_t *r)	\
+{																				\
+	apr_pool_t *sub;															\
+	type *ht = NULL;															\
+	apr_size_t sum = 0;															\
+	void *found = NULL;															\
+	double t;																	\
+	int i, rep;																	\
+																				\
+	apr_pool_create(&sub, pool);												\
+																				\
+	t = now_ns();																\
+	for (rep = 0; rep < reps; rep++) {											\
+		apr_pool_clear(sub);													\
+		ht = prefix##_make(sub);												\
+		for (i = 0; i < n; i++) {												\
+			prefix##_set(ht, keys[i], APR_HASH_KEY_STRING, keys[i]);			\
+		}																		\
+	}																			\
+	r->insert = (now_ns() - t) / ((double)n * reps);							\
+	r->count = prefix##_count(ht);												\
+																				\
+	t = now_ns();																\
+	for (rep = 0; rep < reps; rep++) {											\
+		for (i = 0; i < n; i++) {												\
+			found = prefix##_get(ht, hits[i], APR_HASH_KEY_STRING);				\
+			sum += (apr_size_t)found;											\
+		}																		\
+	}																			\
+	r->hit = (now_ns() - t) / ((double)n * reps);								\
+																				\
+	t = now_ns();																\
+	for (rep = 0; rep < reps; rep++) {											\
+		for (i = 0; i < n; i++) {												\
+			found = prefix##_get(ht, misses[i], APR_HASH_KEY_STRING);			\
+			sum += (apr_size_t)found;											\
+		}																		\
+	}																			\
+	r->miss = (now_ns() - t) / ((double)n * reps);								\
+																				\
+	t = now_ns();																\
+	for (rep = 0; rep < reps; rep++) {											\
+		prefix##_do(count_item, &sum, ht);										\
+	}																			\
+	r->iterate = (now_ns() - t) / ((double)n * reps);							\
+																				\
+	if (sum == 1) {																\
+		printf("%p\n", found);	/* keep the loops alive */					\
+	}																			\
+	apr_pool_destroy(sub);														\
+}
+
+DEFINE_BENCH(apr_hash, apr_hash_t)
+DEFINE_BENCH(swiss_hash, swiss_hash_t)
+
+static void print_result(const char *name, int n, result_t *r)
+{
+	printf("%-8d %-12s %10.1f %10.1f %10.1f %12.2f %8u\n",
+		n, name, r->insert, r->hit, r->miss, r->iterate, r->count);
+}
+
+int main(int argc, char *argv[])
+{
+	int sizes[] = {10, 1000, 1000000};
+	long total = argc > 1 ? atol(argv[1]) : 2000000;
+	int s;
+
+	apr_initialize();
+
+	apr_pool_t *pool;
+	apr_pool_create(&pool, NULL);
+
+	printf("%-8s %-12s %10s %10s %10s %12s %8s\n",
+		"entries", "table", "insert ns", "hit ns", "miss ns", "iterate ns", "count");
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int n = sizes[s];
+		int reps = total / n > 1 ? total / n : 1;
+		char **keys = apr_palloc(pool, sizeof(char *) * n);
+		char **hits = apr_palloc(pool, sizeof(char *) * n);
+		char **misses = apr_palloc(pool, sizeof(char *) * n);
+		result_t r;
+		int i;
+
+		/* short keys fit inline in a swiss slot, the same as most header names */
+		for (i = 0; i < n; i++) {
+			keys[i] = apr_psprintf(pool, "key-%d", i);
+			misses[i] = apr_psprintf(pool, "miss-%d", i);
+		}
+		/* look keys up in random order, insertion order would let apr_hash
+		 * walk its pool-allocated entries sequentially */
+		memcpy(hits, keys, sizeof(char *) * n);
+		srand(n);
+		for (i = n - 1; i > 0; i--) {
+			int j = rand() % (i + 1);
+			char *tmp = hits[i];
+			hits[i] = hits[j];
+			hits[j] = tmp;
+		}
+
+		bench_apr_hash(pool, keys, hits, misses, n, reps, &r);
+		print_result("apr_hash", n, &r);
+		bench_swiss_hash(pool, keys, hits, misses, n, reps, &r);
+		print_result("swiss_hash", n, &r);
+	}
+
+	apr_pool_destroy(pool);
+	apr_terminate();
+	return 0;
+}
@@ -0,0 +1,49 @@
+#include <apr-1.0/apr_general.h>
+#include <apr-1.0/apr_pools.h>
+#include <apr-1.0/apr_strings.h>
+#include <stdio.h>
+#include "pool_stats.h"
+
+/*
+ * gcc -DPOOL_STATS -I/usr/include/apr-1.0 pool-stats.c pool_stats.c -o pool-stats -lapr-1 -lpthread
+ *
+ * A "connection" pool with short-lived "request" sub pools, the request
+ * pools grow with the request number like pools that build big responses.
+ */
+
+int main(void)
+{
+	apr_initialize();
+
+	apr_pool_t *pool;
+	apr_pool_create(&pool, NULL);
+	POOL_STATS_TAG(pool, "connection");
+	apr_pstrdup(pool, "127.0.0.1");
+
+	int i, j;
+	for (i = 0; i < 1000; i++) {
+		apr_pool_t *r;
+		apr_pool_create(&r, pool);
+		POOL_STATS_TAG(r, "request");
+
+		char *uri = apr_psprintf(r, "/index.php?id=%d", i);
+		apr_pstrdup(r, uri);
+		for (j = 0; j < i % 64; j++) {
+			apr_palloc(r, 1024);
+		}
+		if (i % 100 == 0) {
+			apr_pcalloc(r, 256 * 1024);
+		}
+
+		apr_pool_destroy(r);
+	}
+
+	pool_stats_t *st = pool_stats_get(pool);
+	printf("connection pool: bytes = %zu, allocs = %zu, blocks = %zu\n", st->bytes, st->allocs, st->blocks);
+
+	apr_pool_destroy(pool);
+	pool_stats_dump(stdout);
+
+	apr_terminate();
+	return 0;
+}
@@ -0,0 +1,291 @@
+#define POOL_STATS_IMPL
+#include "pool_stats.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NODE_SIZE		8192	/* APR's MIN_ALLOC */
+#define NODE_HEADER		64		/* apr_memnode_t, rounded up */
+#define POOL_HEADER		128		/* apr_pool_t lives in its first node */
+#define HIST_BUCKETS	40
+#define MAX_TAGS		64
+#define SITE_TABLE		1024	/* power of 2 */
+#define TOP_SITES		20
+
+typedef struct {
+	const char *tag;
+	apr_uint64_t pools;
+	apr_uint64_t bytes;
+	apr_uint64_t allocs;
+	apr_uint64_t blocks;
+	apr_size_t high_water;
+	apr_uint64_t hist[HIST_BUCKETS];	/* pools of [2^i, 2^(i+1)) bytes */
+} tag_total_t;
+
+typedef struct {
+	const char *site;
+	apr_uint64_t bytes;
+} site_total_t;
+
+static const char *const stats_key = "pool_stats";
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static tag_total_t tags[MAX_TAGS];
+static int ntags;
+static site_total_t sites[SITE_TABLE];
+static int nsites;
+static apr_uint64_t other_bytes;	/* per-pool overflow and site table overflow */
+
+static void dump_at_exit(void)
+{
+	pool_stats_dump(stderr);
+}
+
+static void init(void)
+{
+	atexit(dump_at_exit);
+}
+
+static int log2_bucket(apr_size_t n)
+{
+	int b = n ? 63 - __builtin_clzll(n) : 0;
+	return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+static tag_total_t *find_tag(const char *tag)
+{
+	int i;
+
+	for (i = 0; i < ntags; i++) {
+		if (tags[i].tag == tag || strcmp(tags[i].tag, tag) == 0) {
+			return &tags[i];
+		}
+	}
+	if (ntags == MAX_TAGS) {
+		return NULL;
+	}
+	tags[ntags].tag = tag;
+	return &tags[ntags++];
+}
+
+/* sites are string literals, so the pointer is the key */
+static void add_site(const char *site, apr_uint64_t bytes)
+{
+	unsigned int i = (unsigned int)(((apr_uintptr_t)site >> 3) * 2654435761U) & (SITE_TABLE - 1);
+
+	while (sites[i].site && sites[i].site != site) {
+		i = (i + 1) & (SITE_TABLE - 1);
+	}
+	if (!sites[i].site) {
+		if (nsites >= SITE_TABLE * 3 / 4) {
+			other_bytes += bytes;
+			return;
+		}
+		sites[i].site = site;
+		nsites++;
+	}
+	sites[i].bytes += bytes;
+}
+
+/* runs on apr_pool_clear() and apr_pool_destroy(), before the memory goes */
+static apr_status_t pool_stats_cleanup(void *data)
+{
+	pool_stats_t *st = data;
+	tag_total_t *t;
+	int i;
+
+	pthread_mutex_lock(&totals_lock);
+	t = find_tag(st->tag ? st->tag : "untagged");
+	if (t) {
+		t->pools++;
+		t->bytes += st->bytes;
+		t->allocs += st->allocs;
+		t->blocks += st->blocks;
+		if (st->bytes > t->high_water) {
+			t->high_water = st->bytes;
+		}
+		t->hist[log2_bucket(st->bytes)]++;
+	}
+	for (i = 0; i < POOL_STATS_SITES && st->sites[i].site; i++) {
+		add_site(st->sites[i].site, st->sites[i].bytes);
+	}
+	other_bytes += st->other_bytes;
+	pthread_mutex_unlock(&totals_lock);
+
+	return APR_SUCCESS;
+}
+
+pool_stats_t *pool_stats_get(apr_pool_t *p)
+{
+	pool_stats_t *st;
+	void *data;
+
+	apr_pool_userdata_get(&data, stats_key, p);
+	if (data) {
+		return data;
+	}
+
+	pthread_once(&init_once, init);
+	st = apr_pcalloc(p, sizeof(pool_stats_t));
+	st->blocks = 1;
+	st->node_free = NODE_SIZE - NODE_HEADER - POOL_HEADER;
+	apr_pool_userdata_setn(st, stats_key, pool_stats_cleanup, p);
+	return st;
+}
+
+void pool_stats_tag(apr_pool_t *p, const char *tag)
+{
+	pool_stats_get(p)->tag = tag;
+}
+
+static void record(apr_pool_t *p, apr_size_t size, const char *site)
+{
+	pool_stats_t *st = pool_stats_get(p);
+	apr_size_t aligned = APR_ALIGN_DEFAULT(size);
+	int i;
+
+	st->bytes += size;
+	st->allocs++;
+
+	/* a request that does not fit gets a new node: 8 KB, or page rounded */
+	if (aligned > st->node_free) {
+		apr_size_t node = (aligned + NODE_HEADER + 4095) & ~(apr_size_t)4095;
+		if (node < NODE_SIZE) {
+			node = NODE_SIZE;
+		}
+		st->blocks++;
+		st->node_free = node - NODE_HEADER - aligned;
+	} else {
+		st->node_free -= aligned;
+	}
+
+	for (i = 0; i < POOL_STATS_SITES; i++) {
+		if (st->sites[i].site == site) {
+			st->sites[i].bytes += size;
+			return;
+		}
+		if (!st->sites[i].site) {
+			st->sites[i].site = site;
+			st->sites[i].bytes = size;
+			return;
+		}
+	}
+	st->other_bytes += size;
+}
+
+void *pool_stats_palloc(apr_pool_t *p, apr_size_t size, const char *site)
+{
+	record(p, size, site);
+	return apr_palloc(p, size);
+}
+
+void *pool_stats_pcalloc(apr_pool_t *p, apr_size_t size, const char *site)
+{
+	record(p, size, site);
+	return apr_pcalloc(p, size);
+}
+
+char *pool_stats_pstrdup(apr_pool_t *p, const char *s, const char *site)
+{
+	if (s) {
+		record(p, strlen(s) + 1, site);
+	}
+	return apr_pstrdup(p, s);
+}
+
+char *pool_stats_pstrndup(apr_pool_t *p, const char *s, apr_size_t n, const char *site)
+{
+	char *res = apr_pstrndup(p, s, n);
+
+	if (res) {
+		record(p, strlen(res) + 1, site);
+	}
+	return res;
+}
+
+void *pool_stats_pmemdup(apr_pool_t *p, const void *m, apr_size_t n, const char *site)
+{
+	if (m) {
+		record(p, n, site);
+	}
+	return apr_pmemdup(p, m, n);
+}
+
+char *pool_stats_psprintf(apr_pool_t *p, const char *site, const char *fmt, ...)
+{
+	va_list ap;
+	char *res;
+
+	va_start(ap, fmt);
+	res = apr_pvsprintf(p, fmt, ap);
+	va_end(ap);
+	if (res) {
+		record(p, strlen(res) + 1, site);
+	}
+	return res;
+}
+
+static apr_size_t percentile(const tag_total_t *t, double q)
+{
+	apr_uint64_t want = (apr_uint64_t)(t->pools * q), seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += t->hist[i];
+		if (seen > want) {
+			return (apr_size_t)2 << i;
+		}
+	}
+	return t->high_water;
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+	const site_total_t *x = a, *y = b;
+	return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+void pool_stats_dump(FILE *out)
+{
+	site_total_t top[SITE_TABLE];
+	int i, j, n = 0;
+
+	pthread_mutex_lock(&totals_lock);
+
+	fprintf(out, "pool stats (%d tags)\n", ntags);
+	for (i = 0; i < ntags; i++) {
+		tag_total_t *t = &tags[i];
+
+		fprintf(out, "%s: pools=%llu avg bytes=%llu allocs=%llu blocks=%.1f "
+					 "p50<=%zu p90<=%zu p99<=%zu high-water=%zu\n",
+			t->tag, (unsigned long long)t->pools,
+			(unsigned long long)(t->bytes / t->pools),
+			(unsigned long long)(t->allocs / t->pools),
+			(double)t->blocks / t->pools,
+			percentile(t, 0.5), percentile(t, 0.9), percentile(t, 0.99), t->high_water);
+		for (j = 0; j < HIST_BUCKETS; j++) {
+			if (t->hist[j]) {
+				fprintf(out, "    [%12zu, %12zu) %llu\n",
+					j ? (apr_size_t)1 << j : 0, (apr_size_t)2 << j, (unsigned long long)t->hist[j]);
+			}
+		}
+	}
+
+	for (i = 0; i < SITE_TABLE; i++) {
+		if (sites[i].site) {
+			top[n++] = sites[i];
+		}
+	}
+	qsort(top, n, sizeof(site_total_t), site_cmp);
+	fprintf(out, "top allocation sites\n");
+	for (i = 0; i < n && i < TOP_SITES; i++) {
+		fprintf(out, "    %12llu  %s\n", (unsigned long long)top[i].bytes, top[i].site);
+	}
+	if (other_bytes) {
+		fprintf(out, "    %12llu  (other)\n", (unsigned long long)other_bytes);
+	}
+
+	pthread_mutex_unlock(&totals_lock);
+}
@@ -0,0 +1,77 @@
+#ifndef POOL_STATS_H
+#define POOL_STATS_H
+
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <stdio.h>
+
+/*
+ * Per-pool allocation statistics.
+ *
+ * Compile a module or program with -DPOOL_STATS and link pool_stats.c:
+ * apr_palloc / apr_pcalloc / apr_pstrdup / apr_pstrndup / apr_pmemdup /
+ * apr_psprintf in that code are then redirected here and tagged with the
+ * calling __FILE__:__LINE__. Without -DPOOL_STATS this header only defines
+ * POOL_STATS_TAG() as a no-op.
+ *
+ * A pool gets its stats (bytes, allocation count, allocator blocks and the
+ * per-site split) on the first counted allocation. When the pool is cleared
+ * or destroyed they are folded into its tag's totals: pool count, largest
+ * pool (high-water mark) and a log2 histogram of pool sizes, which is what
+ * MaxMemFree has to cover. pool_stats_dump() prints the totals and the
+ * allocation sites that requested most; it runs at exit on its own.
+ *
+ * Blocks are the 8 KB allocator nodes the pool would need if every counted
+ * allocation went to the active node, so they are a lower bound.
+ */
+
+#define POOL_STATS_SITES	8		/* sites tracked per pool, the rest is "other" */
+
+typedef struct {
+	const char *tag;
+	apr_size_t bytes;
+	apr_size_t allocs;
+	apr_size_t blocks;
+	apr_size_t node_free;
+	struct {
+		const char *site;
+		apr_size_t bytes;
+	} sites[POOL_STATS_SITES];
+	apr_size_t other_bytes;
+} pool_stats_t;
+
+/* stats of a pool, created on first use */
+pool_stats_t *pool_stats_get(apr_pool_t *p);
+void pool_stats_tag(apr_pool_t *p, const char *tag);
+void pool_stats_dump(FILE *out);
+
+void *pool_stats_palloc(apr_pool_t *p, apr_size_t size, const char *site);
+void *pool_stats_pcalloc(apr_pool_t *p, apr_size_t size, const char *site);
+char *pool_stats_pstrdup(apr_pool_t *p, const char *s, const char *site);
+char *pool_stats_pstrndup(apr_pool_t *p, const char *s, apr_size_t n, const char *site);
+void *pool_stats_pmemdup(apr_pool_t *p, const void *m, apr_size_t n, const char *site);
+char *pool_stats_psprintf(apr_pool_t *p, const char *site, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#if defined(POOL_STATS) && !defined(POOL_STATS_IMPL)
+
+#define POOL_STATS_STR2(x)	#x
+#define POOL_STATS_STR(x)	POOL_STATS_STR2(x)
+#define POOL_STATS_SITE		__FILE__ ":" POOL_STATS_STR(__LINE__)
+
+#undef apr_pcalloc
+#define apr_palloc(p, size)			pool_stats_palloc(p, size, POOL_STATS_SITE)
+#define apr_pcalloc(p, size)		pool_stats_pcalloc(p, size, POOL_STATS_SITE)
+#define apr_pstrdup(p, s)			pool_stats_pstrdup(p, s, POOL_STATS_SITE)
+#define apr_pstrndup(p, s, n)		pool_stats_pstrndup(p, s, n, POOL_STATS_SITE)
+#define apr_pmemdup(p, m, n)		pool_stats_pmemdup(p, m, n, POOL_STATS_SITE)
+#define apr_psprintf(p, ...)		pool_stats_psprintf(p, POOL_STATS_SITE, __VA_ARGS__)
+#define POOL_STATS_TAG(p, tag)		pool_stats_tag(p, tag)
+
+#else
+
+#define POOL_STATS_TAG(p, tag)
+
+#endif
+
+#endif
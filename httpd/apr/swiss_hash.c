@@ -0,0 +1,350 @@
+#include "swiss_hash.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define GROUP_WIDTH		16
+#define INITIAL_CAPACITY	16
+
+/* control bytes: full slots hold the low 7 bits of the hash (high bit clear) */
+#define CTRL_EMPTY		((signed char)0x80)
+#define CTRL_DELETED	((signed char)0xFE)
+
+typedef struct {
+	apr_uint32_t hash;
+	apr_uint32_t klen;
+	const void *val;
+	union {
+		const void *ptr;
+		char buf[SWISS_HASH_INLINE_KEY];
+	} key;
+} swiss_slot_t;
+
+struct swiss_hash_index_t {
+	swiss_hash_t *ht;
+	unsigned int index;
+};
+
+struct swiss_hash_t {
+	apr_pool_t *pool;
+	signed char *ctrl;
+	swiss_slot_t *slots;
+	unsigned int mask;			/* capacity - 1, capacity is a power of 2 */
+	unsigned int count;
+	unsigned int growth_left;	/* EMPTY slots we may still fill before a rehash */
+	apr_size_t pool_bytes;
+	swiss_hash_index_t iterator;	/* for swiss_hash_first(NULL, ...) */
+};
+
+#define H1(hash)	((hash) >> 7)
+#define H2(hash)	((signed char)((hash) & 0x7F))
+
+static APR_INLINE unsigned int max_load(unsigned int capacity)
+{
+	return capacity - capacity / 8;
+}
+
+static APR_INLINE const void *slot_key(const swiss_slot_t *s)
+{
+	return s->klen < SWISS_HASH_INLINE_KEY ? (const void *)s->key.buf : s->key.ptr;
+}
+
+/*
+ * 8 bytes at a time with a multiply-xorshift mix, murmur3 finalizer at the end.
+ * apr_hashfunc_default() (times 33) leaves the low bits poorly mixed, and we
+ * take both the control byte and the probe start from this value.
+ */
+static apr_uint32_t swiss_hashfunc(const void *key, apr_size_t klen)
+{
+	const unsigned char *p = key;
+	apr_uint64_t h = 0x9E3779B97F4A7C15ULL ^ (klen * 0xFF51AFD7ED558CCDULL);
+	apr_uint64_t v;
+
+	while (klen >= 8) {
+		memcpy(&v, p, 8);
+		h ^= v * 0x87C37B91114253D5ULL;
+		h = (h << 31 | h >> 33) * 0x4CF5AD432745937FULL;
+		p += 8;
+		klen -= 8;
+	}
+	if (klen) {
+		/* a byte loop, a variable length memcpy() here is a libc call */
+		v = 0;
+		while (klen--) {
+			v = v << 8 | p[klen];
+		}
+		h ^= v * 0x87C37B91114253D5ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return (apr_uint32_t)h;
+}
+
+/* bit i set <=> ctrl[i] == h2 */
+static APR_INLINE unsigned int group_match(const signed char *g, signed char h2)
+{
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)g);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+#else
+	unsigned int i, m = 0;
+	for (i = 0; i < GROUP_WIDTH; i++) {
+		m |= (unsigned int)(g[i] == h2) << i;
+	}
+	return m;
+#endif
+}
+
+/* bit i set <=> ctrl[i] is EMPTY or DELETED, both have the high bit set */
+static APR_INLINE unsigned int group_match_free(const signed char *g)
+{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+#else
+	unsigned int i, m = 0;
+	for (i = 0; i < GROUP_WIDTH; i++) {
+		m |= (unsigned int)(g[i] < 0) << i;
+	}
+	return m;
+#endif
+}
+
+static APR_INLINE unsigned int group_match_full(const signed char *g)
+{
+	return ~group_match_free(g) & 0xFFFF;
+}
+
+static void table_alloc(swiss_hash_t *ht, unsigned int capacity)
+{
+	apr_size_t ctrl_bytes = APR_ALIGN_DEFAULT(capacity);
+	apr_size_t bytes = ctrl_bytes + sizeof(swiss_slot_t) * capacity;
+	char *block = apr_palloc(ht->pool, bytes);
+
+	ht->ctrl = (signed char *)block;
+	ht->slots = (swiss_slot_t *)(block + ctrl_bytes);
+	ht->mask = capacity - 1;
+	ht->count = 0;
+	ht->growth_left = max_load(capacity);
+	ht->pool_bytes += bytes;
+	memset(ht->ctrl, CTRL_EMPTY, capacity);
+}
+
+/*
+ * Probing walks whole groups: start at the group holding h1 & mask, then
+ * triangular steps of GROUP_WIDTH, which visits every group once because the
+ * number of groups is a power of 2.
+ */
+static swiss_slot_t *find(const swiss_hash_t *ht, const void *key, apr_size_t klen, apr_uint32_t hash)
+{
+	unsigned int pos = H1(hash) & ht->mask & ~(GROUP_WIDTH - 1);
+	unsigned int stride = 0;
+	signed char h2 = H2(hash);
+
+	while (1) {
+		const signed char *g = ht->ctrl + pos;
+		unsigned int m = group_match(g, h2);
+
+		while (m) {
+			swiss_slot_t *s = &ht->slots[pos + __builtin_ctz(m)];
+			if (s->hash == hash && s->klen == klen && memcmp(slot_key(s), key, klen) == 0) {
+				return s;
+			}
+			m &= m - 1;
+		}
+		if (group_match(g, CTRL_EMPTY)) {
+			return NULL;
+		}
+		stride += GROUP_WIDTH;
+		pos = (pos + stride) & ht->mask;
+	}
+}
+
+static unsigned int find_free(const swiss_hash_t *ht, apr_uint32_t hash)
+{
+	unsigned int pos = H1(hash) & ht->mask & ~(GROUP_WIDTH - 1);
+	unsigned int stride = 0;
+
+	while (1) {
+		unsigned int m = group_match_free(ht->ctrl + pos);
+		if (m) {
+			return pos + __builtin_ctz(m);
+		}
+		stride += GROUP_WIDTH;
+		pos = (pos + stride) & ht->mask;
+	}
+}
+
+static void rehash(swiss_hash_t *ht)
+{
+	signed char *old_ctrl = ht->ctrl;
+	swiss_slot_t *old_slots = ht->slots;
+	unsigned int old_capacity = ht->mask + 1;
+	unsigned int count = ht->count;
+	unsigned int capacity = old_capacity;
+	unsigned int i;
+
+	/* mostly tombstones: rebuild at the same size, otherwise double */
+	if (count >= max_load(old_capacity) / 2) {
+		capacity *= 2;
+	}
+
+	table_alloc(ht, capacity);
+	for (i = 0; i < old_capacity; i++) {
+		if (old_ctrl[i] >= 0) {
+			unsigned int j = find_free(ht, old_slots[i].hash);
+			ht->ctrl[j] = old_ctrl[i];
+			ht->slots[j] = old_slots[i];
+		}
+	}
+	ht->count = count;
+	ht->growth_left -= count;
+}
+
+swiss_hash_t *swiss_hash_make(apr_pool_t *pool)
+{
+	swiss_hash_t *ht = apr_pcalloc(pool, sizeof(swiss_hash_t));
+	ht->pool = pool;
+	table_alloc(ht, INITIAL_CAPACITY);
+	return ht;
+}
+
+void swiss_hash_set(swiss_hash_t *ht, const void *key, apr_ssize_t klen, const void *val)
+{
+	apr_uint32_t hash;
+	swiss_slot_t *s;
+	unsigned int i;
+
+	if (klen == APR_HASH_KEY_STRING) {
+		klen = strlen(key);
+	}
+	hash = swiss_hashfunc(key, klen);
+	s = find(ht, key, klen, hash);
+
+	if (s) {
+		if (val) {
+			s->val = val;
+			return;
+		}
+		/* delete: a group that still has an EMPTY slot never stopped a probe,
+		 * so the slot can go back to EMPTY, otherwise leave a tombstone */
+		i = s - ht->slots;
+		if (group_match(ht->ctrl + (i & ~(GROUP_WIDTH - 1)), CTRL_EMPTY)) {
+			ht->ctrl[i] = CTRL_EMPTY;
+			ht->growth_left++;
+		} else {
+			ht->ctrl[i] = CTRL_DELETED;
+		}
+		ht->count--;
+		return;
+	}
+	if (!val) {
+		return;
+	}
+
+	i = find_free(ht, hash);
+	if (ht->ctrl[i] == CTRL_EMPTY && ht->growth_left == 0) {
+		rehash(ht);
+		i = find_free(ht, hash);
+	}
+	if (ht->ctrl[i] == CTRL_EMPTY) {
+		ht->growth_left--;
+	}
+
+	ht->ctrl[i] = H2(hash);
+	s = &ht->slots[i];
+	s->hash = hash;
+	s->klen = klen;
+	s->val = val;
+	if (klen < SWISS_HASH_INLINE_KEY) {
+		/* keep a NUL so callers can print keys, as they do with apr_hash */
+		memcpy(s->key.buf, key, klen);
+		s->key.buf[klen] = '\0';
+	} else {
+		s->key.ptr = key;
+	}
+	ht->count++;
+}
+
+void *swiss_hash_get(swiss_hash_t *ht, const void *key, apr_ssize_t klen)
+{
+	swiss_slot_t *s;
+
+	if (klen == APR_HASH_KEY_STRING) {
+		klen = strlen(key);
+	}
+	s = find(ht, key, klen, swiss_hashfunc(key, klen));
+	return s ? (void *)s->val : NULL;
+}
+
+unsigned int swiss_hash_count(swiss_hash_t *ht)
+{
+	return ht->count;
+}
+
+void swiss_hash_clear(swiss_hash_t *ht)
+{
+	memset(ht->ctrl, CTRL_EMPTY, ht->mask + 1);
+	ht->count = 0;
+	ht->growth_left = max_load(ht->mask + 1);
+}
+
+int swiss_hash_do(apr_hash_do_callback_fn_t *comp, void *rec, const swiss_hash_t *ht)
+{
+	unsigned int pos;
+
+	for (pos = 0; pos <= ht->mask; pos += GROUP_WIDTH) {
+		unsigned int m = group_match_full(ht->ctrl + pos);
+		while (m) {
+			const swiss_slot_t *s = &ht->slots[pos + __builtin_ctz(m)];
+			if (!comp(rec, slot_key(s), s->klen, s->val)) {
+				return 0;
+			}
+			m &= m - 1;
+		}
+	}
+	return 1;
+}
+
+static swiss_hash_index_t *seek(swiss_hash_index_t *hi, unsigned int from)
+{
+	swiss_hash_t *ht = hi->ht;
+
+	for (hi->index = from; hi->index <= ht->mask; hi->index++) {
+		if (ht->ctrl[hi->index] >= 0) {
+			return hi;
+		}
+	}
+	return NULL;
+}
+
+swiss_hash_index_t *swiss_hash_first(apr_pool_t *p, swiss_hash_t *ht)
+{
+	swiss_hash_index_t *hi = p ? apr_palloc(p, sizeof(*hi)) : &ht->iterator;
+
+	hi->ht = ht;
+	return seek(hi, 0);
+}
+
+swiss_hash_index_t *swiss_hash_next(swiss_hash_index_t *hi)
+{
+	return seek(hi, hi->index + 1);
+}
+
+void swiss_hash_this(swiss_hash_index_t *hi, const void **key, apr_ssize_t *klen, void **val)
+{
+	const swiss_slot_t *s = &hi->ht->slots[hi->index];
+
+	if (key)  *key  = slot_key(s);
+	if (klen) *klen = s->klen;
+	if (val)  *val  = (void *)s->val;
+}
+
+apr_size_t swiss_hash_pool_bytes(const swiss_hash_t *ht)
+{
+	return ht->pool_bytes;
+}
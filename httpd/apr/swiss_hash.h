@@ -0,0 +1,45 @@
+#ifndef SWISS_HASH_H
+#define SWISS_HASH_H
+
+#include <apr-1.0/apr_pools.h>
+#include <apr-1.0/apr_hash.h>
+
+/*
+ * Open addressing hash table with the same API as apr_hash_t.
+ *
+ * apr_hash_t keeps an array of bucket chains, every entry is a separate
+ * apr_palloc() and every lookup miss walks a linked list.
+ * swiss_hash_t keeps one control byte per slot (empty / deleted / 7 bits of
+ * the hash) and probes 16 control bytes at a time with SSE2, so most lookups
+ * touch one control group and one slot.
+ *
+ * Keys shorter than SWISS_HASH_INLINE_KEY bytes are copied (NUL terminated)
+ * into the slot, longer keys are referenced like apr_hash does (the caller
+ * keeps them alive).
+ * Slots live in one block allocated from the pool; growing the table
+ * allocates a new block and leaves the old one to the pool.
+ */
+
+#define SWISS_HASH_INLINE_KEY	16
+
+typedef struct swiss_hash_t swiss_hash_t;
+typedef struct swiss_hash_index_t swiss_hash_index_t;
+
+swiss_hash_t *swiss_hash_make(apr_pool_t *pool);
+
+/* val == NULL deletes the key, like apr_hash_set() */
+void swiss_hash_set(swiss_hash_t *ht, const void *key, apr_ssize_t klen, const void *val);
+void *swiss_hash_get(swiss_hash_t *ht, const void *key, apr_ssize_t klen);
+unsigned int swiss_hash_count(swiss_hash_t *ht);
+void swiss_hash_clear(swiss_hash_t *ht);
+
+int swiss_hash_do(apr_hash_do_callback_fn_t *comp, void *rec, const swiss_hash_t *ht);
+
+swiss_hash_index_t *swiss_hash_first(apr_pool_t *p, swiss_hash_t *ht);
+swiss_hash_index_t *swiss_hash_next(swiss_hash_index_t *hi);
+void swiss_hash_this(swiss_hash_index_t *hi, const void **key, apr_ssize_t *klen, void **val);
+
+/* bytes of table blocks given to the pool, including abandoned ones */
+apr_size_t swiss_hash_pool_bytes(const swiss_hash_t *ht);
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/*
+ * Log-linear latency histogram (the HdrHistogram layout with a fixed
+ * precision): values below 64 get their own bucket, above that every power
+ * of 2 is split into 64 buckets, so a bucket is at most 1/64 (1.6%) wide.
+ * Any uint64_t fits, recording is a clz and an increment, histograms of
+ * different threads are merged by adding the counts.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HIST_SUB_BITS   6
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} histogram_t;
+
+static inline void hist_init(histogram_t *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline int hist_index(uint64_t v)
+{
+    int e;
+
+    if (v < HIST_SUB) {
+        return v;
+    }
+    e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) - HIST_SUB);
+}
+
+/* largest value that lands in bucket i */
+static inline uint64_t hist_value(int i)
+{
+    int e;
+
+    if (i < HIST_SUB) {
+        return i;
+    }
+    e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    return (((uint64_t)(i % HIST_SUB + HIST_SUB) + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+static inline void hist_record(histogram_t *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static inline void hist_merge(histogram_t *dst, const histogram_t *src)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+/* q in [0, 1] */
+static inline uint64_t hist_percentile(const histogram_t *h, double q)
+{
+    uint64_t want = (uint64_t)(q * h->total), seen = 0;
+    int i;
+
+    if (h->total == 0) {
+        return 0;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > want) {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* one line: count, mean and percentiles, values divided by scale (1000 for ns -> us) */
+static inline void hist_print(FILE *out, const char *name, const histogram_t *h, double scale, const char *unit)
+{
+    if (h->total == 0) {
+        fprintf(out, "%s: no samples\n", name);
+        return;
+    }
+    fprintf(out, "%s: n=%llu min=%.1f mean=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f %s\n",
+        name, (unsigned long long)h->total,
+        h->min / scale, h->sum / h->total / scale,
+        hist_percentile(h, 0.5) / scale, hist_percentile(h, 0.9) / scale,
+        hist_percentile(h, 0.99) / scale, hist_percentile(h, 0.999) / scale,
+        h->max / scale, unit);
+}
+
+#endif
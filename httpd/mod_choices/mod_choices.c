@@ -3,6 +3,9 @@
 #include <http_config.h>
 #include <apr_strings.h>
 #include <apr_hash.h>
+#ifdef POOL_STATS
+#include "../apr/pool_stats.h"
+#endif
 
 typedef struct choices_cfg {
     int choices;
@@ -43,6 +46,9 @@ static int choices_select(request_rec *r)
         return HTTP_INTERNAL_SERVER_ERROR;
     }
 
+#ifdef POOL_STATS
+    POOL_STATS_TAG(r->pool, "mod_choices");
+#endif
     ap_set_content_type(r, "text/plain;charset=utf8");
 
     char *ext = strrchr(r->filename, '.');
@@ -3,6 +3,9 @@
 #include <http_config.h>
 #include <apr_strings.h>
 #include <apr_hash.h>
+#ifdef POOL_STATS
+#include "../apr/pool_stats.h"
+#endif
 
 static int printitem(void *rec, const char *key, const char *value)
 {
@@ -168,6 +171,9 @@ static int helloworld_handler(request_rec *r)
         return HTTP_METHOD_NOT_ALLOWED;
     }
 
+#ifdef POOL_STATS
+    POOL_STATS_TAG(r->pool, "mod_helloworld");
+#endif
     ap_set_content_type(r, "text/html;charset=utf8");
 
     printtable(r, r->headers_in, "Request Headers", "Header", "Value");
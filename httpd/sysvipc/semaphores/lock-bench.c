@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../../histogram.h"
+
+/*
+ * Accept mutex contention: N processes loop lock / -w ns of work (the
+ * accept()) / unlock / -o ns of work (the request), with every Mutex
+ * mechanism httpd has, plus a raw futex and a POSIX semaphore:
+ *
+ *   sysvsem   semop() -1/+1 with SEM_UNDO, like apr's sysvsem
+ *   pthread   process-shared robust pthread mutex in shared memory
+ *   futex     3-state futex mutex (Drepper, "Futexes Are Tricky")
+ *   posixsem  sem_wait()/sem_post() on a process-shared sem_t
+ *   flock     flock() on a lock file opened by every child
+ *   fcntl     F_SETLKW on a lock file opened before fork()
+ *
+ * Per mechanism and process count it prints acquisitions/s, handoffs/s (the
+ * lock went to another process than the last owner), fairness as Jain's
+ * index of the per-process acquisitions (1 = equal, 1/N = one process got
+ * all) and min/max, and the time to get the lock: p50, p99, p99.9, max.
+ *
+ * gcc -O2 lock-bench.c -o lock-bench -lpthread
+ * ./lock-bench [-m sysvsem,pthread,futex,posixsem,flock,fcntl] [-n 1,2,4,8] [-d secs] [-w ns] [-o ns] [-a]
+ */
+
+#define MAX_PROCS	256
+#define LOCK_FILE	"/tmp/lock-bench.lock"
+
+enum { M_SYSVSEM, M_PTHREAD, M_FUTEX, M_POSIXSEM, M_FLOCK, M_FCNTL, M_COUNT };
+
+static const char *mech_names[M_COUNT] = {
+	"sysvsem", "pthread", "futex", "posixsem", "flock", "fcntl"
+};
+
+typedef struct {
+	unsigned long long acquired;
+	unsigned long long handoffs;
+	histogram_t wait;
+} proc_stats_t;
+
+typedef struct {
+	volatile int ready;
+	volatile int start;
+	volatile int stop;
+	int owner;
+	pthread_mutex_t mutex;
+	int futex;
+	sem_t sem;
+	proc_stats_t procs[MAX_PROCS];
+} shared_t;
+
+union semun {
+	int val;
+};
+
+static shared_t *shm;
+static int mech;
+static int semid;
+static int lock_fd;
+static long hold_ns;
+static long outside_ns;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void spin(long ns)
+{
+	uint64_t end;
+
+	if (ns <= 0) {
+		return;
+	}
+	end = now_ns() + ns;
+	while (now_ns() < end) {
+	}
+}
+
+static long sys_futex(int *uaddr, int op, int val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/* 0 unlocked, 1 locked, 2 locked with waiters; not FUTEX_PRIVATE, it is shared */
+static void futex_lock(int *f)
+{
+	int c = __sync_val_compare_and_swap(f, 0, 1);
+
+	if (c == 0) {
+		return;
+	}
+	if (c != 2) {
+		c = __sync_lock_test_and_set(f, 2);
+	}
+	while (c != 0) {
+		sys_futex(f, FUTEX_WAIT, 2);
+		c = __sync_lock_test_and_set(f, 2);
+	}
+}
+
+static void futex_unlock(int *f)
+{
+	if (__sync_fetch_and_sub(f, 1) != 1) {
+		*f = 0;
+		sys_futex(f, FUTEX_WAKE, 1);
+	}
+}
+
+static void lock(void)
+{
+	struct sembuf sop = { 0, -1, SEM_UNDO };
+	struct flock fl = { F_WRLCK, SEEK_SET, 0, 0, 0 };
+
+	switch (mech) {
+	case M_SYSVSEM:
+		while (semop(semid, &sop, 1) < 0) {
+		}
+		break;
+	case M_PTHREAD:
+		if (pthread_mutex_lock(&shm->mutex) == EOWNERDEAD) {
+			pthread_mutex_consistent(&shm->mutex);
+		}
+		break;
+	case M_FUTEX:
+		futex_lock(&shm->futex);
+		break;
+	case M_POSIXSEM:
+		while (sem_wait(&shm->sem) < 0) {
+		}
+		break;
+	case M_FLOCK:
+		while (flock(lock_fd, LOCK_EX) < 0) {
+		}
+		break;
+	case M_FCNTL:
+		while (fcntl(lock_fd, F_SETLKW, &fl) < 0) {
+		}
+		break;
+	}
+}
+
+static void unlock(void)
+{
+	struct sembuf sop = { 0, 1, SEM_UNDO };
+	struct flock fl = { F_UNLCK, SEEK_SET, 0, 0, 0 };
+
+	switch (mech) {
+	case M_SYSVSEM:
+		semop(semid, &sop, 1);
+		break;
+	case M_PTHREAD:
+		pthread_mutex_unlock(&shm->mutex);
+		break;
+	case M_FUTEX:
+		futex_unlock(&shm->futex);
+		break;
+	case M_POSIXSEM:
+		sem_post(&shm->sem);
+		break;
+	case M_FLOCK:
+		flock(lock_fd, LOCK_UN);
+		break;
+	case M_FCNTL:
+		fcntl(lock_fd, F_SETLK, &fl);
+		break;
+	}
+}
+
+static void child(int id, int pin)
+{
+	proc_stats_t *st = &shm->procs[id];
+
+	if (pin) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+	/* flock() locks belong to the open file, every child needs its own */
+	if (mech == M_FLOCK) {
+		lock_fd = open(LOCK_FILE, O_RDWR);
+	}
+
+	__sync_fetch_and_add(&shm->ready, 1);
+	while (!shm->start) {
+	}
+
+	while (!shm->stop) {
+		uint64_t t0 = now_ns();
+		lock();
+		hist_record(&st->wait, now_ns() - t0);
+		st->acquired++;
+		if (shm->owner != id) {
+			st->handoffs++;
+			shm->owner = id;
+		}
+		spin(hold_ns);
+		unlock();
+		spin(outside_ns);
+	}
+	_exit(0);
+}
+
+static void run(int nprocs, int secs, int pin)
+{
+	pthread_mutexattr_t attr;
+	union semun arg;
+	histogram_t waits;
+	unsigned long long acquired = 0, handoffs = 0, min = ~0ULL, max = 0;
+	double sum_sq = 0;
+	int i;
+
+	memset(shm, 0, sizeof(shared_t));
+	shm->owner = -1;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shm->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	sem_init(&shm->sem, 1, 1);
+	for (i = 0; i < nprocs; i++) {
+		hist_init(&shm->procs[i].wait);
+	}
+
+	semid = semget(IPC_PRIVATE, 1, 0600);
+	arg.val = 1;
+	semctl(semid, 0, SETVAL, arg);
+	lock_fd = open(LOCK_FILE, O_RDWR | O_CREAT, 0600);
+
+	for (i = 0; i < nprocs; i++) {
+		if (fork() == 0) {
+			child(i, pin);
+		}
+	}
+	while (shm->ready < nprocs) {
+		usleep(1000);
+	}
+	uint64_t start = now_ns();
+	shm->start = 1;
+	sleep(secs);
+	shm->stop = 1;
+	while (wait(NULL) > 0) {
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	hist_init(&waits);
+	for (i = 0; i < nprocs; i++) {
+		proc_stats_t *st = &shm->procs[i];
+		acquired += st->acquired;
+		handoffs += st->handoffs;
+		sum_sq += (double)st->acquired * st->acquired;
+		if (st->acquired < min) {
+			min = st->acquired;
+		}
+		if (st->acquired > max) {
+			max = st->acquired;
+		}
+		hist_merge(&waits, &st->wait);
+	}
+
+	printf("%-9s %5d %12.0f %12.0f %6.3f %7.3f %9.2f %9.2f %9.2f %9.2f\n",
+		mech_names[mech], nprocs, acquired / elapsed, handoffs / elapsed,
+		sum_sq ? (double)acquired * acquired / (nprocs * sum_sq) : 0.0,
+		max ? (double)min / max : 0.0,
+		hist_percentile(&waits, 0.5) / 1000.0, hist_percentile(&waits, 0.99) / 1000.0,
+		hist_percentile(&waits, 0.999) / 1000.0, waits.max / 1000.0);
+	fflush(stdout);
+
+	semctl(semid, 0, IPC_RMID);
+	close(lock_fd);
+	unlink(LOCK_FILE);
+	pthread_mutex_destroy(&shm->mutex);
+	sem_destroy(&shm->sem);
+}
+
+int main(int argc, char *argv[])
+{
+	char mechs[256] = "sysvsem,pthread,futex,posixsem,flock,fcntl";
+	char procs[256];
+	int secs = 2, pin = 0;
+	int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	snprintf(procs, sizeof(procs), "1,2,4,%d,%d", ncpu, ncpu * 2);
+	while ((opt = getopt(argc, argv, "m:n:d:w:o:a")) != -1) {
+		switch (opt) {
+		case 'm': snprintf(mechs, sizeof(mechs), "%s", optarg); break;
+		case 'n': snprintf(procs, sizeof(procs), "%s", optarg); break;
+		case 'd': secs = atoi(optarg); break;
+		case 'w': hold_ns = atol(optarg); break;
+		case 'o': outside_ns = atol(optarg); break;
+		case 'a': pin = 1; break;
+		default:
+			printf("%s [-m sysvsem,pthread,futex,posixsem,flock,fcntl] [-n 1,2,4,8] [-d secs] [-w ns] [-o ns] [-a]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	shm = mmap(NULL, sizeof(shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	printf("%d cpus, %d s per run, %ld ns in the lock, %ld ns outside%s\n",
+		ncpu, secs, hold_ns, outside_ns, pin ? ", pinned" : "");
+	printf("%-9s %5s %12s %12s %6s %7s %9s %9s %9s %9s\n",
+		"mechanism", "procs", "acquired/s", "handoffs/s", "jain", "min/max", "p50 us", "p99 us", "p99.9 us", "max us");
+
+	char *m, *msave;
+	for (m = strtok_r(mechs, ",", &msave); m; m = strtok_r(NULL, ",", &msave)) {
+		for (mech = 0; mech < M_COUNT && strcmp(m, mech_names[mech]) != 0; mech++) {
+		}
+		if (mech == M_COUNT) {
+			printf("unknown mechanism %s\n", m);
+			continue;
+		}
+
+		char list[256], *n, *nsave;
+		snprintf(list, sizeof(list), "%s", procs);
+		for (n = strtok_r(list, ",", &nsave); n; n = strtok_r(NULL, ",", &nsave)) {
+			int nprocs = atoi(n);
+			if (nprocs < 1 || nprocs > MAX_PROCS) {
+				continue;
+			}
+			run(nprocs, secs, pin);
+		}
+	}
+
+	munmap(shm, sizeof(shared_t));
+	return 0;
+}
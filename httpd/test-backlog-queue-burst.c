@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "histogram.h"
+
+/*
+ * What a small listen() backlog does to a connection burst.
+ *
+ * For every backlog in -b, listen on 127.0.0.1:port with that backlog and
+ * accept at -r connections/s (0 = as fast as possible; the blocking
+ * test-backlog-queue is about 1 connection per client lifetime), then open
+ * -n connections at once. Like an HTTP client every connection writes a
+ * short request as soon as it is connected, the acceptor reads it, answers
+ * with one byte and closes.
+ *
+ *   connect:  connect() to writable, the SYN-ACK came back. When the accept
+ *             queue is full the SYN is dropped and this takes the SYN
+ *             retransmit timeout: 1 s, 3 s, 7 s ...
+ *   accepted: connect() to the server's byte, so the time spent in the
+ *             accept queue. With tcp_abort_on_overflow=0 the final ACK of
+ *             a full queue is dropped too, the client thinks it is connected
+ *             and only the retransmits of its request get it in.
+ *
+ * Every -i ms a sampler records the accept queue (TCP_INFO on the listen
+ * socket: tcpi_unacked is the current length, tcpi_sacked the backlog, what
+ * ss shows as Recv-Q/Send-Q), the SYN queue (SYN_RECV entries for the port
+ * in /proc/net/tcp) and ListenOverflows, ListenDrops and SyncookiesSent from
+ * /proc/net/netstat. The netstat counters are system wide, run on an idle box.
+ *
+ * With -e the listener is an outside server already on the port (httpd,
+ * php-fpm, test-backlog-queue -b N): -b is then only a label and the accept
+ * queue columns are empty.
+ *
+ * gcc -O2 test-backlog-queue-burst.c -o test-backlog-queue-burst -lpthread
+ * ./test-backlog-queue-burst [-p port] [-b 2,16,128] [-n burst] [-r accepts/s] [-T timeout] [-i ms] [-e] [-v]
+ */
+
+#define MAX_BACKLOGS    32
+#define MAX_SAMPLES     100000
+
+typedef struct {
+    uint64_t t;
+    int accept_queue;
+    int accept_max;
+    int syn_queue;
+    unsigned long long overflows;
+    unsigned long long drops;
+    unsigned long long cookies;
+} sample_t;
+
+typedef struct {
+    int fd;
+    int state;                      /* 0 connecting, 1 connected, 2 done */
+    uint64_t start;
+} burst_conn_t;
+
+static int port = 9999;
+static int burst = 1000;
+static int accept_rate;
+static int timeout_s = 15;
+static int interval_ms = 10;
+static int external;
+static int verbose;
+
+static int listen_fd = -1;
+static int server_accepted, server_answered;
+static volatile int stop_threads;
+static sample_t *samples;
+static int nsamples;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* TcpExt counters come as a line of names followed by a line of values */
+static void read_netstat(sample_t *s)
+{
+    char names[8192], values[8192];
+    FILE *fp = fopen("/proc/net/netstat", "r");
+
+    if (!fp) {
+        return;
+    }
+    while (fgets(names, sizeof(names), fp) && fgets(values, sizeof(values), fp)) {
+        char *np, *vp, *n, *v;
+        if (strncmp(names, "TcpExt:", 7) != 0) {
+            continue;
+        }
+        n = strtok_r(names, " \n", &np);
+        v = strtok_r(values, " \n", &vp);
+        while ((n = strtok_r(NULL, " \n", &np)) && (v = strtok_r(NULL, " \n", &vp))) {
+            if (strcmp(n, "ListenOverflows") == 0) {
+                s->overflows = strtoull(v, NULL, 10);
+            } else if (strcmp(n, "ListenDrops") == 0) {
+                s->drops = strtoull(v, NULL, 10);
+            } else if (strcmp(n, "SyncookiesSent") == 0) {
+                s->cookies = strtoull(v, NULL, 10);
+            }
+        }
+    }
+    fclose(fp);
+}
+
+/* request sockets show up in /proc/net/tcp as state 03, TCP_SYN_RECV */
+static int count_syn_recv(void)
+{
+    char line[512];
+    int count = 0;
+    FILE *fp = fopen("/proc/net/tcp", "r");
+
+    if (!fp) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned int lport, state;
+        if (sscanf(line, " %*d: %*x:%x %*x:%*x %x", &lport, &state) == 2
+            && lport == (unsigned int)port && state == 0x03) {
+            count++;
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+static void take_sample(sample_t *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->t = now_ns();
+    s->accept_queue = s->accept_max = -1;
+    if (listen_fd >= 0) {
+        struct tcp_info ti;
+        socklen_t len = sizeof(ti);
+        if (getsockopt(listen_fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0) {
+            s->accept_queue = ti.tcpi_unacked;
+            s->accept_max = ti.tcpi_sacked;
+        }
+    }
+    s->syn_queue = count_syn_recv();
+    read_netstat(s);
+}
+
+static void *run_sampler(void *arg)
+{
+    while (!stop_threads && nsamples < MAX_SAMPLES) {
+        take_sample(&samples[nsamples++]);
+        usleep(interval_ms * 1000);
+    }
+    return NULL;
+}
+
+/*
+ * Accepts at -r and answers every connection when its request arrives,
+ * through epoll, so a connection whose request is late (its final ACK was
+ * dropped, or it came in on a SYN cookie and waits for a retransmit) does
+ * not hold up the accepts behind it.
+ */
+static void *run_acceptor(void *arg)
+{
+    struct epoll_event ev, events[256];
+    int epfd = epoll_create1(0);
+    int fd, listening = 0;
+    uint64_t next = now_ns();
+    struct rlimit rl;
+
+    /* the accepted connections still open, by fd */
+    getrlimit(RLIMIT_NOFILE, &rl);
+    char *open = calloc(rl.rlim_cur, 1);
+
+    while (!stop_threads) {
+        uint64_t now = now_ns();
+        int i, n, timeout = 100;
+
+        if (now >= next && !listening) {
+            ev.events = EPOLLIN;
+            ev.data.fd = listen_fd;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+            listening = 1;
+        } else if (now < next) {
+            timeout = (next - now) / 1000000 + 1;
+        }
+
+        n = epoll_wait(epfd, events, 256, timeout);
+        for (i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                int conn = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+                if (conn < 0) {
+                    continue;
+                }
+                ev.events = EPOLLIN | EPOLLRDHUP;
+                ev.data.fd = conn;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, conn, &ev);
+                open[conn] = 1;
+                server_accepted++;
+                /*
+                 * next moves by the period from where it was, epoll_wait()
+                 * wakes up in ms: a late wakeup makes up for the accepts it
+                 * missed, up to 1 ms worth of them
+                 */
+                if (accept_rate > 0) {
+                    uint64_t t = now_ns(), period = 1000000000ULL / accept_rate;
+
+                    next = next + 1000000 < t ? t - 1000000 + period : next + period;
+                    if (next > t) {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+                        listening = 0;
+                    }
+                }
+                continue;
+            }
+
+            char req[64];
+            if (read(fd, req, sizeof(req)) < 0 && errno == EAGAIN) {
+                continue;
+            }
+            write(fd, "x", 1);
+            close(fd);
+            open[fd] = 0;
+            server_answered++;
+        }
+    }
+
+    /* the ones still waiting for their request */
+    for (fd = 0; fd < (int)rl.rlim_cur; fd++) {
+        if (open[fd]) {
+            close(fd);
+        }
+    }
+    free(open);
+    close(epfd);
+    return NULL;
+}
+
+static int open_listener(int backlog)
+{
+    struct sockaddr_in addr;
+    int optval = 1;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, backlog) == -1) {
+        perror("bind/listen");
+        exit(1);
+    }
+    return sock;
+}
+
+static void run_burst(int backlog)
+{
+    burst_conn_t *conns = calloc(burst, sizeof(burst_conn_t));
+    struct epoll_event ev, events[256];
+    struct sockaddr_in addr;
+    histogram_t connect_hist, accept_hist;
+    int epfd = epoll_create1(0);
+    int i, pending = 0, failed = 0, timed_out = 0, refused = 0, queue_peak = 0, syn_peak = 0;
+    pthread_t sampler, acceptor;
+    uint64_t deadline;
+
+    hist_init(&connect_hist);
+    hist_init(&accept_hist);
+    nsamples = 0;
+    server_accepted = server_answered = 0;
+    stop_threads = 0;
+
+    if (!external) {
+        listen_fd = open_listener(backlog);
+        pthread_create(&acceptor, NULL, run_acceptor, NULL);
+    }
+    pthread_create(&sampler, NULL, run_sampler, NULL);
+    usleep(interval_ms * 1000);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (i = 0; i < burst; i++) {
+        burst_conn_t *c = &conns[i];
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (c->fd < 0) {
+            perror("socket");
+            c->state = 2;
+            failed++;
+            continue;
+        }
+        c->start = now_ns();
+        if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+            close(c->fd);
+            c->state = 2;
+            errno == ECONNREFUSED ? refused++ : failed++;
+            continue;
+        }
+        ev.events = EPOLLOUT | EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+        pending++;
+    }
+
+    deadline = now_ns() + (uint64_t)timeout_s * 1000000000;
+    while (pending > 0 && now_ns() < deadline) {
+        int n = epoll_wait(epfd, events, 256, 100);
+        for (i = 0; i < n; i++) {
+            burst_conn_t *c = events[i].data.ptr;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            ssize_t r;
+            char b;
+
+            if (c->state == 0) {
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err == 0) {
+                    hist_record(&connect_hist, now_ns() - c->start);
+                    write(c->fd, "GET\n", 4);
+                    c->state = 1;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                    continue;
+                }
+            } else if ((r = read(c->fd, &b, 1)) == 1) {
+                hist_record(&accept_hist, now_ns() - c->start);
+            } else if (r == 0) {
+                /* EOF, errno is left from some earlier call: closed by the server */
+                err = ECONNRESET;
+            } else if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            } else {
+                err = errno;
+            }
+
+            if (err) {
+                err == ECONNREFUSED || err == ECONNRESET ? refused++ : failed++;
+            }
+            epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+            close(c->fd);
+            c->state = 2;
+            pending--;
+        }
+    }
+
+    for (i = 0; i < burst; i++) {
+        if (conns[i].state != 2) {
+            close(conns[i].fd);
+            timed_out++;
+        }
+    }
+
+    stop_threads = 1;
+    pthread_join(sampler, NULL);
+    if (!external) {
+        pthread_join(acceptor, NULL);
+        close(listen_fd);
+        listen_fd = -1;
+    }
+
+    for (i = 0; i < nsamples; i++) {
+        if (samples[i].accept_queue > queue_peak) {
+            queue_peak = samples[i].accept_queue;
+        }
+        if (samples[i].syn_queue > syn_peak) {
+            syn_peak = samples[i].syn_queue;
+        }
+    }
+
+    printf("backlog %d: %d connections, %llu accepted, %d refused/reset, %d failed, %d timed out\n",
+        backlog, burst, (unsigned long long)accept_hist.total, refused, failed, timed_out);
+    if (!external) {
+        printf("    server: accept() returned %d, %d requests answered\n", server_accepted, server_answered);
+    }
+    if (nsamples > 1) {
+        sample_t *first = &samples[0], *last = &samples[nsamples - 1];
+        printf("    peak accept queue %d/%d, peak SYN_RECV %d, ListenOverflows +%llu, ListenDrops +%llu, SyncookiesSent +%llu\n",
+            queue_peak, first->accept_max, syn_peak,
+            last->overflows - first->overflows, last->drops - first->drops, last->cookies - first->cookies);
+    }
+    hist_print(stdout, "    connect", &connect_hist, 1000000.0, "ms");
+    hist_print(stdout, "    accepted", &accept_hist, 1000000.0, "ms");
+
+    if (verbose) {
+        printf("    %8s %8s %8s %10s %10s\n", "ms", "acceptq", "synq", "overflows", "drops");
+        for (i = 0; i < nsamples; i++) {
+            sample_t *s = &samples[i];
+            printf("    %8.1f %8d %8d %10llu %10llu\n", (s->t - samples[0].t) / 1e6,
+                s->accept_queue, s->syn_queue, s->overflows - samples[0].overflows, s->drops - samples[0].drops);
+        }
+    }
+
+    close(epfd);
+    free(conns);
+}
+
+int main(int argc, char *argv[])
+{
+    char *backlog_list = "2,16,128,1024";
+    int backlogs[MAX_BACKLOGS], nbacklogs = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "p:b:n:r:T:i:ev")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'b': backlog_list = optarg; break;
+        case 'n': burst = atoi(optarg); break;
+        case 'r': accept_rate = atoi(optarg); break;
+        case 'T': timeout_s = atoi(optarg); break;
+        case 'i': interval_ms = atoi(optarg); break;
+        case 'e': external = 1; break;
+        case 'v': verbose = 1; break;
+        default:
+            fprintf(stderr, "%s [-p port] [-b 2,16,128] [-n burst] [-r accepts/s] [-T timeout] [-i ms] [-e] [-v]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    char *tok, *save;
+    for (tok = strtok_r(backlog_list, ",", &save); tok && nbacklogs < MAX_BACKLOGS; tok = strtok_r(NULL, ",", &save)) {
+        backlogs[nbacklogs++] = atoi(tok);
+    }
+
+    /* a burst needs a descriptor per connection */
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)burst + 64) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)burst + 64 ? rl.rlim_max : (rlim_t)burst + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    samples = malloc(sizeof(sample_t) * MAX_SAMPLES);
+    printf("burst of %d connections to 127.0.0.1:%d, accepting at %s\n", burst, port,
+        external ? "the server's pace" : accept_rate ? "a fixed rate" : "full speed");
+    for (i = 0; i < nbacklogs; i++) {
+        run_burst(backlogs[i]);
+        /* let the TIME_WAIT and retransmit noise of the last run settle */
+        sleep(1);
+    }
+    free(samples);
+    return 0;
+}
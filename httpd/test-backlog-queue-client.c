@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "histogram.h"
+
+/*
+ * Load generator for the line echo servers (test-backlog-queue,
+ * test-backlog-queue-uring).
+ *
+ * -c connections spread over -t threads, every connection keeps -P lines
+ * of -l bytes in flight. A line's latency is from its write() to the read()
+ * that brought its '\n' back. Runs for -d seconds, or until -n lines are done.
+ *
+ * gcc -O2 test-backlog-queue-client.c -o test-backlog-queue-client -lpthread
+ * ./test-backlog-queue-client [-h host] [-p port] [-c conns] [-t threads] [-d secs] [-n lines] [-l size] [-P depth]
+ */
+
+#define MAX_PIPELINE    64
+#define MAX_EVENTS      256
+
+typedef struct {
+    int fd;
+    int inflight;
+    int head;                       /* oldest line in sent_at */
+    size_t out_pos;                 /* bytes of the current batch written */
+    size_t out_len;
+    uint64_t sent_at[MAX_PIPELINE];
+} client_conn_t;
+
+typedef struct {
+    pthread_t tid;
+    int nconns;
+    unsigned long long lines;
+    unsigned long long errors;
+    histogram_t hist;
+} client_thread_t;
+
+static struct sockaddr_in server;
+static int line_size = 64;
+static int pipeline = 1;
+static long long max_lines;
+static volatile int done;
+static char *line_buf;              /* MAX_PIPELINE lines back to back */
+
+static unsigned long long lines_total;   /* for -n */
+static int running;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int conn_open(client_conn_t *c, int epfd)
+{
+    int one = 1;
+    struct epoll_event ev;
+
+    memset(c, 0, sizeof(*c));
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&server, sizeof(server)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(c->fd);
+        return -1;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return 0;
+}
+
+/* fill the pipeline: a new batch is stamped when its write starts */
+static int conn_send(client_conn_t *c)
+{
+    while (1) {
+        if (c->out_pos == c->out_len) {
+            int n = pipeline - c->inflight, i;
+            if (n == 0 || done) {
+                return 0;
+            }
+            uint64_t t = now_ns();
+            for (i = 0; i < n; i++) {
+                c->sent_at[(c->head + c->inflight + i) % MAX_PIPELINE] = t;
+            }
+            c->inflight += n;
+            c->out_pos = 0;
+            c->out_len = (size_t)n * line_size;
+        }
+
+        ssize_t w = write(c->fd, line_buf + c->out_pos, c->out_len - c->out_pos);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? 0 : -1;
+        }
+        c->out_pos += w;
+    }
+}
+
+static int conn_recv(client_thread_t *t, client_conn_t *c)
+{
+    char buf[16384];
+
+    while (1) {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+
+        char *p = buf, *end = buf + n;
+        uint64_t now = 0;
+        int got = 0;
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+            if (c->inflight == 0) {
+                return -1;
+            }
+            if (!now) {
+                now = now_ns();
+            }
+            hist_record(&t->hist, now - c->sent_at[c->head]);
+            c->head = (c->head + 1) % MAX_PIPELINE;
+            c->inflight--;
+            got++;
+            p++;
+        }
+        t->lines += got;
+        if (max_lines && got && __sync_add_and_fetch(&lines_total, got) >= (unsigned long long)max_lines) {
+            done = 1;
+        }
+    }
+}
+
+static void *run_thread(void *arg)
+{
+    client_thread_t *t = arg;
+    client_conn_t *conns = calloc(t->nconns, sizeof(client_conn_t));
+    struct epoll_event events[MAX_EVENTS];
+    int epfd = epoll_create1(0);
+    int i, open = 0;
+
+    hist_init(&t->hist);
+    for (i = 0; i < t->nconns; i++) {
+        if (conn_open(&conns[i], epfd) == 0) {
+            open++;
+        } else {
+            conns[i].fd = -1;
+            t->errors++;
+        }
+    }
+
+    while (!done && open > 0) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (i = 0; i < n; i++) {
+            client_conn_t *c = events[i].data.ptr;
+            if (c->fd < 0) {
+                continue;
+            }
+            if (conn_recv(t, c) < 0 || conn_send(c) < 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                close(c->fd);
+                c->fd = -1;
+                t->errors++;
+                open--;
+            }
+        }
+    }
+
+    for (i = 0; i < t->nconns; i++) {
+        if (conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+    }
+    close(epfd);
+    free(conns);
+    __sync_sub_and_fetch(&running, 1);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = "127.0.0.1";
+    int port = 9999, nconns = 1, nthreads = 1, duration = 10;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "h:p:c:t:d:n:l:P:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': nconns = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'n': max_lines = atoll(optarg); break;
+        case 'l': line_size = atoi(optarg); break;
+        case 'P': pipeline = atoi(optarg); break;
+        default:
+            fprintf(stderr, "%s [-h host] [-p port] [-c conns] [-t threads] [-d secs] [-n lines] [-l size] [-P depth]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads > nconns) {
+        nthreads = nconns;
+    }
+    if (line_size < 2) {
+        line_size = 2;
+    }
+    if (pipeline < 1 || pipeline > MAX_PIPELINE) {
+        pipeline = pipeline < 1 ? 1 : MAX_PIPELINE;
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", host);
+        return 1;
+    }
+
+    line_buf = malloc((size_t)line_size * MAX_PIPELINE);
+    for (i = 0; i < MAX_PIPELINE; i++) {
+        char *line = line_buf + (size_t)i * line_size;
+        memset(line, 'a' + i % 26, line_size - 1);
+        line[line_size - 1] = '\n';
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    client_thread_t *threads = calloc(nthreads, sizeof(client_thread_t));
+    uint64_t start = now_ns();
+    running = nthreads;
+    for (i = 0; i < nthreads; i++) {
+        threads[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+        pthread_create(&threads[i].tid, NULL, run_thread, &threads[i]);
+    }
+
+    while (!done && running) {
+        usleep(10000);
+        if (!max_lines && now_ns() - start >= (uint64_t)duration * 1000000000) {
+            done = 1;
+        }
+    }
+
+    histogram_t hist;
+    unsigned long long lines = 0, errors = 0;
+    hist_init(&hist);
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        hist_merge(&hist, &threads[i].hist);
+        lines += threads[i].lines;
+        errors += threads[i].errors;
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    printf("%d connections, %d threads, %d byte lines, pipeline %d\n", nconns, nthreads, line_size, pipeline);
+    printf("%llu lines in %.2f s, %.0f lines/s, %llu errors\n", lines, secs, lines / secs, errors);
+    hist_print(stdout, "latency", &hist, 1000.0, "us");
+
+    free(threads);
+    free(line_buf);
+    return 0;
+}
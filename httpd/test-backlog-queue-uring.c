@@ -0,0 +1,427 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <liburing.h>
+
+/*
+ * The line echo server of test-backlog-queue.c on io_uring (kernel 5.19+,
+ * liburing 2.4+).
+ *
+ * - one multishot accept per listen socket, re-armed only when a CQE comes
+ *   without IORING_CQE_F_MORE; out of fds it sheds a connection with a
+ *   spare fd like -m epoll, or re-arms after 10 ms
+ * - recv picks a 16 KB buffer from a provided buffer ring, the data is
+ *   split into lines right away and the buffer goes back to the ring, so
+ *   idle connections hold no buffer
+ * - the echo is a send linked to the next recv: one submission per round
+ *   trip, and the connection does not read more while its answer is still
+ *   going out. A short send breaks the link, the rest is sent again.
+ *
+ * -t threads each have their own SO_REUSEPORT listen socket and ring, like
+ * -m epoll. Load with the same test-backlog-queue-client and compare the
+ * syscalls with perf stat -e raw_syscalls:sys_enter or strace -c -f; on
+ * SIGINT every thread also prints how many times it entered the kernel.
+ *
+ * gcc -O2 test-backlog-queue-uring.c -o test-backlog-queue-uring -luring -lpthread
+ * ./test-backlog-queue-uring [-p port] [-b backlog] [-t threads] [-e entries]
+ */
+
+#define READ_BUF        16384
+#define WRITE_BUF       65536       /* more than the 2 * READ_BUF of input it may get */
+#define BUF_COUNT       1024        /* provided buffers per thread, power of 2 */
+#define BUF_GROUP       0
+#define ACCEPT_BACKOFF_NS   10000000
+
+enum { OP_ACCEPT, OP_RECV, OP_SEND, OP_TIMEOUT };
+
+#define USER_DATA(c, op)    ((__u64)(uintptr_t)(c) | (op))
+#define USER_CONN(ud)       ((conn_t *)(uintptr_t)((ud) & ~(__u64)3))
+#define USER_OP(ud)         ((int)((ud) & 3))
+
+typedef struct {
+    int fd;
+    int inflight;                   /* SQEs not completed yet */
+    int dead;
+    size_t in_len;
+    size_t out_pos;
+    size_t out_len;
+    char in[READ_BUF * 2];
+    char out[WRITE_BUF];
+} conn_t;
+
+typedef struct {
+    pthread_t tid;
+    int id;
+    int sock;
+    struct io_uring ring;
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned long long accepted;
+    unsigned long long shed;        /* accepted and closed at once, out of fds */
+    int spare;                      /* an fd held for that, -1 if it could not be reopened */
+    struct __kernel_timespec backoff;
+    unsigned long long lines;
+    unsigned long long enters;
+    unsigned long long cqes;
+    unsigned long long nobufs;
+} worker_t;
+
+static int port = 9999;
+static int backlog = 2;
+static unsigned int entries = 4096;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static int listen_socket(void)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int optval = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(sock, backlog) == -1) {
+        perror("listen");
+        exit(1);
+    }
+    return sock;
+}
+
+/* the SQ is only full when a burst of CQEs asked for more SQEs: flush it */
+static struct io_uring_sqe *get_sqe(worker_t *w)
+{
+    struct io_uring_sqe *sqe;
+
+    while ((sqe = io_uring_get_sqe(&w->ring)) == NULL) {
+        io_uring_submit(&w->ring);
+        w->enters++;
+    }
+    return sqe;
+}
+
+static void submit_accept(worker_t *w)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    io_uring_prep_multishot_accept(sqe, w->sock, NULL, NULL, 0);
+    io_uring_sqe_set_data64(sqe, USER_DATA(NULL, OP_ACCEPT));
+}
+
+/* the accept again after ACCEPT_BACKOFF_NS, handle_timeout() arms it */
+static void submit_accept_later(worker_t *w)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    w->backoff.tv_sec = 0;
+    w->backoff.tv_nsec = ACCEPT_BACKOFF_NS;
+    io_uring_prep_timeout(sqe, &w->backoff, 0, 0);
+    io_uring_sqe_set_data64(sqe, USER_DATA(NULL, OP_TIMEOUT));
+}
+
+static void submit_recv(worker_t *w, conn_t *c)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    io_uring_prep_recv(sqe, c->fd, NULL, READ_BUF, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    io_uring_sqe_set_data64(sqe, USER_DATA(c, OP_RECV));
+    c->inflight++;
+}
+
+/* MSG_WAITALL makes a short send fail the link instead of running the recv */
+static void submit_send_recv(worker_t *w, conn_t *c)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    io_uring_prep_send(sqe, c->fd, c->out + c->out_pos, c->out_len - c->out_pos, MSG_WAITALL);
+    sqe->flags |= IOSQE_IO_LINK;
+    io_uring_sqe_set_data64(sqe, USER_DATA(c, OP_SEND));
+    c->inflight++;
+    submit_recv(w, c);
+}
+
+static void conn_release(conn_t *c)
+{
+    if (!c->dead) {
+        c->dead = 1;
+        close(c->fd);
+    }
+    if (c->inflight == 0) {
+        free(c);
+    }
+}
+
+/* move complete lines from in to out, a line that does not fit in is sent as is */
+static int conn_split_lines(conn_t *c)
+{
+    char *start = c->in, *end = c->in + c->in_len, *nl;
+    int lines = 0;
+
+    while (start < end && (nl = memchr(start, '\n', end - start)) != NULL) {
+        size_t len = nl + 1 - start;
+        memcpy(c->out + c->out_len, start, len);
+        c->out_len += len;
+        start = nl + 1;
+        lines++;
+    }
+    if (end - start >= READ_BUF) {
+        memcpy(c->out + c->out_len, start, end - start);
+        c->out_len += end - start;
+        start = end;
+        lines++;
+    }
+
+    c->in_len = end - start;
+    if (c->in_len && start != c->in) {
+        memmove(c->in, start, c->in_len);
+    }
+    return lines;
+}
+
+/*
+ * Out of fds (EMFILE, ENFILE) the accept fails at once, whether a
+ * connection is waiting or not, and the multishot accept ends. Re-armed
+ * right away it would fail again in a loop. Instead, give up the spare fd
+ * to accept a waiting connection and close it, so the client sees a close
+ * instead of hanging in the queue, and re-arm for the next one. With
+ * nothing waiting, or no spare, the accept is re-armed 10 ms later.
+ */
+static void accept_shed(worker_t *w)
+{
+    struct pollfd pfd = { w->sock, POLLIN, 0 };
+    int fd = -1;
+
+    if (w->spare < 0) {
+        w->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    if (w->spare >= 0 && poll(&pfd, 1, 0) == 1) {
+        /* the listen socket is blocking, but poll() said one is there */
+        close(w->spare);
+        fd = accept(w->sock, NULL, NULL);
+        if (fd >= 0) {
+            close(fd);
+            w->shed++;
+        }
+        w->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    if (fd >= 0) {
+        submit_accept(w);
+    } else {
+        submit_accept_later(w);
+    }
+}
+
+static void handle_accept(worker_t *w, struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+            accept_shed(w);
+        } else {
+            submit_accept(w);
+        }
+    }
+    if (cqe->res < 0) {
+        return;
+    }
+
+    int one = 1;
+    setsockopt(cqe->res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn_t *c = malloc(sizeof(conn_t));
+    c->fd = cqe->res;
+    c->inflight = c->dead = 0;
+    c->in_len = c->out_pos = c->out_len = 0;
+    w->accepted++;
+    submit_recv(w, c);
+}
+
+static void handle_recv(worker_t *w, conn_t *c, struct io_uring_cqe *cqe)
+{
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buf = w->bufs + (size_t)bid * READ_BUF;
+
+        if (cqe->res > 0 && !c->dead) {
+            memcpy(c->in + c->in_len, buf, cqe->res);
+            c->in_len += cqe->res;
+        }
+        io_uring_buf_ring_add(w->br, buf, READ_BUF, bid, io_uring_buf_ring_mask(BUF_COUNT), 0);
+        io_uring_buf_ring_advance(w->br, 1);
+    }
+
+    if (c->dead) {
+        conn_release(c);
+        return;
+    }
+    if (cqe->res == -ECANCELED) {
+        /* the send before it was short, handle_send takes over */
+        return;
+    }
+    if (cqe->res == -ENOBUFS) {
+        /* every buffer is in some other connection's recv, try again */
+        w->nobufs++;
+        submit_recv(w, c);
+        return;
+    }
+    if (cqe->res <= 0) {
+        conn_release(c);
+        return;
+    }
+
+    w->lines += conn_split_lines(c);
+    if (c->out_len) {
+        submit_send_recv(w, c);
+    } else {
+        submit_recv(w, c);
+    }
+}
+
+static void handle_send(worker_t *w, conn_t *c, struct io_uring_cqe *cqe)
+{
+    if (c->dead) {
+        conn_release(c);
+        return;
+    }
+    if (cqe->res < 0) {
+        conn_release(c);
+        return;
+    }
+
+    c->out_pos += cqe->res;
+    if (c->out_pos < c->out_len) {
+        submit_send_recv(w, c);
+    } else {
+        c->out_pos = c->out_len = 0;
+    }
+}
+
+static void *run_worker(void *arg)
+{
+    worker_t *w = arg;
+    struct io_uring_params params;
+    struct io_uring_cqe *cqe;
+    int ret, i;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL;
+    ret = io_uring_queue_init_params(entries, &w->ring, &params);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        exit(1);
+    }
+
+    w->br = io_uring_setup_buf_ring(&w->ring, BUF_COUNT, BUF_GROUP, 0, &ret);
+    if (!w->br) {
+        fprintf(stderr, "io_uring_setup_buf_ring: %s\n", strerror(-ret));
+        exit(1);
+    }
+    w->bufs = malloc((size_t)BUF_COUNT * READ_BUF);
+    for (i = 0; i < BUF_COUNT; i++) {
+        io_uring_buf_ring_add(w->br, w->bufs + (size_t)i * READ_BUF, READ_BUF, i,
+            io_uring_buf_ring_mask(BUF_COUNT), i);
+    }
+    io_uring_buf_ring_advance(w->br, BUF_COUNT);
+
+    w->sock = listen_socket();
+    w->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    submit_accept(w);
+
+    while (!stop) {
+        struct __kernel_timespec ts = { 1, 0 };
+        unsigned int head, count = 0;
+
+        ret = io_uring_submit_and_wait_timeout(&w->ring, &cqe, 1, &ts, NULL);
+        w->enters++;
+        if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+            fprintf(stderr, "io_uring_submit_and_wait_timeout: %s\n", strerror(-ret));
+            break;
+        }
+
+        io_uring_for_each_cqe(&w->ring, head, cqe) {
+            __u64 ud = io_uring_cqe_get_data64(cqe);
+            switch (USER_OP(ud)) {
+            case OP_ACCEPT: handle_accept(w, cqe); break;
+            case OP_RECV: USER_CONN(ud)->inflight--; handle_recv(w, USER_CONN(ud), cqe); break;
+            case OP_SEND: USER_CONN(ud)->inflight--; handle_send(w, USER_CONN(ud), cqe); break;
+            case OP_TIMEOUT: submit_accept(w); break;
+            }
+            count++;
+        }
+        io_uring_cq_advance(&w->ring, count);
+        w->cqes += count;
+    }
+
+    /* connections still open are left to exit() */
+    io_uring_free_buf_ring(&w->ring, w->br, BUF_COUNT, BUF_GROUP);
+    io_uring_queue_exit(&w->ring);
+    close(w->sock);
+    if (w->spare >= 0) {
+        close(w->spare);
+    }
+    free(w->bufs);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int nthreads = 1;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "p:b:t:e:")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'b': backlog = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'e': entries = atoi(optarg); break;
+        default:
+            fprintf(stderr, "%s [-p port] [-b backlog] [-t threads] [-e entries]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    unsigned long long lines = 0, enters = 0;
+    for (i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        worker_t *w = &workers[i];
+        pthread_join(w->tid, NULL);
+        printf("thread %d: accepted %llu, shed %llu, lines %llu, io_uring_enter %llu, cqes %llu, out of buffers %llu\n",
+            i, w->accepted, w->shed, w->lines, w->enters, w->cqes, w->nobufs);
+        lines += w->lines;
+        enters += w->enters;
+    }
+    printf("total lines %llu, %.2f lines per io_uring_enter\n", lines, enters ? (double)lines / enters : 0.0);
+    free(workers);
+    return 0;
+}
@@ -1,26 +1,80 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 
-int main(void)
+/*
+ * Line echo server.
+ *
+ *   blocking: one accept() at a time, read() one byte at a time and print
+ *             every line (-q to not), the original test for a tiny
+ *             listen() backlog (-b 2)
+ *   epoll:    -t threads, each with its own SO_REUSEPORT listen socket and
+ *             epoll instance, edge-triggered accept and read, 16 KB reads
+ *             split into lines with memchr()
+ *
+ * gcc -O2 test-backlog-queue.c -o test-backlog-queue -lpthread
+ * ./test-backlog-queue [-m blocking|epoll] [-p port] [-b backlog] [-t threads] [-q]
+ *
+ * Load with test-backlog-queue-client. SIGINT prints lines echoed per thread.
+ */
+
+#define READ_BUF    16384
+#define WRITE_BUF   65536
+#define MAX_EVENTS  256
+
+static int port = 9999;
+static int backlog = 2;
+static int quiet;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static int listen_socket(int reuseport)
 {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     int optval = 1;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (reuseport) {
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+    }
 
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(struct sockaddr_in));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(9999);
+    addr.sin_port = htons(port);
 
-    bind(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
-    listen(sock, 2);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(sock, backlog) == -1) {
+        perror("listen");
+        exit(1);
+    }
+    return sock;
+}
+
+static void run_blocking(void)
+{
+    int sock = listen_socket(0);
 
     int conn;
-    while ((conn = accept(sock, NULL, NULL)) >= 0) {
+    while (!stop && (conn = accept(sock, NULL, NULL)) >= 0) {
         char buf[1024];
         char *ptr = buf;
         char c;
@@ -32,10 +86,13 @@ int main(void)
             }
             *ptr = c;
             ptr++;
-            if (c == '\n') {
+            /* a line longer than buf goes out in pieces */
+            if (c == '\n' || ptr == buf + sizeof(buf) - 1) {
                 *ptr = 0;
                 write(conn, buf, ptr - buf);
-                printf("received: %s", buf);
+                if (!quiet) {
+                    printf("received: %s", buf);
+                }
                 ptr = buf;
             }
         }
@@ -45,3 +102,266 @@ close_conn:
 
     close(sock);
 }
+
+typedef struct {
+    int fd;
+    size_t in_len;
+    size_t out_pos;
+    size_t out_len;
+    char in[READ_BUF];
+    char out[WRITE_BUF];
+} conn_t;
+
+typedef struct {
+    pthread_t tid;
+    int id;
+    unsigned long long lines;
+    unsigned long long accepted;
+    unsigned long long shed;    /* accepted and closed at once, out of fds */
+    int spare;                  /* an fd held for that, -1 if it could not be reopened */
+    int backed_off;             /* pending connections left behind, accept_all() again soon */
+} worker_t;
+
+static void conn_close(int epfd, conn_t *c)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
+}
+
+/* write what is queued; 0 when all out, 1 on EAGAIN, -1 on error */
+static int conn_flush(conn_t *c)
+{
+    while (c->out_pos < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? 1 : -1;
+        }
+        c->out_pos += n;
+    }
+    c->out_pos = c->out_len = 0;
+    return 0;
+}
+
+/* move complete lines from in to out, returns the number of lines */
+static int conn_split_lines(conn_t *c)
+{
+    char *start = c->in, *end = c->in + c->in_len, *nl;
+    int lines = 0;
+
+    while (start < end && (nl = memchr(start, '\n', end - start)) != NULL) {
+        size_t len = nl + 1 - start;
+        if (c->out_len + len > WRITE_BUF) {
+            break;
+        }
+        memcpy(c->out + c->out_len, start, len);
+        c->out_len += len;
+        start = nl + 1;
+        lines++;
+    }
+
+    /* no newline in a full buffer: echo it as one line */
+    if (start == c->in && c->in_len == READ_BUF && c->out_len + READ_BUF <= WRITE_BUF) {
+        memcpy(c->out + c->out_len, c->in, READ_BUF);
+        c->out_len += READ_BUF;
+        start = end;
+        lines++;
+    }
+
+    c->in_len = end - start;
+    if (c->in_len && start != c->in) {
+        memmove(c->in, start, c->in_len);
+    }
+    return lines;
+}
+
+/*
+ * Edge-triggered: keep going until read() says EAGAIN, unless the output
+ * is stuck, then EPOLLOUT brings us back.
+ */
+static void conn_handle(worker_t *w, int epfd, conn_t *c)
+{
+    while (1) {
+        int rv = conn_flush(c);
+        if (rv < 0) {
+            conn_close(epfd, c);
+            return;
+        }
+        if (rv > 0) {
+            return;
+        }
+
+        if (c->in_len == READ_BUF) {
+            /* a full buffer that could not be moved: wait for output room */
+            w->lines += conn_split_lines(c);
+            continue;
+        }
+
+        ssize_t n = read(c->fd, c->in + c->in_len, READ_BUF - c->in_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (n <= 0) {
+            conn_close(epfd, c);
+            return;
+        }
+        c->in_len += n;
+        w->lines += conn_split_lines(c);
+    }
+}
+
+/*
+ * The listen socket is edge-triggered: accept_all() has to drain it, or
+ * the connections left in the queue are not reported again. Out of fds
+ * (EMFILE, ENFILE) it gives up the spare fd to accept one and close it,
+ * so the client sees a close instead of hanging in the queue. Without a
+ * spare it sets backed_off and the worker retries on its next wakeup.
+ */
+static void accept_all(worker_t *w, int epfd, int sock)
+{
+    w->backed_off = 0;
+    while (1) {
+        int fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                if (w->spare < 0) {
+                    w->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                }
+                if (w->spare < 0) {
+                    w->backed_off = 1;
+                    return;
+                }
+                close(w->spare);
+                fd = accept(sock, NULL, NULL);
+                if (fd >= 0) {
+                    close(fd);
+                    w->shed++;
+                }
+                w->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (fd < 0 && errno == EAGAIN) {
+                    return;
+                }
+                continue;
+            }
+            if (errno != EAGAIN) {
+                perror("accept4");
+            }
+            return;
+        }
+
+        /* a line split over two writes would wait for the delayed ACK */
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn_t *c = malloc(sizeof(conn_t));
+        c->fd = fd;
+        c->in_len = c->out_pos = c->out_len = 0;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        w->accepted++;
+
+        /* data may have arrived before the ADD, edge-triggered would miss it */
+        conn_handle(w, epfd, c);
+    }
+}
+
+static void *run_epoll_worker(void *arg)
+{
+    worker_t *w = arg;
+    int sock = listen_socket(1);
+    int epfd = epoll_create1(0);
+    struct epoll_event ev, events[MAX_EVENTS];
+
+    w->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+
+    while (!stop) {
+        int i, n = epoll_wait(epfd, events, MAX_EVENTS, w->backed_off ? 10 : 1000);
+        if (w->backed_off) {
+            accept_all(w, epfd, sock);
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_all(w, epfd, sock);
+            } else {
+                conn_handle(w, epfd, events[i].data.ptr);
+            }
+        }
+    }
+
+    if (w->spare >= 0) {
+        close(w->spare);
+    }
+    close(epfd);
+    close(sock);
+    return NULL;
+}
+
+static void run_epoll(int nthreads)
+{
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    unsigned long long lines = 0;
+    int i;
+
+    for (i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        pthread_create(&workers[i].tid, NULL, run_epoll_worker, &workers[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        printf("thread %d: accepted %llu, shed %llu, lines %llu\n", i, workers[i].accepted, workers[i].shed,
+            workers[i].lines);
+        lines += workers[i].lines;
+    }
+    printf("total lines %llu\n", lines);
+    free(workers);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mode = "blocking";
+    int nthreads = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:p:b:t:q")) != -1) {
+        switch (opt) {
+        case 'm': mode = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'b': backlog = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'q': quiet = 1; break;
+        default:
+            fprintf(stderr, "%s [-m blocking|epoll] [-p port] [-b backlog] [-t threads] [-q]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (strcmp(mode, "epoll") == 0) {
+        run_epoll(nthreads);
+    } else {
+        run_blocking();
+    }
+    return 0;
+}
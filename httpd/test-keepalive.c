@@ -0,0 +1,722 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "histogram.h"
+
+/*
+ * Keep-alive load generator, the C version of test-keepalive.php and
+ * test-keepalive-timeout-max.php.
+ *
+ * -c connections over -t epoll threads. Every connection sends GET -u,
+ * reads the whole response (Content-Length, chunked or until close), waits
+ * -k ms and sends the next one on the same connection, -n requests per
+ * connection (0 = until the server closes it). A closed connection is
+ * replaced by a new one until -d seconds are over.
+ *
+ * Why connections ended:
+ *   client limit      -n requests done
+ *   Connection: close the server said so, httpd does on the
+ *                     MaxKeepAliveRequests'th request
+ *   idle close        EOF while waiting -k ms: KeepAliveTimeout, the idle
+ *                     times are printed, set -k above the timeout to see it
+ *   closed on reuse   EOF or RST right after the next request went out, the
+ *                     server closed while it was on its way; retried on a
+ *                     new connection, not counted as an error
+ *   error             anything else; the connection is reopened after
+ *                     10 ms, doubling up to 1 s while errors follow each
+ *                     other, so a server that is down is not flooded;
+ *                     a socket() that fails (out of fds) backs off the
+ *                     same way and is counted apart, it opened nothing
+ *
+ * gcc -O2 test-keepalive.c -o test-keepalive -lpthread
+ * ./test-keepalive [-h host] [-p port] [-H Host] [-u path] [-c conns] [-t threads] [-n requests] [-k ms] [-d secs]
+ *
+ * Like test-keepalive-timeout-max.php (300 clients, one request each):
+ * ./test-keepalive -h a.example.com -p 8888 -c 300 -n 1 -d 30
+ */
+
+#define HDR_BUF         8192
+#define MAX_EVENTS      256
+#define BACKOFF_MIN_MS  10
+#define BACKOFF_MAX_MS  1000
+
+enum { ST_CONNECTING, ST_WRITING, ST_HEADERS, ST_BODY, ST_THINKING, ST_BACKOFF };
+enum { BODY_LENGTH, BODY_CHUNKED, BODY_UNTIL_CLOSE };
+enum { CH_SIZE, CH_DATA, CH_DATA_END, CH_TRAILER };
+enum { CLOSE_LIMIT, CLOSE_HEADER, CLOSE_IDLE, CLOSE_REUSE, CLOSE_ERROR, CLOSE_REASONS };
+
+static const char *close_names[CLOSE_REASONS] = {
+    "client limit", "Connection: close", "idle close", "closed on reuse", "error"
+};
+
+typedef struct {
+    int fd;
+    int state;
+    int heap_idx;
+    int requests;                   /* responses read on this connection */
+    int errors;                     /* CLOSE_ERRORs since the last response */
+    uint64_t connect_start;
+    uint64_t req_start;
+    uint64_t last_done;
+    uint64_t wake_at;
+    size_t out_pos;
+    size_t hdr_len;
+    int body_mode;
+    long long body_left;
+    int chunk_state;
+    int chunk_ext;
+    int trailer_len;
+    int got_bytes;                  /* of the current response */
+    int server_close;
+    char hdr[HDR_BUF];
+} ka_conn_t;
+
+typedef struct {
+    pthread_t tid;
+    int epfd;
+    int nconns;
+    ka_conn_t *conns;
+    ka_conn_t **heap;               /* thinking and backing off connections by wake_at */
+    int heap_len;
+    ka_conn_t **reopen;             /* closed in this round, opened after it */
+    int reopen_len;
+
+    unsigned long long requests;
+    unsigned long long non_2xx;
+    unsigned long long opened;
+    unsigned long long socket_errors;
+    unsigned long long closed[CLOSE_REASONS];
+    int ka_timeout;                 /* from Keep-Alive: timeout=, max= */
+    int ka_max;
+    histogram_t latency;
+    histogram_t connect;
+    histogram_t reuse;
+    histogram_t reuse_header;       /* requests on connections that got Connection: close */
+    histogram_t idle;
+} ka_thread_t;
+
+static struct sockaddr_storage server;
+static socklen_t server_len;
+static char request[1024];
+static size_t request_len;
+static int max_requests;
+static int think_ms;
+static volatile int done;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void heap_swap(ka_thread_t *t, int i, int j)
+{
+    ka_conn_t *c = t->heap[i];
+    t->heap[i] = t->heap[j];
+    t->heap[j] = c;
+    t->heap[i]->heap_idx = i;
+    t->heap[j]->heap_idx = j;
+}
+
+static void heap_fix(ka_thread_t *t, int i)
+{
+    while (i > 0 && t->heap[(i - 1) / 2]->wake_at > t->heap[i]->wake_at) {
+        heap_swap(t, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < t->heap_len && t->heap[l]->wake_at < t->heap[m]->wake_at) {
+            m = l;
+        }
+        if (r < t->heap_len && t->heap[r]->wake_at < t->heap[m]->wake_at) {
+            m = r;
+        }
+        if (m == i) {
+            return;
+        }
+        heap_swap(t, i, m);
+        i = m;
+    }
+}
+
+static void heap_push(ka_thread_t *t, ka_conn_t *c)
+{
+    c->heap_idx = t->heap_len;
+    t->heap[t->heap_len++] = c;
+    heap_fix(t, c->heap_idx);
+}
+
+static void heap_remove(ka_thread_t *t, ka_conn_t *c)
+{
+    int i = c->heap_idx;
+
+    if (i < 0) {
+        return;
+    }
+    t->heap_len--;
+    if (i != t->heap_len) {
+        heap_swap(t, i, t->heap_len);
+        heap_fix(t, i);
+    }
+    c->heap_idx = -1;
+}
+
+static void conn_watch(ka_thread_t *t, ka_conn_t *c, int op, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events | EPOLLRDHUP;
+    ev.data.ptr = c;
+    epoll_ctl(t->epfd, op, c->fd, &ev);
+}
+
+/* c has no socket after an error: open it again later, the later the more errors in a row */
+static void conn_backoff(ka_thread_t *t, ka_conn_t *c, uint64_t now)
+{
+    int ms = BACKOFF_MIN_MS << (c->errors < 7 ? c->errors : 7);
+
+    c->errors++;
+    c->state = ST_BACKOFF;
+    c->wake_at = now + (uint64_t)(ms < BACKOFF_MAX_MS ? ms : BACKOFF_MAX_MS) * 1000000;
+    heap_push(t, c);
+}
+
+static void conn_open(ka_thread_t *t, ka_conn_t *c)
+{
+    int one = 1;
+
+    c->state = ST_CONNECTING;
+    c->heap_idx = -1;
+    c->requests = 0;
+    c->fd = socket(server.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        t->socket_errors++;
+        conn_backoff(t, c, now_ns());
+        return;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->connect_start = now_ns();
+    t->opened++;
+    if (connect(c->fd, (struct sockaddr *)&server, server_len) < 0 && errno != EINPROGRESS) {
+        /* leave it to the EPOLLERR that follows */
+    }
+    conn_watch(t, c, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+static void conn_close(ka_thread_t *t, ka_conn_t *c, int reason)
+{
+    uint64_t now = now_ns();
+
+    heap_remove(t, c);
+    t->closed[reason]++;
+    hist_record(&t->reuse, c->requests);
+    if (reason == CLOSE_HEADER) {
+        hist_record(&t->reuse_header, c->requests);
+    }
+    if (reason == CLOSE_IDLE) {
+        hist_record(&t->idle, now - c->last_done);
+    }
+    epoll_ctl(t->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+
+    if (done) {
+        return;
+    }
+    if (reason == CLOSE_ERROR) {
+        conn_backoff(t, c, now);
+    } else {
+        /* not now: events of this epoll_wait() round may still point to c */
+        t->reopen[t->reopen_len++] = c;
+    }
+}
+
+static void request_send(ka_thread_t *t, ka_conn_t *c)
+{
+    while (c->out_pos < request_len) {
+        ssize_t n = write(c->fd, request + c->out_pos, request_len - c->out_pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return;
+            }
+            conn_close(t, c, c->requests ? CLOSE_REUSE : CLOSE_ERROR);
+            return;
+        }
+        c->out_pos += n;
+    }
+
+    c->state = ST_HEADERS;
+    conn_watch(t, c, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+static void request_start(ka_thread_t *t, ka_conn_t *c)
+{
+    c->state = ST_WRITING;
+    c->req_start = now_ns();
+    c->out_pos = 0;
+    c->hdr_len = 0;
+    c->got_bytes = 0;
+    c->server_close = 0;
+    conn_watch(t, c, EPOLL_CTL_MOD, EPOLLOUT);
+    request_send(t, c);
+}
+
+static void response_done(ka_thread_t *t, ka_conn_t *c)
+{
+    c->last_done = now_ns();
+    hist_record(&t->latency, c->last_done - c->req_start);
+    c->requests++;
+    c->errors = 0;
+    t->requests++;
+
+    if (c->server_close) {
+        conn_close(t, c, CLOSE_HEADER);
+    } else if (max_requests && c->requests >= max_requests) {
+        conn_close(t, c, CLOSE_LIMIT);
+    } else if (done) {
+        return;
+    } else if (think_ms > 0) {
+        /* keep reading: an EOF now is the server's idle close */
+        c->state = ST_THINKING;
+        c->wake_at = c->last_done + (uint64_t)think_ms * 1000000;
+        heap_push(t, c);
+    } else {
+        request_start(t, c);
+    }
+}
+
+/* the value of a header line, NULL if the line is another header */
+static const char *header_value(const char *line, const char *name)
+{
+    size_t len = strlen(name);
+
+    if (strncasecmp(line, name, len) != 0 || line[len] != ':') {
+        return NULL;
+    }
+    line += len + 1;
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    return line;
+}
+
+static int parse_headers(ka_thread_t *t, ka_conn_t *c)
+{
+    char *line, *save;
+    int status = 0;
+
+    c->body_mode = BODY_UNTIL_CLOSE;
+    c->body_left = 0;
+    for (line = strtok_r(c->hdr, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save)) {
+        const char *v;
+        if (status == 0) {
+            if (sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+                return -1;
+            }
+            continue;
+        }
+        if ((v = header_value(line, "Content-Length")) != NULL) {
+            c->body_mode = BODY_LENGTH;
+            c->body_left = atoll(v);
+        } else if ((v = header_value(line, "Transfer-Encoding")) != NULL) {
+            if (strcasestr(v, "chunked")) {
+                c->body_mode = BODY_CHUNKED;
+                c->chunk_state = CH_SIZE;
+                c->chunk_ext = 0;
+            }
+        } else if ((v = header_value(line, "Connection")) != NULL) {
+            if (strcasestr(v, "close")) {
+                c->server_close = 1;
+            }
+        } else if ((v = header_value(line, "Keep-Alive")) != NULL) {
+            const char *p;
+            if ((p = strstr(v, "timeout=")) != NULL) {
+                t->ka_timeout = atoi(p + 8);
+            }
+            if ((p = strstr(v, "max=")) != NULL && atoi(p + 4) > t->ka_max) {
+                t->ka_max = atoi(p + 4);
+            }
+        }
+    }
+
+    if (status < 200 || status >= 400) {
+        t->non_2xx++;
+    }
+    /* responses that never have a body */
+    if (status == 204 || status == 304 || status < 200) {
+        c->body_mode = BODY_LENGTH;
+        c->body_left = 0;
+    }
+    if (c->body_mode == BODY_UNTIL_CLOSE) {
+        c->server_close = 1;
+    }
+    return 0;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* eat body bytes, 1 when the response is complete */
+static int consume_body(ka_conn_t *c, const char *p, size_t n)
+{
+    const char *end = p + n;
+
+    if (c->body_mode == BODY_UNTIL_CLOSE) {
+        return 0;
+    }
+    if (c->body_mode == BODY_LENGTH) {
+        c->body_left -= n < (size_t)c->body_left ? (long long)n : c->body_left;
+        return c->body_left == 0;
+    }
+
+    while (p < end) {
+        switch (c->chunk_state) {
+        case CH_SIZE:
+            /* hex size, maybe ;extensions, then CRLF */
+            if (*p == '\n') {
+                c->chunk_state = c->body_left ? CH_DATA : CH_TRAILER;
+                c->chunk_ext = 0;
+                c->trailer_len = 0;
+            } else if (*p == ';') {
+                c->chunk_ext = 1;
+            } else if (!c->chunk_ext && hex_value(*p) >= 0) {
+                c->body_left = c->body_left * 16 + hex_value(*p);
+            }
+            p++;
+            break;
+        case CH_DATA: {
+            size_t take = (size_t)(end - p) < (size_t)c->body_left ? (size_t)(end - p) : (size_t)c->body_left;
+            p += take;
+            c->body_left -= take;
+            if (c->body_left == 0) {
+                c->chunk_state = CH_DATA_END;
+            }
+            break;
+        }
+        case CH_DATA_END:
+            if (*p++ == '\n') {
+                c->chunk_state = CH_SIZE;
+                c->body_left = 0;
+            }
+            break;
+        case CH_TRAILER:
+            /* trailer lines until an empty one */
+            if (*p == '\n') {
+                if (c->trailer_len == 0) {
+                    return 1;
+                }
+                c->trailer_len = 0;
+            } else if (*p != '\r') {
+                c->trailer_len++;
+            }
+            p++;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void conn_read(ka_thread_t *t, ka_conn_t *c)
+{
+    char buf[16384];
+
+    while (c->fd >= 0) {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (n <= 0) {
+            if (c->state == ST_THINKING) {
+                conn_close(t, c, CLOSE_IDLE);
+            } else if (c->state == ST_BODY && c->body_mode == BODY_UNTIL_CLOSE) {
+                response_done(t, c);
+            } else {
+                conn_close(t, c, c->requests && !c->got_bytes ? CLOSE_REUSE : CLOSE_ERROR);
+            }
+            return;
+        }
+
+        if (c->state == ST_THINKING) {
+            /* nothing was asked */
+            conn_close(t, c, CLOSE_ERROR);
+            return;
+        }
+        c->got_bytes = 1;
+
+        char *p = buf;
+        size_t len = n;
+        if (c->state == ST_HEADERS) {
+            size_t old = c->hdr_len;
+            size_t take = len < HDR_BUF - 1 - c->hdr_len ? len : HDR_BUF - 1 - c->hdr_len;
+            char *eoh;
+
+            memcpy(c->hdr + c->hdr_len, p, take);
+            c->hdr_len += take;
+            c->hdr[c->hdr_len] = '\0';
+            if ((eoh = strstr(c->hdr, "\r\n\r\n")) == NULL) {
+                if (c->hdr_len == HDR_BUF - 1) {
+                    conn_close(t, c, CLOSE_ERROR);
+                    return;
+                }
+                continue;
+            }
+            size_t hdr_end = eoh + 4 - c->hdr;
+            *eoh = '\0';
+            if (parse_headers(t, c) < 0) {
+                conn_close(t, c, CLOSE_ERROR);
+                return;
+            }
+            c->state = ST_BODY;
+            p += hdr_end - old;
+            len -= hdr_end - old;
+            if (c->body_mode == BODY_LENGTH && c->body_left == 0) {
+                response_done(t, c);
+                return;
+            }
+        }
+        if (consume_body(c, p, len)) {
+            /* level-triggered, whatever comes next is seen in the new state */
+            response_done(t, c);
+            return;
+        }
+    }
+}
+
+static void conn_event(ka_thread_t *t, ka_conn_t *c, uint32_t events)
+{
+    if (c->state == ST_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            conn_close(t, c, CLOSE_ERROR);
+            return;
+        }
+        hist_record(&t->connect, now_ns() - c->connect_start);
+        request_start(t, c);
+        return;
+    }
+    if (c->state == ST_WRITING) {
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            conn_close(t, c, c->requests ? CLOSE_REUSE : CLOSE_ERROR);
+            return;
+        }
+        request_send(t, c);
+        return;
+    }
+    conn_read(t, c);
+}
+
+static void *run_thread(void *arg)
+{
+    ka_thread_t *t = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int i;
+
+    hist_init(&t->latency);
+    hist_init(&t->connect);
+    hist_init(&t->reuse);
+    hist_init(&t->reuse_header);
+    hist_init(&t->idle);
+    t->epfd = epoll_create1(0);
+    t->conns = calloc(t->nconns, sizeof(ka_conn_t));
+    t->heap = calloc(t->nconns, sizeof(ka_conn_t *));
+    t->reopen = calloc(t->nconns, sizeof(ka_conn_t *));
+    for (i = 0; i < t->nconns; i++) {
+        conn_open(t, &t->conns[i]);
+    }
+
+    while (!done) {
+        int timeout = 100;
+        if (t->heap_len) {
+            int64_t wait = ((int64_t)t->heap[0]->wake_at - (int64_t)now_ns()) / 1000000;
+            timeout = wait < 0 ? 0 : wait < timeout ? wait : timeout;
+        }
+
+        int n = epoll_wait(t->epfd, events, MAX_EVENTS, timeout);
+        for (i = 0; i < n; i++) {
+            ka_conn_t *c = events[i].data.ptr;
+            if (c->fd >= 0) {
+                conn_event(t, c, events[i].events);
+            }
+        }
+
+        uint64_t now = now_ns();
+        while (t->heap_len && t->heap[0]->wake_at <= now) {
+            ka_conn_t *c = t->heap[0];
+            heap_remove(t, c);
+            if (c->state == ST_BACKOFF) {
+                conn_open(t, c);
+            } else {
+                request_start(t, c);
+            }
+        }
+
+        while (t->reopen_len && !done) {
+            conn_open(t, t->reopen[--t->reopen_len]);
+        }
+    }
+
+    for (i = 0; i < t->nconns; i++) {
+        if (t->conns[i].fd >= 0) {
+            hist_record(&t->reuse, t->conns[i].requests);
+            close(t->conns[i].fd);
+        }
+    }
+    close(t->epfd);
+    free(t->heap);
+    free(t->reopen);
+    free(t->conns);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = "127.0.0.1", *host_header = NULL, *path = "/";
+    char port[16] = "80";
+    int nconns = 100, nthreads = 1, duration = 10;
+    int opt, i, j;
+
+    while ((opt = getopt(argc, argv, "h:p:H:u:c:t:n:k:d:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': snprintf(port, sizeof(port), "%s", optarg); break;
+        case 'H': host_header = optarg; break;
+        case 'u': path = optarg; break;
+        case 'c': nconns = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'n': max_requests = atoi(optarg); break;
+        case 'k': think_ms = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        default:
+            fprintf(stderr, "%s [-h host] [-p port] [-H Host] [-u path] [-c conns] [-t threads] [-n requests] [-k ms] [-d secs]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads > nconns) {
+        nthreads = nconns;
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        fprintf(stderr, "cannot resolve %s\n", host);
+        return 1;
+    }
+    memcpy(&server, res->ai_addr, res->ai_addrlen);
+    server_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    if (!host_header) {
+        static char hbuf[300];
+        snprintf(hbuf, sizeof(hbuf), "%s:%s", host, port);
+        host_header = hbuf;
+    }
+    request_len = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: test-keepalive\r\nConnection: keep-alive\r\n\r\n",
+        path, host_header);
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)nconns + 64) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)nconns + 64 ? rl.rlim_max : (rlim_t)nconns + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    ka_thread_t *threads = calloc(nthreads, sizeof(ka_thread_t));
+    uint64_t start = now_ns();
+    for (i = 0; i < nthreads; i++) {
+        threads[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+        pthread_create(&threads[i].tid, NULL, run_thread, &threads[i]);
+    }
+    sleep(duration);
+    done = 1;
+
+    ka_thread_t total;
+    memset(&total, 0, sizeof(total));
+    hist_init(&total.latency);
+    hist_init(&total.connect);
+    hist_init(&total.reuse);
+    hist_init(&total.reuse_header);
+    hist_init(&total.idle);
+    for (i = 0; i < nthreads; i++) {
+        ka_thread_t *t = &threads[i];
+        pthread_join(t->tid, NULL);
+        total.requests += t->requests;
+        total.non_2xx += t->non_2xx;
+        total.opened += t->opened;
+        total.socket_errors += t->socket_errors;
+        for (j = 0; j < CLOSE_REASONS; j++) {
+            total.closed[j] += t->closed[j];
+        }
+        if (t->ka_timeout) {
+            total.ka_timeout = t->ka_timeout;
+        }
+        if (t->ka_max > total.ka_max) {
+            total.ka_max = t->ka_max;
+        }
+        hist_merge(&total.latency, &t->latency);
+        hist_merge(&total.connect, &t->connect);
+        hist_merge(&total.reuse, &t->reuse);
+        hist_merge(&total.reuse_header, &t->reuse_header);
+        hist_merge(&total.idle, &t->idle);
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    printf("GET %s from %s:%s, %d connections, %d threads, %d requests per connection, think %d ms\n",
+        path, host, port, nconns, nthreads, max_requests, think_ms);
+    printf("%llu requests in %.2f s, %.1f requests/s, %llu not 2xx/3xx\n",
+        total.requests, secs, total.requests / secs, total.non_2xx);
+    hist_print(stdout, "latency", &total.latency, 1000000.0, "ms");
+    hist_print(stdout, "connect", &total.connect, 1000000.0, "ms");
+
+    printf("%llu connections opened, %llu socket() failed, closed by:", total.opened, total.socket_errors);
+    for (j = 0; j < CLOSE_REASONS; j++) {
+        printf(" %s %llu%s", close_names[j], total.closed[j], j + 1 < CLOSE_REASONS ? "," : "\n");
+    }
+    hist_print(stdout, "per connection", &total.reuse, 1.0, "requests");
+    if (total.ka_timeout || total.ka_max) {
+        printf("server sent Keep-Alive: timeout=%d, max=%d\n", total.ka_timeout, total.ka_max);
+    }
+    if (total.reuse_header.total) {
+        printf("MaxKeepAliveRequests is about %llu (requests before Connection: close, p50)\n",
+            (unsigned long long)hist_percentile(&total.reuse_header, 0.5));
+    }
+    if (total.idle.total) {
+        hist_print(stdout, "idle before the server closed", &total.idle, 1000000.0, "ms");
+        printf("KeepAliveTimeout is about %.1f s\n", hist_percentile(&total.idle, 0.5) / 1e9);
+    }
+
+    free(threads);
+    return 0;
+}
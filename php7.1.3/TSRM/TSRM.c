@@ -14,17 +14,51 @@
 
 
 #include <stdio.h>
+#include <string.h>
 
 #include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sched.h>
 
 typedef struct _tsrm_tls_entry tsrm_tls_entry;
+typedef struct _tsrm_old_storage tsrm_old_storage;
 
+struct _tsrm_old_storage {
+	void **storage;
+	tsrm_old_storage *next;
+};
+
+typedef struct {
+	uint64_t ctor_ns;
+	int state;				/* TSRM_RSRC_* */
+} tsrm_rsrc_stat;
+
+#define TSRM_DIRTY_BITS		(8 * sizeof(unsigned long))
 
+
+/* storage and count first, they are the tsrm_ls_header TSRM.h reads */
 struct _tsrm_tls_entry {
 	void **storage;
-	int count;
+	int count;				/* constructed; behind size while the ctors of new ids run */
 	THREAD_T thread_id;
-	tsrm_tls_entry *next;
+	int size;				/* of storage */
+	THREAD_T grower;		/* the thread running those ctors, 0 if none */
+	pthread_mutex_t lock;	/* storage against ts_allocate_id()/ts_free_id() of other threads */
+	int dead;				/* out of the table, ts_free_thread() is running the dtors */
+	tsrm_old_storage *old_storage;	/* replaced arrays, the owner may still be reading one */
+	size_t block_size;		/* resources with an offset below this live in the entry */
+	tsrm_rsrc_stat *stats;	/* count of them, written under lock once the entry is in the table */
+	int tid;				/* kernel thread id, 0 if another thread created the entry */
+	int all_dirty;			/* ts_resource_dirty(0) */
+	/*
+	 * bit i: reset resource i before the context is reused. Not in stats,
+	 * which another thread's ts_resource_ex() may realloc(): only the
+	 * thread the entry is current in, or the one releasing it, touch it.
+	 */
+	unsigned long *dirty;
+	int dirty_words;
 };
 
 
@@ -33,20 +67,131 @@ typedef struct {
 	ts_allocate_ctor ctor;
 	ts_allocate_dtor dtor;
 	int done;
+	size_t fast_offset;		/* from the entry, 0 if it is malloc()ed on its own */
+	tsrm_resource_stats *stats;	/* not copied with the table, the counters stay put */
 } tsrm_resource_type;
 
+/*
+ * Block mode (tsrm_reserve()): a thread's entry, the resources that got an
+ * offset and its first storage array are one allocation,
+ *
+ *   [tsrm_tls_entry][resource 0][resource 1]...[reserved][storage[count]]
+ *
+ * and resource i is at (char *) entry + fast_offset, the same for every
+ * thread; storage[i] points there too, so TSRMG() keeps working.
+ */
+#define TSRM_ALIGNMENT			16
+#define TSRM_ALIGNED_SIZE(size)	(((size) + TSRM_ALIGNMENT - 1) & ~((size_t) TSRM_ALIGNMENT - 1))
+#define TSRM_ENTRY_SIZE			TSRM_ALIGNED_SIZE(sizeof(tsrm_tls_entry))
+#define TSRM_INLINE_STORAGE(p)	((void **) ((char *) (p) + TSRM_ENTRY_SIZE + (p)->block_size))
+
+
+/*
+ * The thread table: open addressing, linear probing, keyed by thread id.
+ *
+ * Lookups, inserts and removals are lock-free. A slot's thread id is set
+ * once with a CAS and never cleared, removing a thread only sets the entry
+ * to NULL; a thread id that comes back (pthread ids are reused) gets its old
+ * slot. When TSRM_MAX_LOAD percent of the slots have a thread id the table
+ * is copied into a new one: a copier freezes every slot (empty ones get
+ * TSRM_SLOT_FROZEN, entries the TSRM_ENTRY_MOVED bit) and whoever runs into
+ * a frozen slot goes on in map->next. The copy is done TSRM_COPY_CHUNK slots
+ * at a time by the inserts and removals that come along while it is going
+ * on, no thread copies the whole table; the one that finishes the last
+ * chunk makes the new table current. tsrm_grow_mutex is only taken to
+ * start a copy and to walk the whole table, the fast path never sees it.
+ *
+ * Entries, storage arrays, old tables and old resource type tables are
+ * freed through epoch based reclamation: whoever reads them without
+ * tsmm_mutex does so between tsrm_epoch_enter() and tsrm_epoch_leave(),
+ * and what is unlinked is freed two epochs later, when nobody can still
+ * hold a pointer to it.
+ */
+typedef struct {
+	tsrm_uintptr_t thread_id;	/* 0 empty */
+	tsrm_tls_entry *entry;		/* NULL: no such thread (any more) */
+} tsrm_tls_slot;
+
+typedef struct _tsrm_tls_map tsrm_tls_map;
+
+struct _tsrm_tls_map {
+	size_t size;				/* a power of 2, see THREAD_HASH_OF */
+	size_t used;				/* slots with a thread id */
+	tsrm_tls_map *next;			/* set before the first slot is frozen */
+	size_t copy_pos;			/* first slot of the next chunk to copy */
+	size_t copied;				/* slots copied */
+	tsrm_tls_slot slots[1];
+};
+
+#ifndef TSRM_MAX_LOAD
+# define TSRM_MAX_LOAD			75
+#endif
+#define TSRM_COPY_CHUNK			64
+#define TSRM_MIN_TABLE_SIZE		8
+
+#define TSRM_SLOT_FROZEN		((tsrm_uintptr_t) 1)
+#define TSRM_ENTRY_MOVED		((tsrm_uintptr_t) 1)
+#define TSRM_ENTRY_IS_MOVED(e)	(((tsrm_uintptr_t) (e)) & TSRM_ENTRY_MOVED)
+
+typedef struct _tsrm_epoch_record tsrm_epoch_record;
+
+struct _tsrm_epoch_record {
+	unsigned int epoch;			/* (global epoch << 1) | 1 while inside, 0 outside */
+	int depth;
+	int in_use;					/* owned by a thread */
+	tsrm_epoch_record *next;
+};
+
+typedef struct _tsrm_limbo tsrm_limbo;
+
+struct _tsrm_limbo {
+	void *ptr;
+	void (*free_func)(void *);
+	tsrm_limbo *next;
+};
+
+#define TSRM_ATOMIC_LOAD(p)			__atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define TSRM_ATOMIC_STORE(p, v)		__atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define TSRM_ATOMIC_EXCHANGE(p, v)	__atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define TSRM_ATOMIC_CAS(p, e, v)	__atomic_compare_exchange_n(p, e, v, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
 
 /* The memory manager table */
-static tsrm_tls_entry	**tsrm_tls_table=NULL;
-static int				tsrm_tls_table_size;
-static ts_rsrc_id		id_count;
+static tsrm_tls_map		*tsrm_tls_table=NULL;
+/* resource ids allocated so far, TSRMG_STATIC() compares it with the entry's count */
+TSRM_API ts_rsrc_id		tsrm_id_count;
 
 /* The resource sizes table */
 static tsrm_resource_type	*resource_types_table=NULL;
 static int					resource_types_table_size;
 
+/* The per-thread block */
+static size_t				tsrm_reserved_size;
+static size_t				tsrm_reserved_pos;
+
 
 static MUTEX_T tsmm_mutex;	/* thread-safe memory manager mutex */
+static MUTEX_T tsrm_grow_mutex;	/* copying the thread table, walking all of it */
+
+/* Epoch based reclamation */
+static unsigned int tsrm_epoch;
+static tsrm_epoch_record *tsrm_epoch_records;
+static tsrm_limbo *tsrm_limbo_lists[3];
+static TSRM_TLS tsrm_epoch_record *tsrm_epoch_self;
+static pthread_key_t epoch_key;
+
+/* Interpreter context pool */
+#define TSRM_CONTEXT_POOL_SIZE	64
+
+static MUTEX_T tsrm_pool_mutex;
+static tsrm_tls_entry **tsrm_pool;
+static int tsrm_pool_count;
+static int tsrm_pool_size;
+static void tsrm_context_pool_free(int keep);
+
+/* Resource accounting */
+static unsigned long tsrm_adopted;	/* entries a new thread got from a gone one with the same pthread id */
+static void tsrm_usage_dump_stop(void);
 
 /* New thread handlers */
 static tsrm_thread_begin_func_t tsrm_new_thread_begin_handler;
@@ -60,34 +205,437 @@ static int tsrm_error_level;
 static FILE *tsrm_error_file;
 
 #define TSRM_ERROR(args)
+/* NULL for an id the storage could not be grown to */
 #define TSRM_SAFE_RETURN_RSRC(array, offset, range)		\
 	if (offset==0) {									\
 		return &array;									\
+	} else if (TSRM_UNSHUFFLE_RSRC_ID(offset) >= (range)) {	\
+		return NULL;									\
 	} else {											\
-		return array[TSRM_UNSHUFFLE_RSRC_ID(offset)];	\
+		return TSRM_ATOMIC_LOAD(&array)[TSRM_UNSHUFFLE_RSRC_ID(offset)];	\
 	}
 
-/* Thread local storage */
+/* Thread local storage: read from static TLS, tls_key is kept in step */
 static pthread_key_t tls_key;
-# define tsrm_tls_set(what)		pthread_setspecific(tls_key, (void*)(what))
-# define tsrm_tls_get()			pthread_getspecific(tls_key)
+static TSRM_TLS void *tsrm_tls_current;
+# define tsrm_tls_set(what)		(tsrm_tls_current = (void*)(what), pthread_setspecific(tls_key, (void*)(what)))
+# define tsrm_tls_get()			tsrm_tls_current
+
+
+/*
+ * Epoch based reclamation
+ */
+
+/* pthread destructor of epoch_key: the thread is gone, its record can be reused */
+static void tsrm_epoch_record_release(void *ptr)
+{
+	tsrm_epoch_record *rec = (tsrm_epoch_record *) ptr;
+
+	rec->depth = 0;
+	TSRM_ATOMIC_STORE(&rec->epoch, 0);
+	TSRM_ATOMIC_STORE(&rec->in_use, 0);
+}
+
+static tsrm_epoch_record *tsrm_epoch_record_get(void)
+{
+	tsrm_epoch_record *rec = tsrm_epoch_self;
+
+	if (rec) {
+		return rec;
+	}
+	for (rec = TSRM_ATOMIC_LOAD(&tsrm_epoch_records); rec; rec = rec->next) {
+		int free_record = 0;
+
+		if (TSRM_ATOMIC_CAS(&rec->in_use, &free_record, 1)) {
+			break;
+		}
+	}
+	if (!rec) {
+		rec = (tsrm_epoch_record *) calloc(1, sizeof(tsrm_epoch_record));
+		rec->in_use = 1;
+		rec->next = TSRM_ATOMIC_LOAD(&tsrm_epoch_records);
+		while (!TSRM_ATOMIC_CAS(&tsrm_epoch_records, &rec->next, rec)) {
+		}
+	}
+	tsrm_epoch_self = rec;
+	pthread_setspecific(epoch_key, rec);
+	return rec;
+}
+
+static void tsrm_epoch_enter(void)
+{
+	tsrm_epoch_record *rec = tsrm_epoch_record_get();
+
+	if (rec->depth++ == 0) {
+		TSRM_ATOMIC_STORE(&rec->epoch, (TSRM_ATOMIC_LOAD(&tsrm_epoch) << 1) | 1);
+	}
+}
+
+static void tsrm_epoch_leave(void)
+{
+	tsrm_epoch_record *rec = tsrm_epoch_self;
+
+	if (--rec->depth == 0) {
+		__atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+	}
+}
+
+static void tsrm_limbo_free(tsrm_limbo *list)
+{
+	while (list) {
+		tsrm_limbo *next = list->next;
+
+		list->free_func(list->ptr);
+		free(list);
+		list = next;
+	}
+}
+
+/* go to the next epoch if every thread inside has seen the current one */
+static void tsrm_epoch_try_advance(void)
+{
+	unsigned int epoch = TSRM_ATOMIC_LOAD(&tsrm_epoch);
+	tsrm_epoch_record *rec;
+
+	for (rec = TSRM_ATOMIC_LOAD(&tsrm_epoch_records); rec; rec = rec->next) {
+		unsigned int e = TSRM_ATOMIC_LOAD(&rec->epoch);
+
+		if ((e & 1) && e != ((epoch << 1) | 1)) {
+			return;
+		}
+	}
+	if (TSRM_ATOMIC_CAS(&tsrm_epoch, &epoch, epoch + 1)) {
+		/* retired in epoch - 1, nobody inside is older than epoch now */
+		tsrm_limbo_free(TSRM_ATOMIC_EXCHANGE(&tsrm_limbo_lists[(epoch + 2) % 3], NULL));
+	}
+}
+
+/* free ptr once nobody can hold it any more; call inside, after unlinking it */
+static void tsrm_epoch_retire(void *ptr, void (*free_func)(void *))
+{
+	tsrm_limbo *node = (tsrm_limbo *) malloc(sizeof(tsrm_limbo));
+	tsrm_limbo **list = &tsrm_limbo_lists[TSRM_ATOMIC_LOAD(&tsrm_epoch) % 3];
+
+	node->ptr = ptr;
+	node->free_func = free_func;
+	node->next = TSRM_ATOMIC_LOAD(list);
+	while (!TSRM_ATOMIC_CAS(list, &node->next, node)) {
+	}
+	tsrm_epoch_try_advance();
+}
+
+
+/*
+ * The thread table
+ */
+
+static tsrm_tls_map *tsrm_map_alloc(size_t min_size)
+{
+	size_t size = TSRM_MIN_TABLE_SIZE;
+	tsrm_tls_map *map;
+
+	while (size < min_size) {
+		size <<= 1;
+	}
+	map = (tsrm_tls_map *) calloc(1, sizeof(tsrm_tls_map) + (size - 1) * sizeof(tsrm_tls_slot));
+	if (map) {
+		map->size = size;
+	}
+	return map;
+}
+
+static void tsrm_map_free(void *map)
+{
+	free(map);
+}
+
+/* the slot of thread_id, claimed if it has none; NULL if map is frozen there or full */
+static tsrm_tls_slot *tsrm_map_claim(tsrm_tls_map *map, tsrm_uintptr_t thread_id)
+{
+	size_t n, i = THREAD_HASH_OF(thread_id, map->size);
+
+	for (n = 0; n < map->size; n++) {
+		tsrm_tls_slot *slot = &map->slots[i];
+		tsrm_uintptr_t k = TSRM_ATOMIC_LOAD(&slot->thread_id);
+
+		if (k == 0) {
+			if (TSRM_ATOMIC_CAS(&slot->thread_id, &k, thread_id)) {
+				__atomic_fetch_add(&map->used, 1, __ATOMIC_SEQ_CST);
+				return slot;
+			}
+			/* k is what beat us to it */
+		}
+		if (k == thread_id) {
+			return slot;
+		}
+		if (k == TSRM_SLOT_FROZEN) {
+			return NULL;
+		}
+		if (++i == map->size) {
+			i = 0;
+		}
+	}
+	return NULL;
+}
+
+/* the entry of thread_id or NULL; call inside an epoch */
+static tsrm_tls_entry *tsrm_map_find(tsrm_uintptr_t thread_id)
+{
+	tsrm_tls_map *map = TSRM_ATOMIC_LOAD(&tsrm_tls_table);
+
+	for (;;) {
+		size_t n, i = THREAD_HASH_OF(thread_id, map->size);
+		tsrm_tls_map *next = NULL;
+
+		for (n = 0; n < map->size; n++) {
+			tsrm_tls_slot *slot = &map->slots[i];
+			tsrm_uintptr_t k = TSRM_ATOMIC_LOAD(&slot->thread_id);
+
+			if (k == thread_id) {
+				tsrm_tls_entry *entry = TSRM_ATOMIC_LOAD(&slot->entry);
+
+				if (!TSRM_ENTRY_IS_MOVED(entry)) {
+					return entry;
+				}
+				next = TSRM_ATOMIC_LOAD(&map->next);
+				break;
+			}
+			if (k == 0) {
+				return NULL;
+			}
+			if (k == TSRM_SLOT_FROZEN) {
+				next = TSRM_ATOMIC_LOAD(&map->next);
+				break;
+			}
+			if (++i == map->size) {
+				i = 0;
+			}
+		}
+		if (n == map->size) {
+			/* full, the rest went into the table being filled */
+			next = TSRM_ATOMIC_LOAD(&map->next);
+		}
+		if (!next) {
+			return NULL;
+		}
+		map = next;
+	}
+}
+
+static void tsrm_map_grow(tsrm_tls_map *old);
+static int tsrm_map_copy_chunk(tsrm_tls_map *old);
+
+/*
+ * Put entry in for thread_id unless the thread has one, returns the one
+ * that is in the table now; call inside an epoch
+ */
+static tsrm_tls_entry *tsrm_map_insert(tsrm_uintptr_t thread_id, tsrm_tls_entry *entry)
+{
+	tsrm_tls_map *map = TSRM_ATOMIC_LOAD(&tsrm_tls_table);
+
+	for (;;) {
+		tsrm_tls_slot *slot;
+
+		if (TSRM_ATOMIC_LOAD(&map->next)) {
+			/* being copied, do a part of it */
+			tsrm_map_copy_chunk(map);
+		}
+		slot = tsrm_map_claim(map, thread_id);
+		if (slot) {
+			tsrm_tls_entry *cur = TSRM_ATOMIC_LOAD(&slot->entry);
+
+			while (!cur && !TSRM_ATOMIC_CAS(&slot->entry, &cur, entry)) {
+			}
+			if (!TSRM_ENTRY_IS_MOVED(cur)) {
+				if (TSRM_ATOMIC_LOAD(&map->used) * 100 > map->size * TSRM_MAX_LOAD) {
+					tsrm_map_grow(map);
+				}
+				return cur ? cur : entry;
+			}
+		} else if (!TSRM_ATOMIC_LOAD(&map->next)) {
+			/* full, can only happen to a table that someone is about to grow */
+			tsrm_map_grow(map);
+		}
+		if (TSRM_ATOMIC_LOAD(&map->next)) {
+			map = TSRM_ATOMIC_LOAD(&map->next);
+		} else {
+			map = TSRM_ATOMIC_LOAD(&tsrm_tls_table);
+		}
+	}
+}
+
+/* take entry out if it is still the one of thread_id; call inside an epoch */
+static int tsrm_map_remove(tsrm_uintptr_t thread_id, tsrm_tls_entry *entry)
+{
+	tsrm_tls_map *map = TSRM_ATOMIC_LOAD(&tsrm_tls_table);
+
+	if (TSRM_ATOMIC_LOAD(&map->next)) {
+		tsrm_map_copy_chunk(map);
+	}
+	while (map) {
+		size_t n, i = THREAD_HASH_OF(thread_id, map->size);
+		tsrm_tls_map *next = NULL;
+
+		for (n = 0; n < map->size; n++) {
+			tsrm_tls_slot *slot = &map->slots[i];
+			tsrm_uintptr_t k = TSRM_ATOMIC_LOAD(&slot->thread_id);
+
+			if (k == thread_id) {
+				tsrm_tls_entry *cur = entry;
+
+				if (TSRM_ATOMIC_CAS(&slot->entry, &cur, NULL)) {
+					return 1;
+				}
+				if (!TSRM_ENTRY_IS_MOVED(cur)) {
+					return 0;
+				}
+				next = TSRM_ATOMIC_LOAD(&map->next);
+				break;
+			}
+			if (k == 0) {
+				return 0;
+			}
+			if (k == TSRM_SLOT_FROZEN) {
+				next = TSRM_ATOMIC_LOAD(&map->next);
+				break;
+			}
+			if (++i == map->size) {
+				i = 0;
+			}
+		}
+		if (n == map->size) {
+			next = TSRM_ATOMIC_LOAD(&map->next);
+		}
+		map = next;
+	}
+	return 0;
+}
+
+/*
+ * Copy the next TSRM_COPY_CHUNK slots of old into old->next, the one that
+ * copies the last slot makes old->next current; call inside an epoch.
+ * 0 if every chunk is taken already.
+ */
+static int tsrm_map_copy_chunk(tsrm_tls_map *old)
+{
+	tsrm_tls_map *map = TSRM_ATOMIC_LOAD(&old->next);
+	size_t i, end, start = __atomic_fetch_add(&old->copy_pos, TSRM_COPY_CHUNK, __ATOMIC_SEQ_CST);
+
+	if (start >= old->size) {
+		return 0;
+	}
+	end = start + TSRM_COPY_CHUNK < old->size ? start + TSRM_COPY_CHUNK : old->size;
+	for (i = start; i < end; i++) {
+		tsrm_tls_slot *slot = &old->slots[i], *to = NULL;
+		tsrm_uintptr_t k = TSRM_ATOMIC_LOAD(&slot->thread_id);
+		tsrm_tls_entry *entry;
+
+		if (k == 0 && TSRM_ATOMIC_CAS(&slot->thread_id, &k, TSRM_SLOT_FROZEN)) {
+			continue;
+		}
+		/* only we write map's slot of k until old's one is marked moved */
+		entry = TSRM_ATOMIC_LOAD(&slot->entry);
+		do {
+			if (entry && !to) {
+				to = tsrm_map_claim(map, k);
+			}
+			if (to) {
+				TSRM_ATOMIC_STORE(&to->entry, entry);
+			}
+		} while (!TSRM_ATOMIC_CAS(&slot->entry, &entry, (tsrm_tls_entry *) ((tsrm_uintptr_t) entry | TSRM_ENTRY_MOVED)));
+	}
+
+	if (__atomic_add_fetch(&old->copied, end - start, __ATOMIC_SEQ_CST) == old->size) {
+		TSRM_ATOMIC_STORE(&tsrm_tls_table, map);
+		tsrm_epoch_retire(old, tsrm_map_free);
+	}
+	return 1;
+}
+
+/* start copying the live entries of old into a new table; call inside an epoch */
+static void tsrm_map_grow(tsrm_tls_map *old)
+{
+	tsrm_tls_map *map;
+	size_t i, live = 0;
+
+	tsrm_mutex_lock(tsrm_grow_mutex);
+	if (TSRM_ATOMIC_LOAD(&tsrm_tls_table) != old || TSRM_ATOMIC_LOAD(&old->next)) {
+		tsrm_mutex_unlock(tsrm_grow_mutex);
+		return;
+	}
+	for (i = 0; i < old->size; i++) {
+		if (TSRM_ATOMIC_LOAD(&old->slots[i].entry)) {
+			live++;
+		}
+	}
+	/* only threads that are still there are copied, this drops the dead ids */
+	map = tsrm_map_alloc(live * 4 > old->size ? live * 4 : old->size);
+	if (!map) {
+		tsrm_mutex_unlock(tsrm_grow_mutex);
+		TSRM_ERROR((TSRM_ERROR_LEVEL_ERROR, "Unable to grow the TLS table"));
+		return;
+	}
+	TSRM_ATOMIC_STORE(&old->next, map);
+	tsrm_mutex_unlock(tsrm_grow_mutex);
+
+	tsrm_map_copy_chunk(old);
+}
+
+/*
+ * Take tsrm_grow_mutex and finish the copy that is going on, if any: the
+ * current table then has every thread and stays current until the unlock
+ */
+static tsrm_tls_map *tsrm_map_lock(void)
+{
+	tsrm_tls_map *map;
+
+	tsrm_mutex_lock(tsrm_grow_mutex);
+	for (;;) {
+		map = TSRM_ATOMIC_LOAD(&tsrm_tls_table);
+		if (!TSRM_ATOMIC_LOAD(&map->next)) {
+			return map;
+		}
+		if (!tsrm_map_copy_chunk(map)) {
+			/* the last chunks are being copied by others */
+			sched_yield();
+		}
+	}
+}
+
+/* func on every thread's entry, with tsrm_grow_mutex held; call inside an epoch */
+static void tsrm_map_apply(void (*func)(tsrm_tls_entry *, void *), void *arg)
+{
+	tsrm_tls_map *map;
+	size_t i;
+
+	map = tsrm_map_lock();
+	for (i = 0; i < map->size; i++) {
+		tsrm_tls_entry *entry = TSRM_ATOMIC_LOAD(&map->slots[i].entry);
+
+		if (entry) {
+			func(entry, arg);
+		}
+	}
+	tsrm_mutex_unlock(tsrm_grow_mutex);
+}
 
 
 /* Startup TSRM (call once for the entire process) */
 TSRM_API int tsrm_startup(int expected_threads, int expected_resources, int debug_level, char *debug_filename)
 {
 	pthread_key_create( &tls_key, 0 );
+	pthread_key_create( &epoch_key, tsrm_epoch_record_release );
 
 	tsrm_error_file = stderr;
 	tsrm_error_set(debug_level, debug_filename);
-	tsrm_tls_table_size = expected_threads;
 
-	tsrm_tls_table = (tsrm_tls_entry **) calloc(tsrm_tls_table_size, sizeof(tsrm_tls_entry *));
+	tsrm_tls_table = tsrm_map_alloc(expected_threads * 2);
 	if (!tsrm_tls_table) {
 		TSRM_ERROR((TSRM_ERROR_LEVEL_ERROR, "Unable to allocate TLS table"));
 		return 0;
 	}
-	id_count=0;
+	tsrm_id_count=0;
+	tsrm_reserved_size = tsrm_reserved_pos = 0;
 
 	resource_types_table_size = expected_resources;
 	resource_types_table = (tsrm_resource_type *) calloc(resource_types_table_size, sizeof(tsrm_resource_type));
@@ -99,6 +647,11 @@ TSRM_API int tsrm_startup(int expected_threads, int expected_resources, int debu
 	}
 
 	tsmm_mutex = tsrm_mutex_alloc();
+	tsrm_grow_mutex = tsrm_mutex_alloc();
+	tsrm_pool_mutex = tsrm_mutex_alloc();
+	tsrm_pool = NULL;
+	tsrm_pool_count = 0;
+	tsrm_pool_size = TSRM_CONTEXT_POOL_SIZE;
 
 	tsrm_new_thread_begin_handler = tsrm_new_thread_end_handler = NULL;
 
@@ -107,143 +660,447 @@ TSRM_API int tsrm_startup(int expected_threads, int expected_resources, int debu
 }
 
 
+/* resource i of p is in p's block */
+static int tsrm_in_block(tsrm_tls_entry *p, tsrm_resource_type *types, int i)
+{
+	return types[i].fast_offset && types[i].fast_offset + types[i].size <= TSRM_ENTRY_SIZE + p->block_size;
+}
+
+/* memory for resource i of p, in its block if it has an offset there */
+static void *tsrm_resource_alloc(tsrm_tls_entry *p, tsrm_resource_type *types, int i)
+{
+	if (tsrm_in_block(p, types, i)) {
+		return (char *) p + types[i].fast_offset;
+	}
+	return malloc(types[i].size);
+}
+
+/* free resource i of p unless it is in its block */
+static void tsrm_resource_free(tsrm_tls_entry *p, tsrm_resource_type *types, int i)
+{
+	if (!tsrm_in_block(p, types, i)) {
+		free(p->storage[i]);
+	}
+}
+
+static uint64_t tsrm_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Construct resource i of p, allocated into storage[i], timed from *clock
+ * on, which is then set to now: the ctors of a thread run one after the
+ * other and share their clock reads
+ */
+static void tsrm_resource_ctor(tsrm_tls_entry *p, tsrm_resource_type *types, void **storage, int i, uint64_t *clock)
+{
+	tsrm_resource_stats *st = types[i].stats;
+	uint64_t ns, max, t0 = *clock;
+
+	if (types[i].ctor) {
+		types[i].ctor(storage[i]);
+	}
+	*clock = tsrm_now_ns();
+	ns = *clock - t0;
+
+	p->stats[i].ctor_ns = ns;
+	p->stats[i].state = TSRM_RSRC_LIVE;
+	__atomic_fetch_add(&st->ctors, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->ctor_ns, ns, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&st->ctor_ns_max, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&st->ctor_ns_max, &max, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+/* the dtor of resource i of p ran, freed_by is freed_by_thread or freed_by_id of its type */
+static void tsrm_resource_destructed(tsrm_tls_entry *p, int i, unsigned long *freed_by)
+{
+	if (p->stats[i].state == TSRM_RSRC_LIVE) {
+		__atomic_fetch_add(freed_by, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int tsrm_gettid(void)
+{
+	return (int) syscall(SYS_gettid);
+}
+
+static void tsrm_free_entry(void *ptr)
+{
+	tsrm_tls_entry *entry = (tsrm_tls_entry *) ptr;
+
+	pthread_mutex_destroy(&entry->lock);
+	while (entry->old_storage) {
+		tsrm_old_storage *next = entry->old_storage->next;
+
+		if (entry->old_storage->storage != TSRM_INLINE_STORAGE(entry)) {
+			free(entry->old_storage->storage);
+		}
+		free(entry->old_storage);
+		entry->old_storage = next;
+	}
+	if (entry->storage != TSRM_INLINE_STORAGE(entry)) {
+		free(entry->storage);
+	}
+	free(entry->stats);
+	free(entry->dirty);
+	free(entry);
+}
+
+
 /* Shutdown TSRM (call once for the entire process) */
 TSRM_API void tsrm_shutdown(void)
 {
-	int i;
+	size_t i;
 
+	tsrm_usage_dump_stop();
+	tsrm_context_pool_free(0);
+	free(tsrm_pool);
+	tsrm_pool = NULL;
 	if (tsrm_tls_table) {
-		for (i=0; i<tsrm_tls_table_size; i++) {
-			tsrm_tls_entry *p = tsrm_tls_table[i], *next_p;
+		/* all threads in one table */
+		tsrm_epoch_enter();
+		tsrm_map_lock();
+		tsrm_mutex_unlock(tsrm_grow_mutex);
+		tsrm_epoch_leave();
+
+		for (i=0; i<tsrm_tls_table->size; i++) {
+			tsrm_tls_entry *p = tsrm_tls_table->slots[i].entry;
 
-			while (p) {
+			if (p) {
 				int j;
 
-				next_p = p->next;
 				for (j=0; j<p->count; j++) {
 					if (p->storage[j]) {
 						if (resource_types_table && !resource_types_table[j].done && resource_types_table[j].dtor) {
 							resource_types_table[j].dtor(p->storage[j]);
 						}
-						free(p->storage[j]);
+						tsrm_resource_free(p, resource_types_table, j);
 					}
 				}
-				free(p->storage);
-				free(p);
-				p = next_p;
+				tsrm_free_entry(p);
 			}
 		}
 		free(tsrm_tls_table);
 		tsrm_tls_table = NULL;
 	}
+	for (i=0; i<3; i++) {
+		tsrm_limbo_free(tsrm_limbo_lists[i]);
+		tsrm_limbo_lists[i] = NULL;
+	}
+	while (tsrm_epoch_records) {
+		tsrm_epoch_record *next = tsrm_epoch_records->next;
+
+		free(tsrm_epoch_records);
+		tsrm_epoch_records = next;
+	}
+	tsrm_epoch_self = NULL;
 	if (resource_types_table) {
+		for (i=0; i<(size_t)tsrm_id_count; i++) {
+			free(resource_types_table[i].stats);
+		}
 		free(resource_types_table);
 		resource_types_table=NULL;
 	}
 	tsrm_mutex_free(tsmm_mutex);
 	tsmm_mutex = NULL;
+	tsrm_mutex_free(tsrm_grow_mutex);
+	tsrm_grow_mutex = NULL;
+	tsrm_mutex_free(tsrm_pool_mutex);
+	tsrm_pool_mutex = NULL;
 	TSRM_ERROR((TSRM_ERROR_LEVEL_CORE, "Shutdown TSRM"));
 	if (tsrm_error_file!=stderr) {
 		fclose(tsrm_error_file);
 	}
-	pthread_setspecific(tls_key, 0);
+	tsrm_tls_set(0);
 	pthread_key_delete(tls_key);
+	pthread_setspecific(epoch_key, 0);
+	pthread_key_delete(epoch_key);
+}
+
+
+/*
+ * Bring p->storage up to tsrm_id_count; call inside an epoch. The storage array
+ * is replaced, not realloc()ed: the owner reads it without a lock or an
+ * epoch, so the old one stays until the entry is freed.
+ *
+ * ts_allocate_id() does not visit the other threads, each one gets here by
+ * itself the first time it finds p->count behind tsrm_id_count, so the new
+ * ctors run on the thread that owns the resources.
+ *
+ * The new resources are allocated and the array published (size) first,
+ * then the ctors run, still under p->lock so that other threads wait for
+ * them, and only then count moves. A ctor that comes back here, through
+ * tsrm_get_ls_cache(), TSRMG() or ts_resource() (GINIT's
+ * ZEND_TSRMLS_CACHE_UPDATE() does), finds itself in p->grower and returns
+ * instead of waiting for its own lock.
+ */
+static void tsrm_grow_storage(tsrm_tls_entry *p)
+{
+	int j, first, count = TSRM_ATOMIC_LOAD(&tsrm_id_count);
+	tsrm_resource_type *types;
+	uint64_t clock;
+
+	if (pthread_equal(TSRM_ATOMIC_LOAD(&p->grower), tsrm_thread_id())) {
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	/* loaded under the lock: a ts_free_id() that went by already set done in it */
+	types = TSRM_ATOMIC_LOAD(&resource_types_table);
+	if (!p->dead && p->count < count) {
+		void **storage = (void **) malloc(sizeof(void *)*count);
+		void **old = p->storage;
+		tsrm_old_storage *o = old ? (tsrm_old_storage *) malloc(sizeof(tsrm_old_storage)) : NULL;
+		tsrm_rsrc_stat *stats = NULL;
+
+		if (storage && (o || !old)) {
+			stats = (tsrm_rsrc_stat *) realloc(p->stats, sizeof(tsrm_rsrc_stat)*count);
+		}
+		if (!stats) {
+			/* p->count stays behind, the next tsrm_storage_update() tries again */
+			free(storage);
+			free(o);
+			pthread_mutex_unlock(&p->lock);
+			TSRM_ERROR((TSRM_ERROR_LEVEL_ERROR, "Unable to allocate storage for resource"));
+			return;
+		}
+		p->stats = stats;
+
+		first = p->count;
+		if (first) {
+			memcpy(storage, old, sizeof(void *)*first);
+		}
+		memset(p->stats + first, 0, sizeof(tsrm_rsrc_stat)*(count - first));
+		for (j=first; j<count; j++) {
+			storage[j] = TSRM_ATOMIC_LOAD(&types[j].done) ? NULL : tsrm_resource_alloc(p, types, j);
+		}
+		TSRM_ATOMIC_STORE(&p->storage, storage);
+		TSRM_ATOMIC_STORE(&p->size, count);
+		if (old) {
+			o->storage = old;
+			o->next = p->old_storage;
+			p->old_storage = o;
+		}
+
+		TSRM_ATOMIC_STORE(&p->grower, tsrm_thread_id());
+		clock = tsrm_now_ns();
+		for (j=first; j<count; j++) {
+			if (storage[j]) {
+				tsrm_resource_ctor(p, types, storage, j, &clock);
+			}
+		}
+		TSRM_ATOMIC_STORE(&p->grower, (THREAD_T) 0);
+		TSRM_ATOMIC_STORE(&p->count, count);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* the ids allocated since p last looked, one load and compare if there are none */
+static inline void tsrm_storage_update(tsrm_tls_entry *p)
+{
+	if (TSRM_ATOMIC_LOAD(&p->count) < TSRM_ATOMIC_LOAD(&tsrm_id_count)) {
+		tsrm_epoch_enter();
+		tsrm_grow_storage(p);
+		tsrm_epoch_leave();
+	}
+}
+
+
+/* allocates a new thread-safe-resource id */
+TSRM_API ts_rsrc_id ts_allocate_id(ts_rsrc_id *rsrc_id, size_t size, ts_allocate_ctor ctor, ts_allocate_dtor dtor)
+{
+	tsrm_resource_stats *stats;
+	int j;
+
+	TSRM_ERROR((TSRM_ERROR_LEVEL_CORE, "Obtaining a new resource id, %d bytes", size));
+
+	tsrm_mutex_lock(tsmm_mutex);
+	tsrm_epoch_enter();
+
+	/* obtain a resource id */
+	j = tsrm_id_count;
+	stats = (tsrm_resource_stats *) calloc(1, sizeof(tsrm_resource_stats));
+	if (!stats) {
+		tsrm_epoch_leave();
+		tsrm_mutex_unlock(tsmm_mutex);
+		TSRM_ERROR((TSRM_ERROR_LEVEL_ERROR, "Unable to allocate storage for resource"));
+		*rsrc_id = 0;
+		return 0;
+	}
+	stats->size = size;
+	*rsrc_id = TSRM_SHUFFLE_RSRC_ID(j);
+	TSRM_ERROR((TSRM_ERROR_LEVEL_CORE, "Obtained resource id %d", *rsrc_id));
+
+	/* store the new resource type in the resource sizes table, a new copy if it is full */
+	if (resource_types_table_size <= j) {
+		int new_size = resource_types_table_size ? resource_types_table_size * 2 : 16;
+		tsrm_resource_type *types = (tsrm_resource_type *) calloc(new_size, sizeof(tsrm_resource_type));
+
+		if (!types) {
+			free(stats);
+			tsrm_epoch_leave();
+			tsrm_mutex_unlock(tsmm_mutex);
+			TSRM_ERROR((TSRM_ERROR_LEVEL_ERROR, "Unable to allocate storage for resource"));
+			*rsrc_id = 0;
+			return 0;
+		}
+		memcpy(types, resource_types_table, sizeof(tsrm_resource_type)*j);
+		tsrm_epoch_retire(TSRM_ATOMIC_EXCHANGE(&resource_types_table, types), free);
+		resource_types_table_size = new_size;
+	}
+	resource_types_table[j].size = size;
+	resource_types_table[j].ctor = ctor;
+	resource_types_table[j].dtor = dtor;
+	resource_types_table[j].done = 0;
+	resource_types_table[j].fast_offset = 0;
+	resource_types_table[j].stats = stats;
+	if (tsrm_reserved_size && tsrm_reserved_pos + TSRM_ALIGNED_SIZE(size) <= tsrm_reserved_size) {
+		resource_types_table[j].fast_offset = TSRM_ENTRY_SIZE + tsrm_reserved_pos;
+		tsrm_reserved_pos += TSRM_ALIGNED_SIZE(size);
+	}
+
+	/*
+	 * Publish the id. Only the calling thread, which is about to use the
+	 * resource, gets it now; the others and the interpreter contexts get
+	 * it on their next ts_resource()/tsrm_get_ls_cache(), so this costs
+	 * the same with 10 threads as with 10000.
+	 */
+	TSRM_ATOMIC_STORE(&tsrm_id_count, j + 1);
+	if (tsrm_tls_get()) {
+		tsrm_grow_storage(tsrm_tls_get());
+	}
+
+	tsrm_epoch_leave();
+	tsrm_mutex_unlock(tsmm_mutex);
+
+	TSRM_ERROR((TSRM_ERROR_LEVEL_CORE, "Successfully allocated new resource id %d", *rsrc_id));
+	return *rsrc_id;
+}
+
+
+/* lay the resources out in one per-thread block of size bytes, before the first ts_resource() */
+TSRM_API void tsrm_reserve(size_t size)
+{
+	tsrm_mutex_lock(tsmm_mutex);
+	tsrm_reserved_size = TSRM_ALIGNED_SIZE(size);
+	tsrm_mutex_unlock(tsmm_mutex);
 }
 
 
-/* allocates a new thread-safe-resource id */
-TSRM_API ts_rsrc_id ts_allocate_id(ts_rsrc_id *rsrc_id, size_t size, ts_allocate_ctor ctor, ts_allocate_dtor dtor)
+/* offset of a resource from tsrm_get_ls_cache(), for TSRMG_FAST(); 0 if it has none */
+TSRM_API size_t ts_resource_offset(ts_rsrc_id id)
 {
-	int i;
-
-	TSRM_ERROR((TSRM_ERROR_LEVEL_CORE, "Obtaining a new resource id, %d bytes", size));
+	size_t offset = 0;
 
 	tsrm_mutex_lock(tsmm_mutex);
-
-	/* obtain a resource id */
-	*rsrc_id = TSRM_SHUFFLE_RSRC_ID(id_count++);
-	TSRM_ERROR((TSRM_ERROR_LEVEL_CORE, "Obtained resource id %d", *rsrc_id));
-
-	/* store the new resource type in the resource sizes table */
-	if (resource_types_table_size < id_count) {
-		resource_types_table = (tsrm_resource_type *) realloc(resource_types_table, sizeof(tsrm_resource_type)*id_count);
-		if (!resource_types_table) {
-			tsrm_mutex_unlock(tsmm_mutex);
-			TSRM_ERROR((TSRM_ERROR_LEVEL_ERROR, "Unable to allocate storage for resource"));
-			*rsrc_id = 0;
-			return 0;
-		}
-		resource_types_table_size = id_count;
+	if (id > 0 && id <= tsrm_id_count) {
+		offset = resource_types_table[TSRM_UNSHUFFLE_RSRC_ID(id)].fast_offset;
 	}
-	resource_types_table[TSRM_UNSHUFFLE_RSRC_ID(*rsrc_id)].size = size;
-	resource_types_table[TSRM_UNSHUFFLE_RSRC_ID(*rsrc_id)].ctor = ctor;
-	resource_types_table[TSRM_UNSHUFFLE_RSRC_ID(*rsrc_id)].dtor = dtor;
-	resource_types_table[TSRM_UNSHUFFLE_RSRC_ID(*rsrc_id)].done = 0;
-
-	/* enlarge the arrays for the already active threads */
-	for (i=0; i<tsrm_tls_table_size; i++) {
-		tsrm_tls_entry *p = tsrm_tls_table[i];
+	tsrm_mutex_unlock(tsmm_mutex);
+	return offset;
+}
 
-		while (p) {
-			if (p->count < id_count) {
-				int j;
 
-				p->storage = (void *) realloc(p->storage, sizeof(void *)*id_count);
-				for (j=p->count; j<id_count; j++) {
-					p->storage[j] = (void *) malloc(resource_types_table[j].size);
-					if (resource_types_table[j].ctor) {
-						resource_types_table[j].ctor(p->storage[j]);
-					}
-				}
-				p->count = id_count;
-			}
-			p = p->next;
-		}
+/*
+ * ts_allocate_id() plus the resource's offset in the block, fixed from now
+ * on, for TSRMG_FAST_STATIC(); *offset is 0 if the reserved block is full
+ * and the resource can only be reached by id
+ */
+TSRM_API ts_rsrc_id ts_allocate_fast_id(ts_rsrc_id *rsrc_id, size_t *offset, size_t size, ts_allocate_ctor ctor, ts_allocate_dtor dtor)
+{
+	*offset = 0;
+	if (!ts_allocate_id(rsrc_id, size, ctor, dtor)) {
+		return 0;
+	}
+	*offset = ts_resource_offset(*rsrc_id);
+	if (!*offset) {
+		TSRM_ERROR((TSRM_ERROR_LEVEL_ERROR, "Resource id %d does not fit in the reserved block", *rsrc_id));
 	}
-	tsrm_mutex_unlock(tsmm_mutex);
-
-	TSRM_ERROR((TSRM_ERROR_LEVEL_CORE, "Successfully allocated new resource id %d", *rsrc_id));
 	return *rsrc_id;
 }
 
 
-static void allocate_new_resource(tsrm_tls_entry **thread_resources_ptr, THREAD_T thread_id)
+/* call inside an epoch */
+static tsrm_tls_entry *allocate_new_resource(THREAD_T thread_id)
 {
-	int i;
+	tsrm_tls_entry *thread_resources;
+	int i, count = TSRM_ATOMIC_LOAD(&tsrm_id_count);
+	tsrm_resource_type *types = TSRM_ATOMIC_LOAD(&resource_types_table);
+	uint64_t clock;
 
 	TSRM_ERROR((TSRM_ERROR_LEVEL_CORE, "Creating data structures for thread %x", thread_id));
-	(*thread_resources_ptr) = (tsrm_tls_entry *) malloc(sizeof(tsrm_tls_entry));
-	(*thread_resources_ptr)->storage = NULL;
-	if (id_count > 0) {
-		(*thread_resources_ptr)->storage = (void **) malloc(sizeof(void *)*id_count);
+	if (tsrm_reserved_size) {
+		/* one allocation: entry, resources, storage array */
+		thread_resources = (tsrm_tls_entry *) malloc(TSRM_ENTRY_SIZE + tsrm_reserved_size + sizeof(void *)*count);
+		thread_resources->block_size = tsrm_reserved_size;
+		thread_resources->storage = TSRM_INLINE_STORAGE(thread_resources);
+	} else {
+		thread_resources = (tsrm_tls_entry *) malloc(sizeof(tsrm_tls_entry));
+		thread_resources->block_size = 0;
+		thread_resources->storage = NULL;
+		if (count > 0) {
+			thread_resources->storage = (void **) malloc(sizeof(void *)*count);
+		}
 	}
-	(*thread_resources_ptr)->count = id_count;
-	(*thread_resources_ptr)->thread_id = thread_id;
-	(*thread_resources_ptr)->next = NULL;
+	thread_resources->count = count;
+	thread_resources->size = count;
+	thread_resources->grower = (THREAD_T) 0;
+	thread_resources->thread_id = thread_id;
+	pthread_mutex_init(&thread_resources->lock, NULL);
+	thread_resources->dead = 0;
+	thread_resources->old_storage = NULL;
+	thread_resources->stats = (tsrm_rsrc_stat *) calloc(count ? count : 1, sizeof(tsrm_rsrc_stat));
+	thread_resources->tid = pthread_equal(thread_id, tsrm_thread_id()) ? tsrm_gettid() : 0;
+	thread_resources->all_dirty = 0;
+	thread_resources->dirty = NULL;
+	thread_resources->dirty_words = 0;
 
 	/* Set thread local storage to this new thread resources structure */
-	tsrm_tls_set(*thread_resources_ptr);
+	tsrm_tls_set(thread_resources);
 
 	if (tsrm_new_thread_begin_handler) {
 		tsrm_new_thread_begin_handler(thread_id);
 	}
-	for (i=0; i<id_count; i++) {
-		if (resource_types_table[i].done) {
-			(*thread_resources_ptr)->storage[i] = NULL;
-		} else
-		{
-			(*thread_resources_ptr)->storage[i] = (void *) malloc(resource_types_table[i].size);
-			if (resource_types_table[i].ctor) {
-				resource_types_table[i].ctor((*thread_resources_ptr)->storage[i]);
-			}
+	for (i=0; i<count; i++) {
+		thread_resources->storage[i] = types[i].done ? NULL : tsrm_resource_alloc(thread_resources, types, i);
+	}
+	/* a ctor that gets to tsrm_grow_storage() for an id allocated meanwhile is not let in */
+	TSRM_ATOMIC_STORE(&thread_resources->grower, tsrm_thread_id());
+	clock = tsrm_now_ns();
+	for (i=0; i<count; i++) {
+		if (thread_resources->storage[i]) {
+			tsrm_resource_ctor(thread_resources, types, thread_resources->storage, i, &clock);
 		}
 	}
+	TSRM_ATOMIC_STORE(&thread_resources->grower, (THREAD_T) 0);
 
 	if (tsrm_new_thread_end_handler) {
 		tsrm_new_thread_end_handler(thread_id);
 	}
 
-	tsrm_mutex_unlock(tsmm_mutex);
+	return thread_resources;
+}
+
+
+/* run the dtors and free the resources of an entry nobody else can reach */
+static void free_thread_resources(tsrm_tls_entry *thread_resources)
+{
+	tsrm_resource_type *types = TSRM_ATOMIC_LOAD(&resource_types_table);
+	int i;
+
+	for (i=0; i<thread_resources->count; i++) {
+		if (types[i].dtor) {
+			types[i].dtor(thread_resources->storage[i]);
+		}
+		tsrm_resource_destructed(thread_resources, i, &types[i].stats->freed_by_thread);
+	}
+	for (i=0; i<thread_resources->count; i++) {
+		tsrm_resource_free(thread_resources, types, i);
+	}
 }
 
 
@@ -251,8 +1108,7 @@ static void allocate_new_resource(tsrm_tls_entry **thread_resources_ptr, THREAD_
 TSRM_API void *ts_resource_ex(ts_rsrc_id id, THREAD_T *th_id)
 {
 	THREAD_T thread_id;
-	int hash_value;
-	tsrm_tls_entry *thread_resources;
+	tsrm_tls_entry *thread_resources, *found;
 
 	if (!th_id) {
 		/* Fast path for looking up the resources for the current
@@ -264,11 +1120,12 @@ TSRM_API void *ts_resource_ex(ts_rsrc_id id, THREAD_T *th_id)
 
 		if (thread_resources) {
 			TSRM_ERROR((TSRM_ERROR_LEVEL_INFO, "Fetching resource id %d for current thread %d", id, (long) thread_resources->thread_id));
+			tsrm_storage_update(thread_resources);
 			/* Read a specific resource from the thread's resources.
 			 * This is called outside of a mutex, so have to be aware about external
 			 * changes to the structure as we read it.
 			 */
-			TSRM_SAFE_RETURN_RSRC(thread_resources->storage, id, thread_resources->count);
+			TSRM_SAFE_RETURN_RSRC(thread_resources->storage, id, TSRM_ATOMIC_LOAD(&thread_resources->size));
 		}
 		thread_id = tsrm_thread_id();
 	} else {
@@ -276,60 +1133,57 @@ TSRM_API void *ts_resource_ex(ts_rsrc_id id, THREAD_T *th_id)
 	}
 
 	TSRM_ERROR((TSRM_ERROR_LEVEL_INFO, "Fetching resource id %d for thread %ld", id, (long) thread_id));
-	tsrm_mutex_lock(tsmm_mutex);
+	tsrm_epoch_enter();
 
-	hash_value = THREAD_HASH_OF(thread_id, tsrm_tls_table_size);
-	thread_resources = tsrm_tls_table[hash_value];
+	thread_resources = tsrm_map_find((tsrm_uintptr_t) thread_id);
+	if (thread_resources && !th_id) {
+		int tid = tsrm_gettid();
 
-	if (!thread_resources) {
-		allocate_new_resource(&tsrm_tls_table[hash_value], thread_id);
-		return ts_resource_ex(id, &thread_id);
-	} else {
-		 do {
-			if (thread_resources->thread_id == thread_id) {
-				break;
-			}
-			if (thread_resources->next) {
-				thread_resources = thread_resources->next;
-			} else {
-				allocate_new_resource(&thread_resources->next, thread_id);
-				return ts_resource_ex(id, &thread_id);
-				/*
-				 * thread_resources = thread_resources->next;
-				 * break;
-				 */
+		pthread_mutex_lock(&thread_resources->lock);
+		if (thread_resources->tid != tid) {
+			/* pthread_self() was reused, the previous thread never called ts_free_thread() */
+			if (thread_resources->tid) {
+				__atomic_fetch_add(&tsrm_adopted, 1, __ATOMIC_RELAXED);
 			}
-		 } while (thread_resources);
+			thread_resources->tid = tid;
+		}
+		pthread_mutex_unlock(&thread_resources->lock);
+		tsrm_tls_set(thread_resources);
+	} else if (!thread_resources) {
+		thread_resources = allocate_new_resource(thread_id);
+		found = tsrm_map_insert((tsrm_uintptr_t) thread_id, thread_resources);
+		if (found != thread_resources) {
+			/* someone else created it for the same thread meanwhile */
+			free_thread_resources(thread_resources);
+			tsrm_tls_set(found);
+			tsrm_free_entry(thread_resources);
+			thread_resources = found;
+		}
 	}
-	tsrm_mutex_unlock(tsmm_mutex);
+	/* another thread's resources are brought up to date by us, with our ctor calls */
+	if (TSRM_ATOMIC_LOAD(&thread_resources->count) < TSRM_ATOMIC_LOAD(&tsrm_id_count)) {
+		tsrm_grow_storage(thread_resources);
+	}
+
+	tsrm_epoch_leave();
 	/* Read a specific resource from the thread's resources.
 	 * This is called outside of a mutex, so have to be aware about external
 	 * changes to the structure as we read it.
 	 */
-	TSRM_SAFE_RETURN_RSRC(thread_resources->storage, id, thread_resources->count);
+	TSRM_SAFE_RETURN_RSRC(thread_resources->storage, id, TSRM_ATOMIC_LOAD(&thread_resources->size));
 }
 
 /* frees an interpreter context.  You are responsible for making sure that
  * it is not linked into the TSRM hash, and not marked as the current interpreter */
 void tsrm_free_interpreter_context(void *context)
 {
-	tsrm_tls_entry *next, *thread_resources = (tsrm_tls_entry*)context;
-	int i;
+	tsrm_tls_entry *thread_resources = (tsrm_tls_entry*)context;
 
-	while (thread_resources) {
-		next = thread_resources->next;
-
-		for (i=0; i<thread_resources->count; i++) {
-			if (resource_types_table[i].dtor) {
-				resource_types_table[i].dtor(thread_resources->storage[i]);
-			}
-		}
-		for (i=0; i<thread_resources->count; i++) {
-			free(thread_resources->storage[i]);
-		}
-		free(thread_resources->storage);
-		free(thread_resources);
-		thread_resources = next;
+	if (thread_resources) {
+		tsrm_epoch_enter();
+		free_thread_resources(thread_resources);
+		tsrm_epoch_leave();
+		tsrm_free_entry(thread_resources);
 	}
 }
 
@@ -353,15 +1207,17 @@ void *tsrm_set_interpreter_context(void *new_ctx)
 /* allocates a new interpreter context */
 void *tsrm_new_interpreter_context(void)
 {
-	tsrm_tls_entry *new_ctx, *current;
+	tsrm_tls_entry *current;
 	THREAD_T thread_id;
 
 	thread_id = tsrm_thread_id();
-	tsrm_mutex_lock(tsmm_mutex);
+	tsrm_epoch_enter();
 
 	current = tsrm_tls_get();
 
-	allocate_new_resource(&new_ctx, thread_id);
+	allocate_new_resource(thread_id);
+
+	tsrm_epoch_leave();
 
 	/* switch back to the context that was in use prior to our creation
 	 * of the new one */
@@ -369,128 +1225,527 @@ void *tsrm_new_interpreter_context(void)
 }
 
 
+/* dtor and ctor again, in place, the resources of p marked dirty */
+static void tsrm_reset_entry(tsrm_tls_entry *p)
+{
+	tsrm_resource_type *types;
+	int i, count = TSRM_ATOMIC_LOAD(&p->count);
+
+	tsrm_epoch_enter();
+	types = TSRM_ATOMIC_LOAD(&resource_types_table);
+	for (i=0; i<count; i++) {
+		if (!p->all_dirty && (i / TSRM_DIRTY_BITS >= p->dirty_words
+				|| !(p->dirty[i / TSRM_DIRTY_BITS] & (1UL << i % TSRM_DIRTY_BITS)))) {
+			continue;
+		}
+		if (!p->storage[i] || TSRM_ATOMIC_LOAD(&types[i].done)) {
+			continue;
+		}
+		if (types[i].dtor) {
+			types[i].dtor(p->storage[i]);
+		}
+		if (types[i].ctor) {
+			types[i].ctor(p->storage[i]);
+		}
+		__atomic_fetch_add(&types[i].stats->resets, 1, __ATOMIC_RELAXED);
+	}
+	p->all_dirty = 0;
+	if (p->dirty_words) {
+		memset(p->dirty, 0, sizeof(unsigned long)*p->dirty_words);
+	}
+	tsrm_epoch_leave();
+}
+
+TSRM_API void *tsrm_acquire_interpreter_context(void)
+{
+	tsrm_tls_entry *context = NULL;
+
+	tsrm_mutex_lock(tsrm_pool_mutex);
+	if (tsrm_pool_count > 0) {
+		context = tsrm_pool[--tsrm_pool_count];
+	}
+	tsrm_mutex_unlock(tsrm_pool_mutex);
+
+	if (!context) {
+		return tsrm_new_interpreter_context();
+	}
+	/* the ids allocated while it was in the pool, before it is current */
+	tsrm_storage_update(context);
+	return context;
+}
+
+TSRM_API void tsrm_release_interpreter_context(void *ctx)
+{
+	tsrm_tls_entry *context = (tsrm_tls_entry *) ctx;
+
+	if (!context) {
+		return;
+	}
+	tsrm_reset_entry(context);
+
+	tsrm_mutex_lock(tsrm_pool_mutex);
+	if (tsrm_pool_count < tsrm_pool_size) {
+		if (!tsrm_pool) {
+			tsrm_pool = (tsrm_tls_entry **) malloc(sizeof(tsrm_tls_entry *)*tsrm_pool_size);
+		}
+		if (tsrm_pool) {
+			tsrm_pool[tsrm_pool_count++] = context;
+			context = NULL;
+		}
+	}
+	tsrm_mutex_unlock(tsrm_pool_mutex);
+
+	if (context) {
+		tsrm_free_interpreter_context(context);
+	}
+}
+
+/* free the pooled contexts beyond keep */
+static void tsrm_context_pool_free(int keep)
+{
+	while (1) {
+		tsrm_tls_entry *context = NULL;
+
+		tsrm_mutex_lock(tsrm_pool_mutex);
+		if (tsrm_pool_count > keep) {
+			context = tsrm_pool[--tsrm_pool_count];
+		}
+		tsrm_mutex_unlock(tsrm_pool_mutex);
+		if (!context) {
+			break;
+		}
+		tsrm_free_interpreter_context(context);
+	}
+}
+
+TSRM_API void tsrm_set_context_pool_size(int size)
+{
+	tsrm_tls_entry **pool;
+
+	tsrm_context_pool_free(size);
+	tsrm_mutex_lock(tsrm_pool_mutex);
+	pool = (tsrm_tls_entry **) realloc(tsrm_pool, sizeof(tsrm_tls_entry *)*(size ? size : 1));
+	if (pool) {
+		tsrm_pool = pool;
+		tsrm_pool_size = size;
+	}
+	tsrm_mutex_unlock(tsrm_pool_mutex);
+}
+
+TSRM_API void ts_resource_dirty(ts_rsrc_id id)
+{
+	tsrm_tls_entry *p = tsrm_tls_get();
+	int i;
+
+	if (!p) {
+		return;
+	}
+	if (id == 0) {
+		p->all_dirty = 1;
+		return;
+	}
+	i = TSRM_UNSHUFFLE_RSRC_ID(id);
+	if (i < 0 || i >= TSRM_ATOMIC_LOAD(&tsrm_id_count)) {
+		return;
+	}
+	if (i / TSRM_DIRTY_BITS >= p->dirty_words) {
+		int words = i / TSRM_DIRTY_BITS + 1;
+		unsigned long *dirty = (unsigned long *) realloc(p->dirty, sizeof(unsigned long)*words);
+
+		if (!dirty) {
+			/* all of them then */
+			p->all_dirty = 1;
+			return;
+		}
+		memset(dirty + p->dirty_words, 0, sizeof(unsigned long)*(words - p->dirty_words));
+		p->dirty = dirty;
+		p->dirty_words = words;
+	}
+	p->dirty[i / TSRM_DIRTY_BITS] |= 1UL << i % TSRM_DIRTY_BITS;
+}
+
+
+/* takes an entry out of the table and frees it, its dtors run in this thread */
+static void tsrm_release_entry(tsrm_tls_entry *thread_resources)
+{
+	if (!tsrm_map_remove((tsrm_uintptr_t) thread_resources->thread_id, thread_resources)) {
+		return;
+	}
+	/* wait for a ts_allocate_id()/ts_free_id() that is working on it */
+	pthread_mutex_lock(&thread_resources->lock);
+	thread_resources->dead = 1;
+	pthread_mutex_unlock(&thread_resources->lock);
+
+	free_thread_resources(thread_resources);
+	tsrm_epoch_retire(thread_resources, tsrm_free_entry);
+}
+
+
 /* frees all resources allocated for the current thread */
 void ts_free_thread(void)
 {
 	tsrm_tls_entry *thread_resources;
-	int i;
 	THREAD_T thread_id = tsrm_thread_id();
-	int hash_value;
-	tsrm_tls_entry *last=NULL;
 
-	tsrm_mutex_lock(tsmm_mutex);
-	hash_value = THREAD_HASH_OF(thread_id, tsrm_tls_table_size);
-	thread_resources = tsrm_tls_table[hash_value];
-
-	while (thread_resources) {
-		if (thread_resources->thread_id == thread_id) {
-			for (i=0; i<thread_resources->count; i++) {
-				if (resource_types_table[i].dtor) {
-					resource_types_table[i].dtor(thread_resources->storage[i]);
-				}
-			}
-			for (i=0; i<thread_resources->count; i++) {
-				free(thread_resources->storage[i]);
-			}
-			free(thread_resources->storage);
-			if (last) {
-				last->next = thread_resources->next;
-			} else {
-				tsrm_tls_table[hash_value] = thread_resources->next;
-			}
-			tsrm_tls_set(0);
-			free(thread_resources);
+	tsrm_epoch_enter();
+	thread_resources = tsrm_map_find((tsrm_uintptr_t) thread_id);
+	if (thread_resources) {
+		tsrm_release_entry(thread_resources);
+		tsrm_tls_set(0);
+	}
+	tsrm_epoch_leave();
+}
+
+
+#define TSRM_WORKER_BATCH	64
+
+typedef struct {
+	tsrm_tls_entry *entries[TSRM_WORKER_BATCH];
+	int count;
+} tsrm_worker_batch;
+
+static void tsrm_collect_worker(tsrm_tls_entry *p, void *arg)
+{
+	tsrm_worker_batch *batch = (tsrm_worker_batch *) arg;
+
+	if (batch->count < TSRM_WORKER_BATCH && !pthread_equal(p->thread_id, tsrm_thread_id())) {
+		batch->entries[batch->count++] = p;
+	}
+}
+
+/* frees all resources allocated for all threads except current */
+void ts_free_worker_threads(void)
+{
+	tsrm_worker_batch batch;
+
+	tsrm_epoch_enter();
+	/* the dtors run outside of tsrm_map_apply(), they may start a thread's resources */
+	for (;;) {
+		batch.count = 0;
+		tsrm_map_apply(tsrm_collect_worker, &batch);
+		if (!batch.count) {
 			break;
 		}
-		if (thread_resources->next) {
-			last = thread_resources;
+		while (batch.count > 0) {
+			tsrm_release_entry(batch.entries[--batch.count]);
 		}
-		thread_resources = thread_resources->next;
 	}
-	tsrm_mutex_unlock(tsmm_mutex);
+	tsrm_epoch_leave();
 }
 
 
-/* frees all resources allocated for all threads except current */
-void ts_free_worker_threads(void)
+static void tsrm_free_id_of(tsrm_tls_entry *p, void *arg)
 {
-	tsrm_tls_entry *thread_resources;
-	int i;
-	THREAD_T thread_id = tsrm_thread_id();
-	int hash_value;
-	tsrm_tls_entry *last=NULL;
+	int j = *(int *) arg;
 
-	tsrm_mutex_lock(tsmm_mutex);
-	hash_value = THREAD_HASH_OF(thread_id, tsrm_tls_table_size);
-	thread_resources = tsrm_tls_table[hash_value];
-
-	while (thread_resources) {
-		if (thread_resources->thread_id != thread_id) {
-			for (i=0; i<thread_resources->count; i++) {
-				if (resource_types_table[i].dtor) {
-					resource_types_table[i].dtor(thread_resources->storage[i]);
-				}
-			}
-			for (i=0; i<thread_resources->count; i++) {
-				free(thread_resources->storage[i]);
-			}
-			free(thread_resources->storage);
-			if (last) {
-				last->next = thread_resources->next;
-			} else {
-				tsrm_tls_table[hash_value] = thread_resources->next;
-			}
-			free(thread_resources);
-			if (last) {
-				thread_resources = last->next;
-			} else {
-				thread_resources = tsrm_tls_table[hash_value];
-			}
-		} else {
-			if (thread_resources->next) {
-				last = thread_resources;
-			}
-			thread_resources = thread_resources->next;
+	pthread_mutex_lock(&p->lock);
+	if (!p->dead && p->count > j && p->storage[j]) {
+		if (resource_types_table && resource_types_table[j].dtor) {
+			resource_types_table[j].dtor(p->storage[j]);
 		}
+		tsrm_resource_destructed(p, j, &resource_types_table[j].stats->freed_by_id);
+		p->stats[j].state = TSRM_RSRC_FREED;
+		tsrm_resource_free(p, resource_types_table, j);
+		p->storage[j] = NULL;
 	}
-	tsrm_mutex_unlock(tsmm_mutex);
+	pthread_mutex_unlock(&p->lock);
 }
 
-
 /* deallocates all occurrences of a given id */
 void ts_free_id(ts_rsrc_id id)
 {
-	int i;
 	int j = TSRM_UNSHUFFLE_RSRC_ID(id);
 
 	tsrm_mutex_lock(tsmm_mutex);
 
 	TSRM_ERROR((TSRM_ERROR_LEVEL_CORE, "Freeing resource id %d", id));
 
+	/* before the walk, a thread that catches up afterwards must not construct it again */
+	TSRM_ATOMIC_STORE(&resource_types_table[j].done, 1);
 	if (tsrm_tls_table) {
-		for (i=0; i<tsrm_tls_table_size; i++) {
-			tsrm_tls_entry *p = tsrm_tls_table[i];
+		tsrm_epoch_enter();
+		tsrm_map_apply(tsrm_free_id_of, &j);
+		tsrm_epoch_leave();
+	}
 
-			while (p) {
-				if (p->count > j && p->storage[j]) {
-					if (resource_types_table && resource_types_table[j].dtor) {
-						resource_types_table[j].dtor(p->storage[j]);
-					}
-					free(p->storage[j]);
-					p->storage[j] = NULL;
-				}
-				p = p->next;
-			}
+	tsrm_mutex_unlock(tsmm_mutex);
+
+	TSRM_ERROR((TSRM_ERROR_LEVEL_CORE, "Successfully freed resource id %d", id));
+}
+
+
+
+/*
+ * Resource accounting
+ */
+
+typedef struct {
+	tsrm_usage_func_t func;
+	void *arg;
+} tsrm_usage_ctx;
+
+/* the thread of p is gone without ts_free_thread(), its task is not in /proc any more */
+static int tsrm_entry_exited(tsrm_tls_entry *p)
+{
+	char path[64];
+
+	if (!p->tid) {
+		return 0;
+	}
+	snprintf(path, sizeof(path), "/proc/self/task/%d", p->tid);
+	return access(path, F_OK) != 0;
+}
+
+static void tsrm_usage_of(tsrm_tls_entry *p, void *arg)
+{
+	tsrm_usage_ctx *ctx = (tsrm_usage_ctx *) arg;
+	tsrm_resource_type *types;
+	tsrm_resource_usage u;
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	u.thread_id = p->thread_id;
+	u.tid = p->tid;
+	u.exited = tsrm_entry_exited(p);
+	types = TSRM_ATOMIC_LOAD(&resource_types_table);
+	if (!p->dead) {
+		for (i=0; i<p->count; i++) {
+			u.id = TSRM_SHUFFLE_RSRC_ID(i);
+			u.size = types[i].size;
+			u.ctor_ns = p->stats[i].ctor_ns;
+			u.state = p->stats[i].state;
+			ctx->func(&u, ctx->arg);
 		}
 	}
-	resource_types_table[j].done = 1;
+	pthread_mutex_unlock(&p->lock);
+}
+
+TSRM_API void tsrm_usage_apply(tsrm_usage_func_t func, void *arg)
+{
+	tsrm_usage_ctx ctx;
+
+	ctx.func = func;
+	ctx.arg = arg;
+	tsrm_epoch_enter();
+	tsrm_map_apply(tsrm_usage_of, &ctx);
+	tsrm_epoch_leave();
+}
+
+TSRM_API int tsrm_resource_stats_get(ts_rsrc_id id, tsrm_resource_stats *stats)
+{
+	tsrm_resource_stats *st;
+	int j = TSRM_UNSHUFFLE_RSRC_ID(id);
 
+	tsrm_mutex_lock(tsmm_mutex);
+	if (j < 0 || j >= tsrm_id_count) {
+		tsrm_mutex_unlock(tsmm_mutex);
+		return 0;
+	}
+	st = resource_types_table[j].stats;
+	stats->size = st->size;
+	stats->ctors = __atomic_load_n(&st->ctors, __ATOMIC_RELAXED);
+	stats->freed_by_thread = __atomic_load_n(&st->freed_by_thread, __ATOMIC_RELAXED);
+	stats->freed_by_id = __atomic_load_n(&st->freed_by_id, __ATOMIC_RELAXED);
+	stats->resets = __atomic_load_n(&st->resets, __ATOMIC_RELAXED);
+	stats->ctor_ns = __atomic_load_n(&st->ctor_ns, __ATOMIC_RELAXED);
+	stats->ctor_ns_max = __atomic_load_n(&st->ctor_ns_max, __ATOMIC_RELAXED);
 	tsrm_mutex_unlock(tsmm_mutex);
+	return 1;
+}
 
-	TSRM_ERROR((TSRM_ERROR_LEVEL_CORE, "Successfully freed resource id %d", id));
+TSRM_API void tsrm_table_stats_get(tsrm_table_stats *stats)
+{
+	tsrm_tls_map *map;
+	size_t i;
+
+	memset(stats, 0, sizeof(*stats));
+	tsrm_epoch_enter();
+	map = tsrm_map_lock();
+	stats->size = map->size;
+	for (i = 0; i < map->size; i++) {
+		tsrm_uintptr_t k = TSRM_ATOMIC_LOAD(&map->slots[i].thread_id);
+		size_t d;
+
+		if (k == 0) {
+			continue;
+		}
+		stats->used++;
+		if (!TSRM_ATOMIC_LOAD(&map->slots[i].entry)) {
+			continue;
+		}
+		stats->live++;
+		d = (i - THREAD_HASH_OF(k, map->size)) & (map->size - 1);
+		stats->probes[d < TSRM_PROBE_HIST - 1 ? d : TSRM_PROBE_HIST - 1]++;
+	}
+	tsrm_mutex_unlock(tsrm_grow_mutex);
+	tsrm_epoch_leave();
+}
+
+typedef struct {
+	FILE *out;					/* the per thread lines, written out after the walk */
+	int count;
+	size_t *live;				/* bytes per id, threads still there */
+	size_t *exited;				/* bytes per id, threads gone without ts_free_thread() */
+	tsrm_resource_usage thread;	/* the thread being summed up */
+	size_t thread_bytes;
+	uint64_t thread_ctor_ns;
+	int thread_freed;
+	int threads;
+	int threads_exited;
+} tsrm_dump_ctx;
+
+static void tsrm_dump_thread_line(tsrm_dump_ctx *ctx)
+{
+	if (ctx->thread.id) {
+		fprintf(ctx->out, "thread %#lx tid %d%s: %zu bytes, ctors %.1f us, %d freed by ts_free_id()\n",
+			(unsigned long) ctx->thread.thread_id, ctx->thread.tid, ctx->thread.exited ? " EXITED" : "",
+			ctx->thread_bytes, ctx->thread_ctor_ns / 1000.0, ctx->thread_freed);
+		ctx->threads++;
+		ctx->threads_exited += ctx->thread.exited;
+	}
+}
+
+static void tsrm_dump_usage_of(const tsrm_resource_usage *u, void *arg)
+{
+	tsrm_dump_ctx *ctx = (tsrm_dump_ctx *) arg;
+	int j = TSRM_UNSHUFFLE_RSRC_ID(u->id);
+
+	/* a thread's resources come one after the other, from id 1 */
+	if (j == 0) {
+		tsrm_dump_thread_line(ctx);
+		ctx->thread = *u;
+		ctx->thread_bytes = 0;
+		ctx->thread_ctor_ns = 0;
+		ctx->thread_freed = 0;
+	}
+	if (u->state == TSRM_RSRC_LIVE) {
+		ctx->thread_bytes += u->size;
+		if (j < ctx->count) {
+			if (u->exited) {
+				ctx->exited[j] += u->size;
+			} else {
+				ctx->live[j] += u->size;
+			}
+		}
+	}
+	ctx->thread_ctor_ns += u->ctor_ns;
+	ctx->thread_freed += u->state == TSRM_RSRC_FREED;
+}
+
+TSRM_API void tsrm_usage_dump(FILE *out)
+{
+	tsrm_dump_ctx ctx;
+	tsrm_table_stats table;
+	char *threads = NULL;
+	size_t threads_len = 0;
+	int j;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.count = TSRM_ATOMIC_LOAD(&tsrm_id_count);
+	ctx.live = (size_t *) calloc(ctx.count + 1, sizeof(size_t));
+	ctx.exited = (size_t *) calloc(ctx.count + 1, sizeof(size_t));
+	ctx.out = open_memstream(&threads, &threads_len);
+	if (!ctx.live || !ctx.exited || !ctx.out) {
+		goto out;
+	}
+	tsrm_usage_apply(tsrm_dump_usage_of, &ctx);
+	tsrm_dump_thread_line(&ctx);
+	fclose(ctx.out);
+	ctx.out = NULL;
+
+	fprintf(out, "TSRM usage, pid %d, %d ids, %d threads, %d exited without ts_free_thread(), %lu taken over by a new thread\n",
+		(int) getpid(), ctx.count, ctx.threads, ctx.threads_exited, __atomic_load_n(&tsrm_adopted, __ATOMIC_RELAXED));
+	fprintf(out, "%6s %8s %10s %10s %10s %10s %12s %12s %10s %10s\n", "id", "size", "ctors", "by thread", "by id",
+		"resets", "live bytes", "exited bytes", "ctor us", "max us");
+	for (j = 0; j < ctx.count; j++) {
+		tsrm_resource_stats st;
+
+		if (!tsrm_resource_stats_get(TSRM_SHUFFLE_RSRC_ID(j), &st)) {
+			continue;
+		}
+		fprintf(out, "%6d %8zu %10lu %10lu %10lu %10lu %12zu %12zu %10.1f %10.1f\n", TSRM_SHUFFLE_RSRC_ID(j), st.size,
+			st.ctors, st.freed_by_thread, st.freed_by_id, st.resets, ctx.live[j], ctx.exited[j],
+			st.ctors ? st.ctor_ns / 1000.0 / st.ctors : 0.0, st.ctor_ns_max / 1000.0);
+	}
+	tsrm_table_stats_get(&table);
+	fprintf(out, "table: %zu slots, %zu used, %zu live, probe lengths", table.size, table.used, table.live);
+	for (j = 0; j < TSRM_PROBE_HIST; j++) {
+		if (table.probes[j]) {
+			fprintf(out, " %d%s:%zu", j, j == TSRM_PROBE_HIST - 1 ? "+" : "", table.probes[j]);
+		}
+	}
+	fprintf(out, "\n");
+	fwrite(threads, 1, threads_len, out);
+	fflush(out);
+
+out:
+	if (ctx.out) {
+		fclose(ctx.out);
+	}
+	free(threads);
+	free(ctx.live);
+	free(ctx.exited);
+}
+
+static pthread_t tsrm_dump_thread;
+static int tsrm_dump_signo;
+static int tsrm_dump_stop;
+static char *tsrm_dump_filename;
+
+/* sigwait() instead of a handler: the dump takes locks and does stdio */
+static void *tsrm_dump_main(void *arg)
+{
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, tsrm_dump_signo);
+	while (sigwait(&set, &sig) == 0 && !TSRM_ATOMIC_LOAD(&tsrm_dump_stop)) {
+		FILE *f = fopen(tsrm_dump_filename, "a");
+
+		if (f) {
+			tsrm_usage_dump(f);
+			fclose(f);
+		}
+	}
+	return NULL;
 }
 
+TSRM_API int tsrm_usage_dump_on_signal(int signo, const char *filename)
+{
+	sigset_t set;
+
+	if (tsrm_dump_signo) {
+		return 0;
+	}
+	sigemptyset(&set);
+	sigaddset(&set, signo);
+	if (tsrm_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+		return 0;
+	}
+	tsrm_dump_filename = strdup(filename);
+	tsrm_dump_signo = signo;
+	tsrm_dump_stop = 0;
+	if (pthread_create(&tsrm_dump_thread, NULL, tsrm_dump_main, NULL) != 0) {
+		free(tsrm_dump_filename);
+		tsrm_dump_filename = NULL;
+		tsrm_dump_signo = 0;
+		return 0;
+	}
+	return 1;
+}
 
+static void tsrm_usage_dump_stop(void)
+{
+	if (tsrm_dump_signo) {
+		TSRM_ATOMIC_STORE(&tsrm_dump_stop, 1);
+		pthread_kill(tsrm_dump_thread, tsrm_dump_signo);
+		pthread_join(tsrm_dump_thread, NULL);
+		free(tsrm_dump_filename);
+		tsrm_dump_filename = NULL;
+		tsrm_dump_signo = 0;
+	}
+}
 
 
 /*
@@ -587,8 +1842,21 @@ void tsrm_error_set(int level, char *debug_filename)
 
 }
 
+/* TSRMLS_CACHE behind tsrm_id_count: grow its storage, see tsrm_ls_cache_checked() */
+TSRM_API void *tsrm_ls_cache_catch_up(void *cache)
+{
+	tsrm_storage_update((tsrm_tls_entry *) cache);
+	return cache;
+}
+
 TSRM_API void *tsrm_get_ls_cache(void)
 {
-	return tsrm_tls_get();
+	tsrm_tls_entry *p = tsrm_tls_get();
+
+	/* TSRMG() and TSRMLS_CACHE_UPDATE() come here, make the late ids visible */
+	if (p) {
+		tsrm_storage_update(p);
+	}
+	return p;
 }
 
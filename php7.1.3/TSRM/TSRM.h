@@ -33,11 +33,41 @@ typedef int ts_rsrc_id;
 # define MUTEX_T pthread_mutex_t *
 
 #include <signal.h>
+#include <stdio.h>
 
 typedef void (*ts_allocate_ctor)(void *);
 typedef void (*ts_allocate_dtor)(void *);
 
-#define THREAD_HASH_OF(thr,ts)  (unsigned long)thr%(unsigned long)ts
+/*
+ * Slot of a thread in a table of ts slots, ts a power of 2. pthread ids are
+ * aligned addresses a stack size apart, their low bits are all the same:
+ * mix them first (the MurmurHash3 finalizer, fmix64 or fmix32 for the
+ * width of a pointer). Define it to try another one.
+ */
+#ifndef THREAD_HASH_OF
+static inline unsigned long tsrm_thread_hash(tsrm_uintptr_t p)
+{
+#if UINTPTR_MAX > 0xffffffffUL
+	uint64_t h = (uint64_t) p;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+#else
+	uint32_t h = (uint32_t) p;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+#endif
+	return (unsigned long) h;
+}
+#define THREAD_HASH_OF(thr,ts)  (tsrm_thread_hash((tsrm_uintptr_t) (thr)) & ((unsigned long) (ts) - 1))
+#endif
 
 
 /* startup/shutdown */
@@ -47,6 +77,15 @@ TSRM_API void tsrm_shutdown(void);
 /* allocates a new thread-safe-resource id */
 TSRM_API ts_rsrc_id ts_allocate_id(ts_rsrc_id *rsrc_id, size_t size, ts_allocate_ctor ctor, ts_allocate_dtor dtor);
 
+/* lays all resources out in one block per thread, call before the first ts_resource() */
+TSRM_API void tsrm_reserve(size_t size);
+
+/* offset of a resource in the block, 0 if it is not in there */
+TSRM_API size_t ts_resource_offset(ts_rsrc_id id);
+
+/* ts_allocate_id() that also returns the resource's offset in the block, 0 if it did not fit */
+TSRM_API ts_rsrc_id ts_allocate_fast_id(ts_rsrc_id *rsrc_id, size_t *offset, size_t size, ts_allocate_ctor ctor, ts_allocate_dtor dtor);
+
 /* fetches the requested resource for the current thread */
 TSRM_API void *ts_resource_ex(ts_rsrc_id id, THREAD_T *th_id);
 #define ts_resource(id)			ts_resource_ex(id, NULL)
@@ -61,6 +100,58 @@ void ts_free_worker_threads(void);
 TSRM_API void ts_free_id(ts_rsrc_id id);
 
 
+/* Resource accounting */
+#define TSRM_RSRC_NONE	0	/* not constructed, the id was freed before the thread got to it */
+#define TSRM_RSRC_LIVE	1
+#define TSRM_RSRC_FREED	2	/* the dtor ran in ts_free_id() */
+
+typedef struct {
+	THREAD_T thread_id;
+	int tid;				/* kernel thread id, 0 if another thread created the entry */
+	int exited;				/* the thread is gone and never called ts_free_thread() */
+	ts_rsrc_id id;
+	size_t size;
+	uint64_t ctor_ns;
+	int state;
+} tsrm_resource_usage;
+
+typedef struct {
+	size_t size;
+	unsigned long ctors;
+	unsigned long freed_by_thread;	/* dtor ran in ts_free_thread() or ts_free_worker_threads() */
+	unsigned long freed_by_id;		/* dtor ran in ts_free_id() */
+	unsigned long resets;			/* dtor and ctor ran on a context going back to the pool */
+	uint64_t ctor_ns;
+	uint64_t ctor_ns_max;
+} tsrm_resource_stats;
+
+typedef void (*tsrm_usage_func_t)(const tsrm_resource_usage *usage, void *arg);
+
+/* func for every resource of every thread in the table; TSRM locks are held, func must not call TSRM */
+TSRM_API void tsrm_usage_apply(tsrm_usage_func_t func, void *arg);
+
+/* totals of an id over all threads, gone ones included; 0 if there is no such id */
+TSRM_API int tsrm_resource_stats_get(ts_rsrc_id id, tsrm_resource_stats *stats);
+
+/* per id and per thread report, with what threads that exited without ts_free_thread() left behind */
+TSRM_API void tsrm_usage_dump(FILE *out);
+
+/* thread table: d slots from their hash slot in probes[d], the last one is d or more */
+#define TSRM_PROBE_HIST	16
+
+typedef struct {
+	size_t size;
+	size_t used;			/* slots with a thread id, of threads still there or not */
+	size_t live;
+	size_t probes[TSRM_PROBE_HIST];
+} tsrm_table_stats;
+
+TSRM_API void tsrm_table_stats_get(tsrm_table_stats *stats);
+
+/* tsrm_usage_dump() appended to filename on every signo; call before starting threads, they inherit signo blocked */
+TSRM_API int tsrm_usage_dump_on_signal(int signo, const char *filename);
+
+
 /* Debug support */
 #define TSRM_ERROR_LEVEL_ERROR	1
 #define TSRM_ERROR_LEVEL_CORE	2
@@ -90,8 +181,45 @@ TSRM_API void *tsrm_new_interpreter_context(void);
 TSRM_API void *tsrm_set_interpreter_context(void *new_ctx);
 TSRM_API void tsrm_free_interpreter_context(void *context);
 
+/*
+ * Interpreter context pool: acquire() hands out a released context, or a
+ * new one if the pool is empty. release() runs dtor and ctor again, in
+ * place, on the resources marked with ts_resource_dirty() while the context
+ * was current, and keeps it for the next acquire(); it must not be current.
+ */
+TSRM_API void *tsrm_acquire_interpreter_context(void);
+TSRM_API void tsrm_release_interpreter_context(void *context);
+/* contexts kept at most, the ones over it are freed; 64 by default */
+TSRM_API void tsrm_set_context_pool_size(int size);
+/* id has to be reset when the current context goes back to the pool, 0 for all */
+TSRM_API void ts_resource_dirty(ts_rsrc_id id);
+
 TSRM_API void *tsrm_get_ls_cache(void);
 
+/*
+ * ts_allocate_id() does not grow the storage of the other threads, each
+ * one grows its own when it finds its count behind tsrm_id_count. TSRMG()
+ * does that in tsrm_get_ls_cache(); TSRMG_STATIC() and TSRMG_FAST_STATIC()
+ * read TSRMLS_CACHE, set maybe long before the id was allocated, so they
+ * check here: two loads and a compare while there is nothing new.
+ */
+typedef struct {
+	void **storage;
+	int count;
+} tsrm_ls_header;
+
+extern TSRM_API ts_rsrc_id tsrm_id_count;
+TSRM_API void *tsrm_ls_cache_catch_up(void *cache);
+
+static inline void *tsrm_ls_cache_checked(void *cache)
+{
+	if (__builtin_expect(__atomic_load_n(&((tsrm_ls_header *) cache)->count, __ATOMIC_RELAXED)
+			< __atomic_load_n(&tsrm_id_count, __ATOMIC_ACQUIRE), 0)) {
+		return tsrm_ls_cache_catch_up(cache);
+	}
+	return cache;
+}
+
 # define TSRM_TLS __thread
 
 #define TSRM_SHUFFLE_RSRC_ID(rsrc_id)		((rsrc_id)+1)
@@ -102,8 +230,13 @@ TSRM_API void *tsrm_get_ls_cache(void);
 #define TSRMG(id, type, element)	(TSRMG_BULK(id, type)->element)
 #define TSRMG_BULK(id, type)	((type) (*((void ***) tsrm_get_ls_cache()))[TSRM_UNSHUFFLE_RSRC_ID(id)])
 
+#define TSRMG_FAST(offset, type, element)	(TSRMG_FAST_BULK(offset, type)->element)
+#define TSRMG_FAST_BULK(offset, type)	((type) (((char*) tsrm_get_ls_cache())+(offset)))
+
 #define TSRMG_STATIC(id, type, element)	(TSRMG_BULK_STATIC(id, type)->element)
-#define TSRMG_BULK_STATIC(id, type)	((type) (*((void ***) TSRMLS_CACHE))[TSRM_UNSHUFFLE_RSRC_ID(id)])
+#define TSRMG_BULK_STATIC(id, type)	((type) (*((void ***) tsrm_ls_cache_checked(TSRMLS_CACHE)))[TSRM_UNSHUFFLE_RSRC_ID(id)])
+#define TSRMG_FAST_STATIC(offset, type, element)	(TSRMG_FAST_BULK_STATIC(offset, type)->element)
+#define TSRMG_FAST_BULK_STATIC(offset, type)	((type) (((char*) tsrm_ls_cache_checked(TSRMLS_CACHE))+(offset)))
 #define TSRMLS_CACHE_EXTERN() extern TSRM_TLS void *TSRMLS_CACHE;
 #define TSRMLS_CACHE_DEFINE() TSRM_TLS void *TSRMLS_CACHE = NULL;
 #define TSRMLS_CACHE_UPDATE() if (!TSRMLS_CACHE) TSRMLS_CACHE = tsrm_get_ls_cache()
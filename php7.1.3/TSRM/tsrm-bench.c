@@ -0,0 +1,611 @@
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "TSRM.h"
+#include "../../httpd/histogram.h"
+
+/*
+ * TSRM under ZTS worker churn.
+ *
+ *   churn     -c launchers each start and join threads until -n threads
+ *             have run; a thread gets its resources (ts_resource(0), the
+ *             slow path: table insert, -r ctors of -s bytes), touches them
+ *             and calls ts_free_thread(). Prints threads/s and the time of
+ *             the first ts_resource(0) and of ts_free_thread(). -B puts the
+ *             resources in one block per thread (tsrm_reserve()).
+ *   layout    -x interpreter contexts, -i requests each touching two words
+ *             of every resource of a random context: the storage[] layout
+ *             through storage[], the block layout through storage[] and
+ *             through the offset (TSRMG_FAST). Prints ns and, if
+ *             perf_event_open() is allowed, L1d and LLC misses per access.
+ *   access    ns per access of one global, -i times, through the old
+ *             pthread_getspecific() path, ts_resource(), TSRMG(), TSRMG()
+ *             with the extension's TSRMLS_CACHE, and by offset from
+ *             tsrm_get_ls_cache() and from TSRMLS_CACHE.
+ *   late      -n threads hold their resources and wait while -r more ids
+ *             are allocated, like an extension loaded at runtime; prints
+ *             the time of ts_allocate_id() and of each thread's first
+ *             access afterwards, where it picks the new ids up. Half of
+ *             the threads access through TSRMG(), half through the
+ *             TSRMLS_CACHE they set before (TSRMG_STATIC(), with -B
+ *             TSRMG_FAST_STATIC()), and all check the ctor ran. Every
+ *             other new id has a ctor that calls back into TSRM through
+ *             tsrm_get_ls_cache() and ts_resource(), as a GINIT does.
+ *   table     -n threads start at once and hold their resources: the time
+ *             of their first ts_resource(0) (table insert, growing it on
+ *             the way), of looking each one up from another thread, and
+ *             the probe lengths in the thread table. Build with
+ *             -D'THREAD_HASH_OF(thr,ts)=((unsigned long)(thr)%(ts))' for
+ *             the unmixed hash.
+ *   request   -c workers run -i requests each the way a threaded embed SAPI
+ *             would: get an interpreter context, make it current, write -d
+ *             of the resources, put it back. Once with new/free and once
+ *             with the context pool, where only the -d dirty resources
+ *             are reset. Prints requests/s and the time to get and to put
+ *             back a context.
+ *
+ * Build in a configured ZTS tree (tsrm_config.h, main/php_config.h), link
+ * it against the previous TSRM.c for the before numbers:
+ *
+ * gcc -O2 -I. -I.. -I../main tsrm-bench.c TSRM.c -o tsrm-bench -lpthread
+ * ./tsrm-bench [-m churn|layout|access|late|table|request] [-c launchers] [-n threads] [-B] [-x contexts] [-i requests] [-r resources] [-s bytes] [-d dirty]
+ */
+
+#define MAX_RESOURCES   1024
+
+static ts_rsrc_id ids[MAX_RESOURCES];
+static size_t offsets[MAX_RESOURCES];
+static int nresources = 64;
+static size_t rsize = 256;
+static int block;
+static int ndirty = 4;
+static int reserve_extra;          /* ids allocated after startup() that get an offset */
+static volatile uint64_t sink;
+
+typedef struct {
+    long hits;
+} bench_globals;
+
+static ts_rsrc_id bench_id;
+static size_t bench_offset;
+
+TSRMLS_CACHE_DEFINE();
+
+typedef struct {
+    pthread_t th;
+    int threads;
+    histogram_t start;
+    histogram_t stop;
+} launcher_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void rsrc_ctor(void *p)
+{
+    memset(p, 0, rsize);
+}
+
+static void startup(int use_block)
+{
+    int i;
+
+    tsrm_startup(1, nresources, 0, NULL);
+    if (use_block) {
+        /* and the access mode's bench_globals */
+        tsrm_reserve((nresources + reserve_extra) * ((rsize + 15) & ~(size_t)15) + 16);
+    }
+    for (i = 0; i < nresources; i++) {
+        ts_allocate_id(&ids[i], rsize, rsrc_ctor, NULL);
+        offsets[i] = ts_resource_offset(ids[i]);
+    }
+    /* the main thread has its resources like a SAPI's */
+    ts_resource(0);
+}
+
+static int perf_open(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t perf_read(int fd)
+{
+    uint64_t v = 0;
+    if (fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v)) {
+        return 0;
+    }
+    return v;
+}
+
+static void *worker(void *arg)
+{
+    launcher_t *l = arg;
+    uint64_t t0, t1;
+    int i;
+
+    t0 = now_ns();
+    void ***ls = ts_resource(0);
+    t1 = now_ns();
+    hist_record(&l->start, t1 - t0);
+
+    for (i = 0; i < nresources; i++) {
+        ((char *)(*ls)[TSRM_UNSHUFFLE_RSRC_ID(ids[i])])[0]++;
+    }
+
+    t0 = now_ns();
+    ts_free_thread();
+    hist_record(&l->stop, now_ns() - t0);
+    return NULL;
+}
+
+static void *launcher(void *arg)
+{
+    launcher_t *l = arg;
+    pthread_t th;
+    int i;
+
+    for (i = 0; i < l->threads; i++) {
+        if (pthread_create(&th, NULL, worker, l) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_join(th, NULL);
+    }
+    return NULL;
+}
+
+static void churn(int nlaunchers, int nthreads)
+{
+    launcher_t *ls = calloc(nlaunchers, sizeof(launcher_t));
+    histogram_t start, stop;
+    int i;
+
+    startup(block);
+
+    hist_init(&start);
+    hist_init(&stop);
+    uint64_t t0 = now_ns();
+    for (i = 0; i < nlaunchers; i++) {
+        ls[i].threads = nthreads / nlaunchers + (i < nthreads % nlaunchers);
+        hist_init(&ls[i].start);
+        hist_init(&ls[i].stop);
+        pthread_create(&ls[i].th, NULL, launcher, &ls[i]);
+    }
+    for (i = 0; i < nlaunchers; i++) {
+        pthread_join(ls[i].th, NULL);
+        hist_merge(&start, &ls[i].start);
+        hist_merge(&stop, &ls[i].stop);
+    }
+    double secs = (now_ns() - t0) / 1e9;
+
+    printf("churn: %d threads by %d launchers in %.2f s, %.0f threads/s%s\n", nthreads, nlaunchers, secs, nthreads / secs,
+        block ? ", block" : "");
+    hist_print(stdout, "ts_resource(0)", &start, 1000.0, "us");
+    hist_print(stdout, "ts_free_thread", &stop, 1000.0, "us");
+    free(ls);
+    tsrm_shutdown();
+}
+
+static void layout(int ncontexts, long requests)
+{
+    static const char *names[] = { "storage[] layout, storage[]", "block layout, storage[]", "block layout, offset" };
+    void **contexts = malloc(ncontexts * sizeof(void *));
+    size_t words = rsize / sizeof(int);
+    int l1d = perf_open(PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    int llc = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    int mode, i;
+    long r;
+
+    printf("layout: %d contexts x %d resources x %zu bytes, %ld requests\n", ncontexts, nresources, rsize, requests);
+    printf("%-28s %10s %12s %12s\n", "", "ns/access", "L1d/access", "LLC/access");
+    for (mode = 0; mode < 3; mode++) {
+        uint32_t seed = 12345;
+        uint64_t sum = 0;
+
+        startup(mode > 0);
+        for (i = 0; i < ncontexts; i++) {
+            contexts[i] = tsrm_new_interpreter_context();
+        }
+
+        uint64_t l1d0 = perf_read(l1d), llc0 = perf_read(llc), t0 = now_ns();
+        for (r = 0; r < requests; r++) {
+            seed = seed * 1103515245 + 12345;
+            char *ctx = contexts[(seed >> 8) % ncontexts];
+            for (i = 0; i < nresources; i++) {
+                int *p = mode < 2 ? (*(int ***)ctx)[TSRM_UNSHUFFLE_RSRC_ID(ids[i])] : (int *)(ctx + offsets[i]);
+                p[0]++;
+                sum += p[(i * 13) % words]++;
+            }
+        }
+        uint64_t t1 = now_ns(), l1d1 = perf_read(l1d), llc1 = perf_read(llc);
+        double accesses = (double)requests * nresources * 2;
+
+        if (l1d < 0) {
+            printf("%-28s %10.2f %12s %12s\n", names[mode], (t1 - t0) / accesses, "n/a", "n/a");
+        } else {
+            printf("%-28s %10.2f %12.4f %12.4f\n", names[mode], (t1 - t0) / accesses, (l1d1 - l1d0) / accesses, (llc1 - llc0) / accesses);
+        }
+        fflush(stdout);
+
+        for (i = 0; i < ncontexts; i++) {
+            tsrm_free_interpreter_context(contexts[i]);
+        }
+        tsrm_shutdown();
+        sink = sum;
+    }
+    free(contexts);
+}
+
+static pthread_mutex_t late_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t late_cond = PTHREAD_COND_INITIALIZER;
+static int late_ready, late_go, late_bad;
+static histogram_t late_catch_up, late_catch_up_static;
+
+#define LATE_BYTE   0xa5
+
+static void late_ctor(void *p)
+{
+    memset(p, LATE_BYTE, rsize);
+}
+
+/* runs while the thread is still catching up on the new ids */
+static void late_ctor_reenter(void *p)
+{
+    if (tsrm_get_ls_cache() == NULL || ts_resource(ids[0]) == NULL) {
+        return;
+    }
+    late_ctor(p);
+}
+
+static void *late_worker(void *arg)
+{
+    int *last = arg, use_static;
+    unsigned char *r;
+    histogram_t *h;
+
+    ts_resource(0);
+    TSRMLS_CACHE_UPDATE();
+    pthread_mutex_lock(&late_mutex);
+    use_static = late_ready & 1;
+    late_ready++;
+    pthread_cond_broadcast(&late_cond);
+    while (!late_go) {
+        pthread_cond_wait(&late_cond, &late_mutex);
+    }
+    pthread_mutex_unlock(&late_mutex);
+
+    uint64_t t0 = now_ns();
+    if (!use_static) {
+        r = TSRMG_BULK(ids[*last], unsigned char *);
+    } else if (offsets[*last]) {
+        r = TSRMG_FAST_BULK_STATIC(offsets[*last], unsigned char *);
+    } else {
+        r = TSRMG_BULK_STATIC(ids[*last], unsigned char *);
+    }
+    int bad = r[0] != LATE_BYTE || r[rsize - 1] != LATE_BYTE;
+    uint64_t t1 = now_ns();
+
+    h = use_static ? &late_catch_up_static : &late_catch_up;
+    pthread_mutex_lock(&late_mutex);
+    hist_record(h, t1 - t0);
+    late_bad += bad;
+    pthread_mutex_unlock(&late_mutex);
+    ts_free_thread();
+    return NULL;
+}
+
+static void late(int nthreads)
+{
+    pthread_t *ths = malloc(nthreads * sizeof(pthread_t));
+    pthread_attr_t attr;
+    histogram_t alloc;
+    int nlate = nresources, i, last;
+
+    /* the ids of the modules loaded at startup */
+    nresources = 16;
+    reserve_extra = nlate;
+    startup(block);
+    hist_init(&alloc);
+    hist_init(&late_catch_up);
+    hist_init(&late_catch_up_static);
+    late_ready = late_go = late_bad = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&ths[i], &attr, late_worker, &last) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    pthread_mutex_lock(&late_mutex);
+    while (late_ready < nthreads) {
+        pthread_cond_wait(&late_cond, &late_mutex);
+    }
+    pthread_mutex_unlock(&late_mutex);
+
+    for (i = nresources; i < nresources + nlate && i < MAX_RESOURCES; i++) {
+        uint64_t t0 = now_ns();
+        ts_allocate_id(&ids[i], rsize, (i - nresources) & 1 ? late_ctor_reenter : late_ctor, NULL);
+        hist_record(&alloc, now_ns() - t0);
+        offsets[i] = ts_resource_offset(ids[i]);
+    }
+    last = i - 1;
+
+    pthread_mutex_lock(&late_mutex);
+    late_go = 1;
+    pthread_cond_broadcast(&late_cond);
+    pthread_mutex_unlock(&late_mutex);
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(ths[i], NULL);
+    }
+
+    printf("late: %d ids of %zu bytes, %d threads holding resources%s, %d saw no ctor\n", last + 1 - nresources, rsize,
+        nthreads, block ? ", block" : "", late_bad);
+    hist_print(stdout, "ts_allocate_id", &alloc, 1000.0, "us");
+    hist_print(stdout, "first access after, TSRMG", &late_catch_up, 1000.0, "us");
+    hist_print(stdout, block ? "first access after, TSRMG_FAST_STATIC" : "first access after, TSRMG_STATIC",
+        &late_catch_up_static, 1000.0, "us");
+    pthread_attr_destroy(&attr);
+    free(ths);
+    tsrm_shutdown();
+}
+
+static histogram_t table_insert;
+
+static void *table_worker(void *arg)
+{
+    uint64_t t0 = now_ns();
+    ts_resource(0);
+    uint64_t t1 = now_ns();
+
+    pthread_mutex_lock(&late_mutex);
+    hist_record(&table_insert, t1 - t0);
+    late_ready++;
+    pthread_cond_broadcast(&late_cond);
+    while (!late_go) {
+        pthread_cond_wait(&late_cond, &late_mutex);
+    }
+    pthread_mutex_unlock(&late_mutex);
+    ts_free_thread();
+    return NULL;
+}
+
+static void table(int nthreads)
+{
+    pthread_t *ths = malloc(nthreads * sizeof(pthread_t));
+    pthread_attr_t attr;
+    histogram_t lookup;
+    tsrm_table_stats st;
+    int i;
+
+    nresources = 4;
+    startup(0);
+    hist_init(&table_insert);
+    hist_init(&lookup);
+    late_ready = late_go = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&ths[i], &attr, table_worker, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    pthread_mutex_lock(&late_mutex);
+    while (late_ready < nthreads) {
+        pthread_cond_wait(&late_cond, &late_mutex);
+    }
+    pthread_mutex_unlock(&late_mutex);
+
+    for (i = 0; i < nthreads; i++) {
+        uint64_t t0 = now_ns();
+        ts_resource_ex(0, &ths[i]);
+        hist_record(&lookup, now_ns() - t0);
+    }
+    tsrm_table_stats_get(&st);
+
+    printf("table: %d threads, %zu slots, %zu used, %zu live\n", nthreads, st.size, st.used, st.live);
+    hist_print(stdout, "ts_resource(0)", &table_insert, 1000.0, "us");
+    hist_print(stdout, "lookup", &lookup, 1.0, "ns");
+    printf("probe length");
+    for (i = 0; i < TSRM_PROBE_HIST; i++) {
+        printf(" %d%s:%zu", i, i == TSRM_PROBE_HIST - 1 ? "+" : "", st.probes[i]);
+    }
+    printf("\n");
+
+    pthread_mutex_lock(&late_mutex);
+    late_go = 1;
+    pthread_cond_broadcast(&late_cond);
+    pthread_mutex_unlock(&late_mutex);
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(ths[i], NULL);
+    }
+    pthread_attr_destroy(&attr);
+    free(ths);
+    tsrm_shutdown();
+}
+
+typedef struct {
+    pthread_t th;
+    long requests;
+    int pool;
+    histogram_t get;
+    histogram_t put;
+} request_worker_t;
+
+static void *request_worker(void *arg)
+{
+    request_worker_t *w = arg;
+    uint32_t seed = (uint32_t)(uintptr_t)w;
+    long r;
+    int i;
+
+    hist_init(&w->get);
+    hist_init(&w->put);
+    for (r = 0; r < w->requests; r++) {
+        uint64_t t0 = now_ns();
+        void *ctx = w->pool ? tsrm_acquire_interpreter_context() : tsrm_new_interpreter_context();
+        void *prev = tsrm_set_interpreter_context(ctx);
+        uint64_t t1 = now_ns();
+
+        /* the request: a few extensions' globals change */
+        for (i = 0; i < ndirty; i++) {
+            seed = seed * 1103515245 + 12345;
+            int k = (seed >> 8) % nresources;
+            ((char *)TSRMG_BULK(ids[k], char *))[0]++;
+            ts_resource_dirty(ids[k]);
+        }
+
+        uint64_t t2 = now_ns();
+        tsrm_set_interpreter_context(prev);
+        if (w->pool) {
+            tsrm_release_interpreter_context(ctx);
+        } else {
+            tsrm_free_interpreter_context(ctx);
+        }
+        uint64_t t3 = now_ns();
+        hist_record(&w->get, t1 - t0);
+        hist_record(&w->put, t3 - t2);
+    }
+    return NULL;
+}
+
+static void request_bench(int nworkers, long requests)
+{
+    request_worker_t *ws = calloc(nworkers, sizeof(request_worker_t));
+    int pool, i;
+
+    printf("request: %d workers x %ld requests, %d resources x %zu bytes, %d dirty%s\n", nworkers, requests, nresources,
+        rsize, ndirty, block ? ", block" : "");
+    for (pool = 0; pool < 2; pool++) {
+        histogram_t get, put;
+
+        startup(block);
+        hist_init(&get);
+        hist_init(&put);
+        uint64_t t0 = now_ns();
+        for (i = 0; i < nworkers; i++) {
+            ws[i].requests = requests;
+            ws[i].pool = pool;
+            pthread_create(&ws[i].th, NULL, request_worker, &ws[i]);
+        }
+        for (i = 0; i < nworkers; i++) {
+            pthread_join(ws[i].th, NULL);
+            hist_merge(&get, &ws[i].get);
+            hist_merge(&put, &ws[i].put);
+        }
+        double secs = (now_ns() - t0) / 1e9;
+
+        printf("%s: %.0f requests/s\n", pool ? "pool" : "new/free", nworkers * requests / secs);
+        hist_print(stdout, pool ? "acquire" : "new", &get, 1000.0, "us");
+        hist_print(stdout, pool ? "release" : "free", &put, 1000.0, "us");
+        tsrm_shutdown();
+    }
+    free(ws);
+}
+
+#define ACCESS_LOOP(name, expr) do {                                    \
+        uint64_t t0 = now_ns();                                         \
+        for (r = 0; r < iterations; r++) {                              \
+            expr;                                                       \
+            /* every access on its own, nothing hoisted */              \
+            __asm__ __volatile__("" ::: "memory");                      \
+        }                                                               \
+        printf("%-32s %8.2f\n", name, (double)(now_ns() - t0) / iterations); \
+    } while (0)
+
+static void access_bench(long iterations)
+{
+    pthread_key_t key;
+    long r;
+
+    startup(1);
+    ts_allocate_fast_id(&bench_id, &bench_offset, sizeof(bench_globals), NULL, NULL);
+    TSRMLS_CACHE_UPDATE();
+    if (!bench_offset) {
+        printf("no room in the reserved block\n");
+        return;
+    }
+    /* what tsrm_get_ls_cache() was before the static TLS cache */
+    pthread_key_create(&key, NULL);
+    pthread_setspecific(key, tsrm_get_ls_cache());
+
+    printf("access: %ld iterations\n%-32s %8s\n", iterations, "", "ns");
+    ACCESS_LOOP("pthread_getspecific, storage[]",
+        ((bench_globals *)(*(void ***)pthread_getspecific(key))[TSRM_UNSHUFFLE_RSRC_ID(bench_id)])->hits++);
+    ACCESS_LOOP("ts_resource(id)", ((bench_globals *)ts_resource(bench_id))->hits++);
+    ACCESS_LOOP("TSRMG", TSRMG(bench_id, bench_globals *, hits)++);
+    ACCESS_LOOP("TSRMG_STATIC", TSRMG_STATIC(bench_id, bench_globals *, hits)++);
+    ACCESS_LOOP("TSRMG_FAST", TSRMG_FAST(bench_offset, bench_globals *, hits)++);
+    ACCESS_LOOP("TSRMG_FAST_STATIC", TSRMG_FAST_STATIC(bench_offset, bench_globals *, hits)++);
+
+    pthread_key_delete(key);
+    tsrm_shutdown();
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mode = "churn";
+    int nlaunchers = 8, nthreads = 20000, ncontexts = 1024;
+    long requests = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:c:n:Bx:i:r:s:d:")) != -1) {
+        switch (opt) {
+        case 'm': mode = optarg; break;
+        case 'c': nlaunchers = atoi(optarg); break;
+        case 'n': nthreads = atoi(optarg); break;
+        case 'B': block = 1; break;
+        case 'x': ncontexts = atoi(optarg); break;
+        case 'i': requests = atol(optarg); break;
+        case 'r': nresources = atoi(optarg); break;
+        case 's': rsize = atol(optarg); break;
+        case 'd': ndirty = atoi(optarg); break;
+        default:
+            goto usage;
+        }
+    }
+    if (nlaunchers < 1 || ncontexts < 1 || nresources < 1 || nresources > MAX_RESOURCES || rsize < 2 * sizeof(int)) {
+usage:
+        printf("%s [-m churn|layout|access|late|table|request] [-c launchers] [-n threads] [-B] [-x contexts] [-i requests] [-r resources] [-s bytes] [-d dirty]\n", argv[0]);
+        return 1;
+    }
+
+    if (strcmp(mode, "churn") == 0) {
+        churn(nlaunchers, nthreads);
+    } else if (strcmp(mode, "layout") == 0) {
+        layout(ncontexts, requests ? requests : 200000);
+    } else if (strcmp(mode, "access") == 0) {
+        access_bench(requests ? requests : 100000000);
+    } else if (strcmp(mode, "late") == 0) {
+        late(nthreads);
+    } else if (strcmp(mode, "table") == 0) {
+        table(nthreads);
+    } else if (strcmp(mode, "request") == 0) {
+        request_bench(nlaunchers, requests ? requests : 100000);
+    } else {
+        printf("unknown mode %s\n", mode);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fcgi_client.h"
+#include "../httpd/histogram.h"
+
+/*
+ * Load generator for php-fpm (or any FastCGI server) without a web server
+ * in front, on fcgi_client.c.
+ *
+ * -c connections each keep one request in flight for -d seconds or -n
+ * requests in total. Without -k every request gets a new connection, like
+ * nginx without fastcgi_keep_conn; with -k the connection stays, but php-fpm
+ * then keeps a child bound to it until it is closed, so -c must not exceed
+ * pm.max_children.
+ *
+ * Where the time goes:
+ *   connect   connect() to writable; php-fpm accepts only when a child is
+ *             idle, so with a full pool this is the time in the backlog
+ *   ttfb      request written to the first STDOUT record
+ *   total     start (connect or, with -k, the previous response) to
+ *             END_REQUEST
+ * and, when the script sends its start time in a header:
+ *   header('X-Fpm-Start: ' . $_SERVER['REQUEST_TIME_FLOAT']);
+ *   queue     request written to the child picking it up
+ *   service   child picking it up to END_REQUEST
+ * Without the header, ttfb above its minimum is the queueing estimate.
+ *
+ * A full UNIX socket backlog fails connect() with EAGAIN at once (what
+ * nginx logs as "Resource temporarily unavailable"), those are counted
+ * and retried a millisecond later. Any other connect() failure (refused,
+ * unreachable, out of fds) is counted apart from the request errors and
+ * retried after a backoff from 10 ms, doubling up to a second.
+ *
+ * gcc -O2 fcgi-bench.c fcgi_client.c -o fcgi-bench
+ * ./fcgi-bench [-a 127.0.0.1:9000|/run/php-fpm.sock] [-c conns] [-d secs] [-n requests] [-k] [-b body] /path/to/script.php [query]
+ */
+
+#define MAX_EVENTS      256
+#define BACKOFF_MIN_MS  10
+#define BACKOFF_MAX_MS  1000
+
+enum { ST_IDLE, ST_CONNECTING, ST_SENDING, ST_WAITING };
+
+typedef struct {
+    fcgi_conn *fc;
+    int state;
+    int ended;                      /* END_REQUEST seen in this fcgi_read() */
+    int failed;
+    int got_stdout;
+    uint64_t t_start;
+    uint64_t t_connected;
+    uint64_t t_sent;
+    double wall_sent;
+    uint64_t t_first;
+    double fpm_start;               /* X-Fpm-Start, 0 if none */
+    uint64_t retry_at;              /* after EAGAIN or a failed connect() */
+    int backoff_ms;                 /* since the last connect that worked */
+} bench_conn;
+
+static fcgi_address address;
+static fcgi_param params[16];
+static int nparams;
+static const char *body;
+static size_t body_len;
+static int keep_conn;
+static long long max_requests;
+static long long started;
+static volatile sig_atomic_t done;
+
+static int epfd;
+static unsigned long long completed, errors, backlog_full, connect_errors, app_errors;
+static histogram_t h_total, h_connect, h_ttfb, h_queue, h_service;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double wall_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_stdout(void *ctx, int id, const char *data, size_t len)
+{
+    bench_conn *b = ctx;
+    const char *h, *eoh;
+
+    if (b->got_stdout || len == 0) {
+        return;
+    }
+    b->got_stdout = 1;
+    b->t_first = now_ns();
+
+    /* the headers come first, normally in the first record */
+    eoh = memmem(data, len, "\r\n\r\n", 4);
+    h = memmem(data, eoh ? (size_t)(eoh - data) : len, "X-Fpm-Start:", 12);
+    if (h) {
+        b->fpm_start = strtod(h + 12, NULL);
+    }
+}
+
+static void on_end(void *ctx, int id, uint32_t app_status, int protocol_status)
+{
+    bench_conn *b = ctx;
+    b->ended = 1;
+    b->failed = protocol_status != FCGI_REQUEST_COMPLETE;
+    if (app_status != 0) {
+        app_errors++;
+    }
+}
+
+static const fcgi_callbacks callbacks = { on_stdout, NULL, on_end, NULL };
+
+static void watch(bench_conn *b, int op, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = b;
+    epoll_ctl(epfd, op, fcgi_conn_fd(b->fc), &ev);
+}
+
+/* the connect of b failed, not its request: try again later */
+static void connect_failed(bench_conn *b, uint64_t now)
+{
+    connect_errors++;
+    b->backoff_ms = b->backoff_ms ? b->backoff_ms * 2 : BACKOFF_MIN_MS;
+    if (b->backoff_ms > BACKOFF_MAX_MS) {
+        b->backoff_ms = BACKOFF_MAX_MS;
+    }
+    b->retry_at = now + (uint64_t)b->backoff_ms * 1000000;
+}
+
+static void request_send(bench_conn *b)
+{
+    int rv = fcgi_flush(b->fc);
+
+    if (rv == FCGI_AGAIN) {
+        return;
+    }
+    if (rv == FCGI_ERROR) {
+        errors++;
+        fcgi_conn_reset(b->fc, -1);
+        b->state = ST_IDLE;
+        return;
+    }
+    b->t_sent = now_ns();
+    b->wall_sent = wall_now();
+    b->state = ST_WAITING;
+    watch(b, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+static void request_start(bench_conn *b)
+{
+    b->ended = b->failed = b->got_stdout = 0;
+    b->fpm_start = 0;
+    fcgi_send_request(b->fc, 1, params, nparams, body, body_len, keep_conn);
+    b->state = ST_SENDING;
+    watch(b, EPOLL_CTL_MOD, EPOLLOUT);
+    request_send(b);
+}
+
+/* an idle connection starts its next request, on a new socket unless -k */
+static void conn_start(bench_conn *b)
+{
+    if (done || (max_requests && started >= max_requests)) {
+        return;
+    }
+    b->t_start = now_ns();
+    if (b->t_start < b->retry_at) {
+        return;
+    }
+    started++;
+
+    if (fcgi_conn_fd(b->fc) >= 0) {
+        b->t_connected = b->t_start;
+        request_start(b);
+        return;
+    }
+
+    int fd = fcgi_connect_addr(&address, 1);
+    if (fd < 0) {
+        started--;
+        if (errno == EAGAIN) {
+            backlog_full++;
+            b->retry_at = b->t_start + 1000000;
+        } else {
+            connect_failed(b, b->t_start);
+        }
+        return;
+    }
+    fcgi_conn_reset(b->fc, fd);
+    b->state = ST_CONNECTING;
+    watch(b, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+static void conn_finish(bench_conn *b)
+{
+    uint64_t now = now_ns();
+
+    if (b->failed) {
+        errors++;
+    } else {
+        completed++;
+        hist_record(&h_total, now - b->t_start);
+        hist_record(&h_connect, b->t_connected - b->t_start);
+        if (b->got_stdout) {
+            hist_record(&h_ttfb, b->t_first - b->t_sent);
+        }
+        if (b->fpm_start > 0) {
+            double q = b->fpm_start - b->wall_sent;
+            hist_record(&h_queue, q > 0 ? (uint64_t)(q * 1e9) : 0);
+            hist_record(&h_service, now - b->t_sent - (q > 0 ? (uint64_t)(q * 1e9) : 0));
+        }
+    }
+
+    b->state = ST_IDLE;
+    if (!keep_conn || b->failed) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fcgi_conn_fd(b->fc), NULL);
+        fcgi_conn_reset(b->fc, -1);
+    }
+}
+
+static void conn_event(bench_conn *b)
+{
+    int rv;
+
+    switch (b->state) {
+    case ST_CONNECTING: {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fcgi_conn_fd(b->fc), SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            fcgi_address_failed(&address);
+            started--;
+            connect_failed(b, now_ns());
+            fcgi_conn_reset(b->fc, -1);
+            b->state = ST_IDLE;
+            return;
+        }
+        b->backoff_ms = 0;
+        b->t_connected = now_ns();
+        request_start(b);
+        return;
+    }
+    case ST_SENDING:
+        request_send(b);
+        return;
+    case ST_WAITING:
+        while ((rv = fcgi_read(b->fc)) == FCGI_OK && !b->ended) {
+        }
+        if (b->ended) {
+            conn_finish(b);
+        } else if (rv != FCGI_AGAIN) {
+            errors++;
+            fcgi_conn_reset(b->fc, -1);
+            b->state = ST_IDLE;
+        }
+        return;
+    }
+}
+
+static void on_signal(int sig)
+{
+    done = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *addr = "127.0.0.1:9000";
+    int nconns = 10, duration = 10;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "a:c:d:n:kb:")) != -1) {
+        switch (opt) {
+        case 'a': addr = optarg; break;
+        case 'c': nconns = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'n': max_requests = atoll(optarg); break;
+        case 'k': keep_conn = 1; break;
+        case 'b': body = optarg; break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind >= argc) {
+usage:
+        printf("%s [-a host:port|/socket] [-c conns] [-d secs] [-n requests] [-k] [-b body] /path/to/script.php [query]\n", argv[0]);
+        return 1;
+    }
+    if (fcgi_resolve(addr, &address) < 0) {
+        perror(addr);
+        return 1;
+    }
+
+    const char *script = argv[optind];
+    const char *uri = strrchr(script, '/') ? strrchr(script, '/') : script;
+    static char content_length[32];
+    body_len = body ? strlen(body) : 0;
+    snprintf(content_length, sizeof(content_length), "%zu", body_len);
+    fcgi_param p[] = {
+        { "GATEWAY_INTERFACE", "FastCGI/1.0" },
+        { "REQUEST_METHOD", body ? "POST" : "GET" },
+        { "SCRIPT_FILENAME", script },
+        { "SCRIPT_NAME", uri },
+        { "REQUEST_URI", uri },
+        { "DOCUMENT_URI", uri },
+        { "QUERY_STRING", optind + 1 < argc ? argv[optind + 1] : "" },
+        { "CONTENT_TYPE", body ? "application/x-www-form-urlencoded" : "" },
+        { "CONTENT_LENGTH", content_length },
+        { "SERVER_SOFTWARE", "fcgi-bench" },
+        { "SERVER_PROTOCOL", "HTTP/1.1" },
+        { "REMOTE_ADDR", "127.0.0.1" },
+        { "SERVER_NAME", "localhost" },
+        { "SERVER_PORT", "80" },
+    };
+    nparams = sizeof(p) / sizeof(p[0]);
+    memcpy(params, p, sizeof(p));
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)nconns + 64) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)nconns + 64 ? rl.rlim_max : (rlim_t)nconns + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+
+    hist_init(&h_total);
+    hist_init(&h_connect);
+    hist_init(&h_ttfb);
+    hist_init(&h_queue);
+    hist_init(&h_service);
+
+    epfd = epoll_create1(0);
+    bench_conn *conns = calloc(nconns, sizeof(bench_conn));
+    for (i = 0; i < nconns; i++) {
+        conns[i].fc = fcgi_conn_new(-1, &callbacks, &conns[i]);
+        if (!conns[i].fc) {
+            perror("fcgi_conn_new");
+            return 1;
+        }
+    }
+
+    uint64_t start = now_ns(), end = start + (uint64_t)duration * 1000000000;
+    struct epoll_event events[MAX_EVENTS];
+    while (!done) {
+        int idle = 0, busy = 0;
+        for (i = 0; i < nconns; i++) {
+            if (conns[i].state == ST_IDLE) {
+                conn_start(&conns[i]);
+                idle += conns[i].state == ST_IDLE;
+            }
+            busy += conns[i].state != ST_IDLE;
+        }
+        if (!busy && max_requests && started >= max_requests) {
+            break;
+        }
+        if (!max_requests && now_ns() >= end) {
+            break;
+        }
+
+        int n = epoll_wait(epfd, events, MAX_EVENTS, idle ? 1 : 100);
+        for (i = 0; i < n; i++) {
+            conn_event(events[i].data.ptr);
+        }
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    printf("%s %s, %d connections%s\n", addr, script, nconns, keep_conn ? ", FCGI_KEEP_CONN" : "");
+    printf("%llu requests in %.2f s, %.1f requests/s, %llu errors, %llu app status != 0, %llu connect() EAGAIN (backlog full), %llu connect() failed\n",
+        completed, secs, completed / secs, errors, app_errors, backlog_full, connect_errors);
+    hist_print(stdout, "total", &h_total, 1000000.0, "ms");
+    hist_print(stdout, "connect", &h_connect, 1000000.0, "ms");
+    hist_print(stdout, "ttfb", &h_ttfb, 1000000.0, "ms");
+    if (h_queue.total) {
+        hist_print(stdout, "queue", &h_queue, 1000000.0, "ms");
+        hist_print(stdout, "service", &h_service, 1000000.0, "ms");
+    } else if (h_ttfb.total) {
+        printf("queueing estimate (ttfb - min ttfb): p50=%.2f p99=%.2f p99.9=%.2f ms\n",
+            (hist_percentile(&h_ttfb, 0.5) - h_ttfb.min) / 1e6,
+            (hist_percentile(&h_ttfb, 0.99) - h_ttfb.min) / 1e6,
+            (hist_percentile(&h_ttfb, 0.999) - h_ttfb.min) / 1e6);
+    }
+
+    for (i = 0; i < nconns; i++) {
+        fcgi_conn_free(conns[i].fc);
+    }
+    free(conns);
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fcgi_client.h"
+
+/*
+ * cgi-fcgi -bind -connect, on fcgi_client.c: run a script on php-fpm
+ * without a web server, e.g. as a health check.
+ *
+ * gcc -O2 fcgi-get.c fcgi_client.c -o fcgi-get
+ * ./fcgi-get [-a 127.0.0.1:9000|/run/php-fpm.sock] [-n requests] [-P pipeline] [-b body] [-v] /path/to/script.php [query]
+ *
+ * -n requests go over one FCGI_KEEP_CONN connection, -P of them are sent
+ * before the first answer is read, with request ids 1..P; the STDOUT of
+ * the last one is printed. -v first asks the server for FCGI_MAX_CONNS,
+ * FCGI_MAX_REQS and FCGI_MPXS_CONNS. The exit status is 0 when every request
+ * ended with FCGI_REQUEST_COMPLETE and app status 0.
+ */
+
+typedef struct {
+    int ended;
+    int failed;
+    int last_id;                /* print only the STDOUT of the last request */
+} get_state;
+
+static void on_stdout(void *ctx, int id, const char *data, size_t len)
+{
+    get_state *st = ctx;
+    if (id == st->last_id) {
+        fwrite(data, 1, len, stdout);
+    }
+}
+
+static void on_stderr(void *ctx, int id, const char *data, size_t len)
+{
+    fwrite(data, 1, len, stderr);
+}
+
+static void on_end(void *ctx, int id, uint32_t app_status, int protocol_status)
+{
+    get_state *st = ctx;
+    st->ended++;
+    if (app_status != 0 || protocol_status != FCGI_REQUEST_COMPLETE) {
+        fprintf(stderr, "request %d: app status %u, protocol status %d\n", id, app_status, protocol_status);
+        st->failed++;
+    }
+}
+
+static void on_value(void *ctx, const char *name, size_t nlen, const char *value, size_t vlen)
+{
+    fprintf(stderr, "%.*s = %.*s\n", (int)nlen, name, (int)vlen, value);
+}
+
+static const fcgi_callbacks callbacks = { on_stdout, on_stderr, on_end, on_value };
+
+int main(int argc, char *argv[])
+{
+    const char *address = "127.0.0.1:9000", *body = NULL;
+    int requests = 1, pipeline = 1, values = 0;
+    int opt, rv;
+
+    while ((opt = getopt(argc, argv, "a:n:P:b:v")) != -1) {
+        switch (opt) {
+        case 'a': address = optarg; break;
+        case 'n': requests = atoi(optarg); break;
+        case 'P': pipeline = atoi(optarg); break;
+        case 'b': body = optarg; break;
+        case 'v': values = 1; break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind >= argc) {
+usage:
+        printf("%s [-a host:port|/socket] [-n requests] [-P pipeline] [-b body] [-v] /path/to/script.php [query]\n", argv[0]);
+        return 1;
+    }
+    if (pipeline < 1) {
+        pipeline = 1;
+    }
+
+    const char *script = argv[optind];
+    const char *uri = strrchr(script, '/') ? strrchr(script, '/') : script;
+    char content_length[32];
+    snprintf(content_length, sizeof(content_length), "%zu", body ? strlen(body) : 0);
+    fcgi_param params[] = {
+        { "GATEWAY_INTERFACE", "FastCGI/1.0" },
+        { "REQUEST_METHOD", body ? "POST" : "GET" },
+        { "SCRIPT_FILENAME", script },
+        { "SCRIPT_NAME", uri },
+        { "REQUEST_URI", uri },
+        { "DOCUMENT_URI", uri },
+        { "QUERY_STRING", optind + 1 < argc ? argv[optind + 1] : "" },
+        { "CONTENT_TYPE", body ? "application/x-www-form-urlencoded" : "" },
+        { "CONTENT_LENGTH", content_length },
+        { "SERVER_SOFTWARE", "fcgi-get" },
+        { "SERVER_PROTOCOL", "HTTP/1.1" },
+        { "REMOTE_ADDR", "127.0.0.1" },
+        { "SERVER_ADDR", "127.0.0.1" },
+        { "SERVER_PORT", "80" },
+        { "SERVER_NAME", "localhost" },
+    };
+    int nparams = sizeof(params) / sizeof(params[0]);
+
+    int fd = fcgi_connect(address);
+    if (fd < 0) {
+        perror(address);
+        return 2;
+    }
+    get_state st = { 0, 0, -1 };
+    fcgi_conn *c = fcgi_conn_new(fd, &callbacks, &st);
+    if (!c) {
+        perror("fcgi_conn_new");
+        return 2;
+    }
+
+    if (values) {
+        fcgi_send_get_values(c);
+    }
+
+    int sent = 0;
+    while (st.ended < requests) {
+        /* keep -P requests in flight, each new batch goes out with one writev() */
+        while (sent < requests && sent - st.ended < pipeline) {
+            fcgi_send_request(c, sent % pipeline + 1, params, nparams, body, body ? strlen(body) : 0, 1);
+            sent++;
+        }
+        if (sent == requests) {
+            st.last_id = (requests - 1) % pipeline + 1;
+        }
+        if (fcgi_flush(c) != FCGI_OK) {
+            perror("write");
+            return 2;
+        }
+        rv = fcgi_read(c);
+        if (rv == FCGI_EOF || rv == FCGI_ERROR) {
+            fprintf(stderr, "connection %s after %d responses\n", rv == FCGI_EOF ? "closed" : "failed", st.ended);
+            return 2;
+        }
+    }
+
+    fcgi_conn_free(c);
+    return st.failed ? 1 : 0;
+}
@@ -0,0 +1,554 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fcgi_client.h"
+
+#define BODY_CHUNK      (FCGI_MAX_CONTENT & ~7)     /* full STDIN records need no padding */
+#define FLUSH_IOV       256
+
+typedef struct {
+    const char *ext;            /* caller's memory, or NULL for out + off */
+    size_t off;
+    size_t len;
+} fcgi_seg;
+
+struct _fcgi_conn {
+    int fd;
+    const fcgi_callbacks *cb;
+    void *ctx;
+
+    char *out;                  /* record headers and params */
+    size_t out_len;
+    size_t out_cap;
+    fcgi_seg *segs;
+    int nsegs;
+    int segs_cap;
+    int seg_pos;                /* flush progress */
+    size_t seg_off;
+    size_t pending;
+
+    char *scratch;              /* name-value pairs before they are cut into records */
+    size_t scratch_cap;
+
+    char *ring;                 /* FCGI_RING_SIZE, mapped twice */
+    uint64_t head;
+    uint64_t tail;
+};
+
+int fcgi_resolve(const char *address, fcgi_address *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+
+    if (strncmp(address, "unix:", 5) == 0 || address[0] == '/') {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&addr->a[0].sa;
+        const char *path = address[0] == '/' ? address : address + 5;
+
+        if (strlen(path) >= sizeof(sun->sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, path);
+        addr->a[0].len = sizeof(*sun);
+        addr->n = 1;
+        return 0;
+    }
+
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    struct addrinfo hints, *res, *ai;
+
+    if (!colon || (size_t)(colon - address) >= sizeof(host)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host[0] ? host : "127.0.0.1", colon + 1, &hints, &res) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    for (ai = res; ai && addr->n < FCGI_MAX_ADDRS; ai = ai->ai_next) {
+        memcpy(&addr->a[addr->n].sa, ai->ai_addr, ai->ai_addrlen);
+        addr->a[addr->n].len = ai->ai_addrlen;
+        addr->n++;
+    }
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int connect_one(const struct sockaddr_storage *sa, socklen_t len, int nonblock)
+{
+    int one = 1;
+    int fd = socket(sa->ss_family, SOCK_STREAM | SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0), 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr *)sa, len) < 0 && !(nonblock && errno == EINPROGRESS)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (sa->ss_family != AF_UNIX) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+int fcgi_connect_addr(fcgi_address *addr, int nonblock)
+{
+    int i, k, fd = -1;
+
+    errno = EHOSTUNREACH;
+    for (k = 0; k < addr->n; k++) {
+        i = (addr->cur + k) % addr->n;
+        fd = connect_one(&addr->a[i].sa, addr->a[i].len, nonblock);
+        if (fd >= 0) {
+            addr->cur = i;
+            break;
+        }
+        /* a full backlog is not this address' fault */
+        if (errno == EAGAIN) {
+            break;
+        }
+    }
+    return fd;
+}
+
+void fcgi_address_failed(fcgi_address *addr)
+{
+    if (addr->n > 1) {
+        addr->cur = (addr->cur + 1) % addr->n;
+    }
+}
+
+int fcgi_connect(const char *address)
+{
+    fcgi_address addr;
+
+    if (fcgi_resolve(address, &addr) < 0) {
+        return -1;
+    }
+    return fcgi_connect_addr(&addr, 0);
+}
+
+/* the same pages at ring and ring + FCGI_RING_SIZE */
+static char *ring_map(void)
+{
+    int fd = memfd_create("fcgi_ring", MFD_CLOEXEC);
+    char *base;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, FCGI_RING_SIZE) < 0
+        || (base = mmap(NULL, 2 * FCGI_RING_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (mmap(base, FCGI_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(base + FCGI_RING_SIZE, FCGI_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * FCGI_RING_SIZE);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    return base;
+}
+
+fcgi_conn *fcgi_conn_new(int fd, const fcgi_callbacks *cb, void *ctx)
+{
+    fcgi_conn *c = calloc(1, sizeof(fcgi_conn));
+
+    if (!c) {
+        return NULL;
+    }
+    c->ring = ring_map();
+    if (!c->ring) {
+        free(c);
+        return NULL;
+    }
+    c->fd = fd;
+    c->cb = cb;
+    c->ctx = ctx;
+    return c;
+}
+
+void fcgi_conn_free(fcgi_conn *c)
+{
+    if (!c) {
+        return;
+    }
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    munmap(c->ring, 2 * FCGI_RING_SIZE);
+    free(c->out);
+    free(c->segs);
+    free(c->scratch);
+    free(c);
+}
+
+void fcgi_conn_reset(fcgi_conn *c, int fd)
+{
+    if (c->fd >= 0 && c->fd != fd) {
+        close(c->fd);
+    }
+    c->fd = fd;
+    c->out_len = c->pending = 0;
+    c->nsegs = c->seg_pos = 0;
+    c->seg_off = 0;
+    c->head = c->tail = 0;
+}
+
+int fcgi_conn_fd(fcgi_conn *c)
+{
+    return c->fd;
+}
+
+size_t fcgi_pending(fcgi_conn *c)
+{
+    return c->pending;
+}
+
+static int grow(void **p, size_t *cap, size_t need, size_t elem)
+{
+    size_t n = *cap ? *cap : 16;
+    void *np;
+
+    if (need <= *cap) {
+        return 0;
+    }
+    while (n < need) {
+        n *= 2;
+    }
+    np = realloc(*p, n * elem);
+    if (!np) {
+        return -1;
+    }
+    *p = np;
+    *cap = n;
+    return 0;
+}
+
+static int add_seg(fcgi_conn *c, const char *ext, size_t off, size_t len)
+{
+    fcgi_seg *last = c->nsegs ? &c->segs[c->nsegs - 1] : NULL;
+    size_t cap = c->segs_cap;
+
+    if (len == 0) {
+        return 0;
+    }
+    c->pending += len;
+    /* consecutive bytes of out are one iovec */
+    if (!ext && last && !last->ext && last->off + last->len == off) {
+        last->len += len;
+        return 0;
+    }
+    if (grow((void **)&c->segs, &cap, c->nsegs + 1, sizeof(fcgi_seg)) < 0) {
+        return -1;
+    }
+    c->segs_cap = cap;
+    c->segs[c->nsegs].ext = ext;
+    c->segs[c->nsegs].off = off;
+    c->segs[c->nsegs].len = len;
+    c->nsegs++;
+    return 0;
+}
+
+/* append to out and to the iovec list */
+static int out_put(fcgi_conn *c, const void *data, size_t len)
+{
+    if (grow((void **)&c->out, &c->out_cap, c->out_len + len, 1) < 0) {
+        return -1;
+    }
+    if (data) {
+        memcpy(c->out + c->out_len, data, len);
+    } else {
+        memset(c->out + c->out_len, 0, len);
+    }
+    c->out_len += len;
+    return add_seg(c, NULL, c->out_len - len, len);
+}
+
+static int put_header(fcgi_conn *c, int type, int id, size_t clen, int plen)
+{
+    fcgi_header h;
+
+    h.version = FCGI_VERSION_1;
+    h.type = type;
+    h.requestIdB1 = (id >> 8) & 0xff;
+    h.requestIdB0 = id & 0xff;
+    h.contentLengthB1 = (clen >> 8) & 0xff;
+    h.contentLengthB0 = clen & 0xff;
+    h.paddingLength = plen;
+    h.reserved = 0;
+    return out_put(c, &h, sizeof(h));
+}
+
+/* a whole stream (PARAMS, STDIN, GET_VALUES) as records plus the empty one */
+static int put_stream(fcgi_conn *c, int type, int id, const char *data, size_t len, int external, int terminate)
+{
+    size_t off = 0;
+
+    while (off < len) {
+        size_t n = len - off < BODY_CHUNK ? len - off : BODY_CHUNK;
+        int pad = (8 - n % 8) % 8;
+
+        if (put_header(c, type, id, n, pad) < 0
+            || (external ? add_seg(c, data + off, 0, n) : out_put(c, data + off, n)) < 0
+            || out_put(c, NULL, pad) < 0) {
+            return -1;
+        }
+        off += n;
+    }
+    return terminate ? put_header(c, type, id, 0, 0) : 0;
+}
+
+static size_t nv_len_size(size_t len)
+{
+    return len < 128 ? 1 : 4;
+}
+
+static char *nv_put_len(char *p, size_t len)
+{
+    if (len < 128) {
+        *p++ = len;
+    } else {
+        *p++ = ((len >> 24) & 0x7f) | 0x80;
+        *p++ = (len >> 16) & 0xff;
+        *p++ = (len >> 8) & 0xff;
+        *p++ = len & 0xff;
+    }
+    return p;
+}
+
+/* name-value pairs into scratch, the encoded length or -1 */
+static long nv_encode(fcgi_conn *c, const fcgi_param *params, int nparams)
+{
+    size_t total = 0;
+    char *p;
+    int i;
+
+    for (i = 0; i < nparams; i++) {
+        size_t nl = strlen(params[i].name), vl = params[i].value ? strlen(params[i].value) : 0;
+        total += nv_len_size(nl) + nv_len_size(vl) + nl + vl;
+    }
+    if (grow((void **)&c->scratch, &c->scratch_cap, total ? total : 1, 1) < 0) {
+        return -1;
+    }
+
+    p = c->scratch;
+    for (i = 0; i < nparams; i++) {
+        size_t nl = strlen(params[i].name), vl = params[i].value ? strlen(params[i].value) : 0;
+        p = nv_put_len(p, nl);
+        p = nv_put_len(p, vl);
+        memcpy(p, params[i].name, nl);
+        p += nl;
+        if (vl) {
+            memcpy(p, params[i].value, vl);
+            p += vl;
+        }
+    }
+    return total;
+}
+
+int fcgi_send_request(fcgi_conn *c, int id, const fcgi_param *params, int nparams,
+    const void *body, size_t body_len, int keep_conn)
+{
+    fcgi_begin_request b;
+    long plen;
+
+    memset(&b, 0, sizeof(b));
+    b.roleB0 = FCGI_RESPONDER;
+    b.flags = keep_conn ? FCGI_KEEP_CONN : 0;
+
+    if ((plen = nv_encode(c, params, nparams)) < 0
+        || put_header(c, FCGI_BEGIN_REQUEST, id, sizeof(b), 0) < 0
+        || out_put(c, &b, sizeof(b)) < 0
+        || put_stream(c, FCGI_PARAMS, id, c->scratch, plen, 0, 1) < 0
+        || put_stream(c, FCGI_STDIN, id, body, body_len, 1, 1) < 0) {
+        return FCGI_ERROR;
+    }
+    return FCGI_OK;
+}
+
+int fcgi_send_abort(fcgi_conn *c, int id)
+{
+    return put_header(c, FCGI_ABORT_REQUEST, id, 0, 0) < 0 ? FCGI_ERROR : FCGI_OK;
+}
+
+int fcgi_send_get_values(fcgi_conn *c)
+{
+    static const fcgi_param names[] = {
+        { "FCGI_MAX_CONNS", NULL }, { "FCGI_MAX_REQS", NULL }, { "FCGI_MPXS_CONNS", NULL }
+    };
+    long len = nv_encode(c, names, 3);
+
+    if (len < 0 || put_stream(c, FCGI_GET_VALUES, 0, c->scratch, len, 0, 0) < 0) {
+        return FCGI_ERROR;
+    }
+    return FCGI_OK;
+}
+
+int fcgi_flush(fcgi_conn *c)
+{
+    struct iovec iov[FLUSH_IOV];
+
+    while (c->seg_pos < c->nsegs) {
+        int i, n = 0;
+        ssize_t w;
+
+        for (i = c->seg_pos; i < c->nsegs && n < FLUSH_IOV; i++, n++) {
+            fcgi_seg *s = &c->segs[i];
+            size_t skip = i == c->seg_pos ? c->seg_off : 0;
+            iov[n].iov_base = (char *)(s->ext ? s->ext : c->out + s->off) + skip;
+            iov[n].iov_len = s->len - skip;
+        }
+
+        w = writev(c->fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? FCGI_AGAIN : FCGI_ERROR;
+        }
+
+        c->pending -= w;
+        while (w > 0) {
+            size_t left = c->segs[c->seg_pos].len - c->seg_off;
+            if ((size_t)w < left) {
+                c->seg_off += w;
+                break;
+            }
+            w -= left;
+            c->seg_pos++;
+            c->seg_off = 0;
+        }
+    }
+
+    c->out_len = 0;
+    c->nsegs = c->seg_pos = 0;
+    c->seg_off = 0;
+    return FCGI_OK;
+}
+
+static size_t nv_get_len(const unsigned char **p, const unsigned char *end, int *ok)
+{
+    const unsigned char *q = *p;
+
+    if (q >= end || ((*q & 0x80) && end - q < 4)) {
+        *ok = 0;
+        return 0;
+    }
+    if (!(*q & 0x80)) {
+        *p = q + 1;
+        return *q;
+    }
+    *p = q + 4;
+    return ((size_t)(q[0] & 0x7f) << 24) | (q[1] << 16) | (q[2] << 8) | q[3];
+}
+
+static void parse_values(fcgi_conn *c, const unsigned char *p, size_t len)
+{
+    const unsigned char *end = p + len;
+
+    while (p < end && c->cb->on_value) {
+        int ok = 1;
+        size_t nl = nv_get_len(&p, end, &ok);
+        size_t vl = nv_get_len(&p, end, &ok);
+        if (!ok || (size_t)(end - p) < nl + vl) {
+            return;
+        }
+        c->cb->on_value(c->ctx, (const char *)p, nl, (const char *)p + nl, vl);
+        p += nl + vl;
+    }
+}
+
+static int dispatch(fcgi_conn *c, const fcgi_header *h, const char *content, size_t clen)
+{
+    int id = (h->requestIdB1 << 8) | h->requestIdB0;
+
+    switch (h->type) {
+    case FCGI_STDOUT:
+        if (c->cb->on_stdout) {
+            c->cb->on_stdout(c->ctx, id, content, clen);
+        }
+        break;
+    case FCGI_STDERR:
+        if (c->cb->on_stderr) {
+            c->cb->on_stderr(c->ctx, id, content, clen);
+        }
+        break;
+    case FCGI_END_REQUEST: {
+        const fcgi_end_request *e = (const fcgi_end_request *)content;
+        if (clen < sizeof(*e)) {
+            return FCGI_ERROR;
+        }
+        if (c->cb->on_end) {
+            c->cb->on_end(c->ctx, id,
+                ((uint32_t)e->appStatusB3 << 24) | (e->appStatusB2 << 16) | (e->appStatusB1 << 8) | e->appStatusB0,
+                e->protocolStatus);
+        }
+        break;
+    }
+    case FCGI_GET_VALUES_RESULT:
+        parse_values(c, (const unsigned char *)content, clen);
+        break;
+    default:
+        /* FCGI_UNKNOWN_TYPE and whatever a newer server sends */
+        break;
+    }
+    return FCGI_OK;
+}
+
+int fcgi_read(fcgi_conn *c)
+{
+    size_t used = c->tail - c->head;
+    ssize_t n;
+
+    /* parsing leaves less than a record behind, so there is always room */
+    do {
+        n = read(c->fd, c->ring + c->tail % FCGI_RING_SIZE, FCGI_RING_SIZE - used);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return errno == EAGAIN ? FCGI_AGAIN : FCGI_ERROR;
+    }
+    if (n == 0) {
+        return FCGI_EOF;
+    }
+    c->tail += n;
+
+    while (c->tail - c->head >= sizeof(fcgi_header)) {
+        const fcgi_header *h = (const fcgi_header *)(c->ring + c->head % FCGI_RING_SIZE);
+        size_t clen = (h->contentLengthB1 << 8) | h->contentLengthB0;
+        size_t total = sizeof(fcgi_header) + clen + h->paddingLength;
+
+        if (h->version != FCGI_VERSION_1) {
+            return FCGI_ERROR;
+        }
+        if (c->tail - c->head < total) {
+            break;
+        }
+        if (dispatch(c, h, (const char *)(h + 1), clen) < 0) {
+            return FCGI_ERROR;
+        }
+        c->head += total;
+    }
+    return FCGI_OK;
+}
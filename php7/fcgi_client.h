@@ -0,0 +1,148 @@
+#ifndef FCGI_CLIENT_H
+#define FCGI_CLIENT_H
+
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * FastCGI client side, @see http://www.mit.edu/~yandros/doc/specs/fcgi-spec.html
+ *
+ * A request is BEGIN_REQUEST, PARAMS records, an empty PARAMS, STDIN records
+ * and an empty STDIN. fcgi_send_request() encodes the records into the
+ * connection's output and fcgi_flush() writes all queued requests with
+ * writev(): the request body is not copied, so it has to stay valid until
+ * the flush is done. Requests can be queued back to back (pipelining) and
+ * with different ids on one connection (multiplexing, only if the server
+ * says FCGI_MPXS_CONNS=1; php-fpm does not and serves a connection's
+ * requests one after the other, with FCGI_KEEP_CONN it keeps it open).
+ *
+ * Input goes into a ring buffer mapped twice back to back, so a record is
+ * always contiguous in memory: fcgi_read() hands STDOUT/STDERR content to
+ * the callbacks as a pointer into the ring, valid during the call only.
+ *
+ * Works on blocking and non-blocking sockets: fcgi_flush() and fcgi_read()
+ * return FCGI_AGAIN on EAGAIN. The callbacks may queue requests but must
+ * not free or reset the connection.
+ */
+
+#define FCGI_VERSION_1          1
+
+#define FCGI_BEGIN_REQUEST      1
+#define FCGI_ABORT_REQUEST      2
+#define FCGI_END_REQUEST        3
+#define FCGI_PARAMS             4
+#define FCGI_STDIN              5
+#define FCGI_STDOUT             6
+#define FCGI_STDERR             7
+#define FCGI_DATA               8
+#define FCGI_GET_VALUES         9
+#define FCGI_GET_VALUES_RESULT  10
+#define FCGI_UNKNOWN_TYPE       11
+
+#define FCGI_RESPONDER          1
+#define FCGI_KEEP_CONN          1
+
+#define FCGI_REQUEST_COMPLETE   0
+#define FCGI_CANT_MPX_CONN      1
+#define FCGI_OVERLOADED         2
+#define FCGI_UNKNOWN_ROLE       3
+
+#define FCGI_MAX_CONTENT        65535
+#define FCGI_RING_SIZE          (128 * 1024)    /* > a full record, 8 + 65535 + 255 */
+
+#define FCGI_OK                 0
+#define FCGI_AGAIN              1
+#define FCGI_ERROR              -1
+#define FCGI_EOF                -2
+
+typedef struct _fcgi_header {
+    unsigned char version;
+    unsigned char type;
+    unsigned char requestIdB1;
+    unsigned char requestIdB0;
+    unsigned char contentLengthB1;
+    unsigned char contentLengthB0;
+    unsigned char paddingLength;
+    unsigned char reserved;
+} fcgi_header;
+
+typedef struct _fcgi_begin_request {
+    unsigned char roleB1;
+    unsigned char roleB0;
+    unsigned char flags;
+    unsigned char reserved[5];
+} fcgi_begin_request;
+
+typedef struct _fcgi_end_request {
+    unsigned char appStatusB3;
+    unsigned char appStatusB2;
+    unsigned char appStatusB1;
+    unsigned char appStatusB0;
+    unsigned char protocolStatus;
+    unsigned char reserved[3];
+} fcgi_end_request;
+
+typedef struct {
+    const char *name;
+    const char *value;
+} fcgi_param;
+
+typedef struct {
+    /* STDOUT/STDERR content, len 0 for the empty record that ends the stream */
+    void (*on_stdout)(void *ctx, int id, const char *data, size_t len);
+    void (*on_stderr)(void *ctx, int id, const char *data, size_t len);
+    void (*on_end)(void *ctx, int id, uint32_t app_status, int protocol_status);
+    /* one call per name-value pair of a GET_VALUES_RESULT */
+    void (*on_value)(void *ctx, const char *name, size_t nlen, const char *value, size_t vlen);
+} fcgi_callbacks;
+
+typedef struct _fcgi_conn fcgi_conn;
+
+#define FCGI_MAX_ADDRS          8
+
+/* every address the name resolved to, in getaddrinfo() order */
+typedef struct {
+    struct {
+        struct sockaddr_storage sa;
+        socklen_t len;
+    } a[FCGI_MAX_ADDRS];
+    int n;
+    int cur;                    /* tried first, the last one that connected */
+} fcgi_address;
+
+/* "host:port", "/path/to/socket" or "unix:/path"; a connected socket or -1 */
+int fcgi_connect(const char *address);
+int fcgi_resolve(const char *address, fcgi_address *addr);
+/*
+ * Tries the addresses from addr->cur on, the first that connects becomes
+ * cur. nonblock: the connect may still be in progress (TCP), only the
+ * addresses that fail at once are skipped; if it fails later (SO_ERROR),
+ * fcgi_address_failed() moves cur on for the next try. A full UNIX socket
+ * backlog fails right away with EAGAIN, like nginx's "Resource temporarily
+ * unavailable"
+ */
+int fcgi_connect_addr(fcgi_address *addr, int nonblock);
+void fcgi_address_failed(fcgi_address *addr);
+
+fcgi_conn *fcgi_conn_new(int fd, const fcgi_callbacks *cb, void *ctx);
+/* closes the socket too */
+void fcgi_conn_free(fcgi_conn *c);
+/* close the socket, forget queued output and input, go on with fd (may be -1) */
+void fcgi_conn_reset(fcgi_conn *c, int fd);
+int fcgi_conn_fd(fcgi_conn *c);
+
+/* bytes queued and not written yet */
+size_t fcgi_pending(fcgi_conn *c);
+
+int fcgi_send_request(fcgi_conn *c, int id, const fcgi_param *params, int nparams,
+    const void *body, size_t body_len, int keep_conn);
+int fcgi_send_abort(fcgi_conn *c, int id);
+/* asks for FCGI_MAX_CONNS, FCGI_MAX_REQS and FCGI_MPXS_CONNS, answered via on_value */
+int fcgi_send_get_values(fcgi_conn *c);
+
+int fcgi_flush(fcgi_conn *c);
+/* one read() and the callbacks of every complete record it finished */
+int fcgi_read(fcgi_conn *c);
+
+#endif
@@ -4,17 +4,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
-
-typedef struct _fcgi_header {
-    unsigned char version;
-    unsigned char type;
-    unsigned char requestIdB1;
-    unsigned char requestIdB0;
-    unsigned char contentLengthB1;
-    unsigned char contentLengthB0;
-    unsigned char paddingLength;
-    unsigned char reserved;
-} fcgi_header;
+#include "fcgi_client.h"
 
 int main(void)
 {
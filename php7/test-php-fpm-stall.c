@@ -0,0 +1,572 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fcgi_client.h"
+#include "../httpd/histogram.h"
+
+/*
+ * What stalled and malformed FastCGI input costs php-fpm, the general case
+ * of test-php-fpm-safe-read.c: after accept() a child waits for the first
+ * byte (poll(), 5 s), then safe_read() waits for whole records as long as
+ * it takes, and the child serves nobody else meanwhile.
+ *
+ * Patterns (-m), each on -c connections at once:
+ *
+ *   split        the request cut at every byte boundary, -s ms between the
+ *                two halves; every cut has to get an END_REQUEST
+ *   trickle      the whole request, -b bytes every -i ms (slowloris)
+ *   idle         connect and send nothing
+ *   half-header  4 bytes of the BEGIN_REQUEST header
+ *   big-content  a PARAMS header with contentLength 65535, 100 bytes of it
+ *   big-padding  a PARAMS record with paddingLength 255, padding not sent
+ *   nv-length    a PARAMS name length of 0x7fffffff, the request complete
+ *   body-stall   a POST whose STDIN never comes, CONTENT_LENGTH -B
+ *
+ * A connection ends with END_REQUEST (end), the server closing or resetting
+ * it (closed), or is given up after -t seconds (held). held is how long the
+ * server kept it: the worker occupancy per connection. Meanwhile one probe
+ * connection after the other sends the plain request, its latency shows
+ * whether the pool still serves anybody (starved: the last probe was not
+ * answered after a second).
+ *
+ * With -P <php-fpm master pid> the pool is sampled every 100 ms from /proc:
+ * children in read()/poll() (waiting for a client) at most and in
+ * worker-seconds, and the RSS of master plus children before, at the peak
+ * and after. /proc/<pid>/syscall needs the pool's user or root.
+ *
+ * gcc -O2 test-php-fpm-stall.c fcgi_client.c -o test-php-fpm-stall
+ * ./test-php-fpm-stall [-a 127.0.0.1:9000|/run/php-fpm.sock] [-m split,trickle,...] [-c conns] [-t secs] [-s ms] [-i ms] [-b bytes] [-B bytes] [-P pid] /path/to/script.php
+ */
+
+#define MAX_REQUEST     8192
+#define SAMPLE_MS       100
+
+enum { R_RUNNING, R_END, R_CLOSED, R_HELD, R_REFUSED, R_COUNT };
+
+static const char *outcome_names[R_COUNT] = { "running", "end", "closed", "held", "refused" };
+
+typedef struct {
+    const char *data;
+    size_t len;                 /* bytes to send, a request or a piece of one */
+    size_t split;               /* stop once after this many bytes */
+    size_t chunk;               /* or send this many every delay */
+    int delay_ms;
+} plan_t;
+
+typedef struct {
+    const plan_t *plan;
+    fcgi_conn *fc;
+    int connecting;
+    size_t sent;
+    uint64_t t_start;
+    uint64_t t_end;
+    uint64_t next_at;           /* 0: nothing more to send */
+    int outcome;
+} stall_conn;
+
+typedef struct {
+    unsigned long long outcomes[R_COUNT];
+    histogram_t held;
+    histogram_t probe;
+    unsigned long long starved;
+    int waiting_max;
+    double waiting_s;
+    long rss_before, rss_peak, rss_after;
+} result_t;
+
+static fcgi_address address;
+static int hold_secs = 10;
+static pid_t master_pid;
+static plan_t probe_plan;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void on_end(void *ctx, int id, uint32_t app_status, int protocol_status)
+{
+    stall_conn *s = ctx;
+    s->outcome = R_END;
+}
+
+static const fcgi_callbacks callbacks = { NULL, NULL, on_end, NULL };
+
+/* the bytes fcgi_client would send, through a socketpair */
+static size_t encode_request(const fcgi_param *params, int nparams, const char *body, char *buf)
+{
+    int sv[2];
+    size_t len = 0;
+    ssize_t n;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        return 0;
+    }
+    fcgi_conn *c = fcgi_conn_new(sv[0], &callbacks, NULL);
+    fcgi_send_request(c, 1, params, nparams, body, body ? strlen(body) : 0, 0);
+    fcgi_flush(c);
+    fcgi_conn_free(c);
+    while ((n = read(sv[1], buf + len, MAX_REQUEST - len)) > 0) {
+        len += n;
+    }
+    close(sv[1]);
+    return len;
+}
+
+static size_t put_record(char *p, int type, size_t clen, int plen)
+{
+    fcgi_header *h = (fcgi_header *)p;
+
+    memset(h, 0, sizeof(*h));
+    h->version = FCGI_VERSION_1;
+    h->type = type;
+    h->requestIdB0 = 1;
+    h->contentLengthB1 = (clen >> 8) & 0xff;
+    h->contentLengthB0 = clen & 0xff;
+    h->paddingLength = plen;
+    return sizeof(*h);
+}
+
+/* RSS of master and children in KB, children waiting for a client */
+static long pool_sample(int *waiting)
+{
+    char path[64], buf[512];
+    long rss = 0;
+    DIR *d;
+    struct dirent *e;
+
+    *waiting = 0;
+    if (!master_pid || !(d = opendir("/proc"))) {
+        return 0;
+    }
+    while ((e = readdir(d))) {
+        pid_t pid = atoi(e->d_name), ppid = 0;
+        FILE *f;
+        char *p;
+
+        if (pid <= 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        if (!(f = fopen(path, "r"))) {
+            continue;
+        }
+        if (fgets(buf, sizeof(buf), f) && (p = strrchr(buf, ')'))) {
+            sscanf(p + 2, "%*c %d", &ppid);
+        }
+        fclose(f);
+        if (pid != master_pid && ppid != master_pid) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/proc/%d/status", pid);
+        if ((f = fopen(path, "r"))) {
+            while (fgets(buf, sizeof(buf), f)) {
+                if (strncmp(buf, "VmRSS:", 6) == 0) {
+                    rss += atol(buf + 6);
+                }
+            }
+            fclose(f);
+        }
+
+        if (pid == master_pid) {
+            continue;
+        }
+        /* idle children are in accept(), busy ones run or sleep elsewhere */
+        snprintf(path, sizeof(path), "/proc/%d/syscall", pid);
+        if ((f = fopen(path, "r"))) {
+            long nr = -1;
+            if (fscanf(f, "%ld", &nr) == 1
+                && (nr == SYS_read || nr == SYS_readv || nr == SYS_recvfrom || nr == SYS_poll || nr == SYS_ppoll)) {
+                (*waiting)++;
+            }
+            fclose(f);
+        }
+    }
+    closedir(d);
+    return rss;
+}
+
+static void conn_open(stall_conn *s, const plan_t *plan)
+{
+    int fd;
+
+    memset(s, 0, sizeof(*s));
+    s->plan = plan;
+    s->t_start = s->next_at = now_ns();
+    if ((fd = fcgi_connect_addr(&address, 1)) < 0) {
+        s->outcome = R_REFUSED;
+        return;
+    }
+    s->fc = fcgi_conn_new(fd, &callbacks, s);
+    s->connecting = 1;
+}
+
+static void conn_close(stall_conn *s, int outcome)
+{
+    if (s->outcome == R_RUNNING) {
+        s->outcome = outcome;
+    }
+    s->t_end = now_ns();
+    fcgi_conn_free(s->fc);
+    s->fc = NULL;
+}
+
+static void conn_send(stall_conn *s, uint64_t now)
+{
+    const plan_t *p = s->plan;
+    size_t n = p->len - s->sent;
+    ssize_t w;
+
+    if (p->chunk && n > p->chunk) {
+        n = p->chunk;
+    } else if (p->split && s->sent < p->split) {
+        n = p->split - s->sent;
+    }
+    w = n ? write(fcgi_conn_fd(s->fc), p->data + s->sent, n) : 0;
+    if (w < 0) {
+        if (errno != EAGAIN) {
+            conn_close(s, R_CLOSED);
+        }
+        return;
+    }
+    s->sent += w;
+    if (s->sent == p->len) {
+        s->next_at = 0;
+    } else if ((size_t)w == n) {
+        s->next_at = now + (uint64_t)p->delay_ms * 1000000;
+    }
+}
+
+static void conn_input(stall_conn *s)
+{
+    int rv;
+
+    while ((rv = fcgi_read(s->fc)) == FCGI_OK && s->outcome == R_RUNNING) {
+    }
+    if (s->outcome == R_END || rv == FCGI_EOF || rv == FCGI_ERROR) {
+        conn_close(s, R_CLOSED);
+    }
+}
+
+/* run the plans on as many connections at once, probing the pool meanwhile */
+static void run(const plan_t *plans, int n, stall_conn *conns, result_t *r)
+{
+    struct pollfd *pfds = calloc(n + 1, sizeof(struct pollfd));
+    int *which = calloc(n + 1, sizeof(int));
+    stall_conn probe;
+    uint64_t probe_next = 0, next_sample = 0;
+    int i, left = n, waiting;
+
+    for (i = 0; i < n; i++) {
+        conn_open(&conns[i], &plans[i]);
+        if (conns[i].outcome != R_RUNNING) {
+            left--;
+        }
+    }
+    memset(&probe, 0, sizeof(probe));
+
+    while (left > 0) {
+        uint64_t now = now_ns(), wake = now + SAMPLE_MS * 1000000ULL;
+        int np = 0;
+
+        if (now >= next_sample) {
+            long rss = pool_sample(&waiting);
+            if (rss > r->rss_peak) {
+                r->rss_peak = rss;
+            }
+            if (waiting > r->waiting_max) {
+                r->waiting_max = waiting;
+            }
+            r->waiting_s += waiting * SAMPLE_MS / 1000.0;
+            next_sample = now + SAMPLE_MS * 1000000ULL;
+        }
+
+        if (!probe.fc && now >= probe_next) {
+            conn_open(&probe, &probe_plan);
+        }
+
+        for (i = 0; i <= n; i++) {
+            stall_conn *s = i < n ? &conns[i] : &probe;
+            short events = POLLIN;
+
+            if (!s->fc) {
+                continue;
+            }
+            if (i < n && now - s->t_start >= (uint64_t)hold_secs * 1000000000) {
+                conn_close(s, R_HELD);
+                continue;
+            }
+            if (s->connecting || (s->next_at && s->next_at <= now)) {
+                events |= POLLOUT;
+            } else if (s->next_at && s->next_at < wake) {
+                wake = s->next_at;
+            }
+            pfds[np].fd = fcgi_conn_fd(s->fc);
+            pfds[np].events = events;
+            which[np++] = i;
+        }
+
+        poll(pfds, np, (wake - now) / 1000000 + 1);
+        now = now_ns();
+
+        for (i = 0; i < np; i++) {
+            stall_conn *s = which[i] < n ? &conns[which[i]] : &probe;
+            if (!pfds[i].revents) {
+                continue;
+            }
+            if (s->connecting && (pfds[i].revents & (POLLOUT | POLLERR | POLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                s->connecting = 0;
+                if (err) {
+                    fcgi_address_failed(&address);
+                    conn_close(s, R_REFUSED);
+                    continue;
+                }
+            }
+            if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                conn_input(s);
+            }
+            if (s->fc && !s->connecting && s->next_at && s->next_at <= now) {
+                conn_send(s, now);
+            }
+        }
+
+        if (probe.outcome != R_RUNNING) {
+            if (probe.outcome == R_END) {
+                hist_record(&r->probe, now - probe.t_start);
+            }
+            probe.outcome = R_RUNNING;
+            probe_next = now + 10000000;
+        }
+
+        left = 0;
+        for (i = 0; i < n; i++) {
+            left += conns[i].fc != NULL;
+        }
+    }
+
+    if (probe.fc) {
+        if (now_ns() - probe.t_start > 1000000000) {
+            r->starved++;
+        }
+        conn_close(&probe, R_HELD);
+    }
+    for (i = 0; i < n; i++) {
+        r->outcomes[conns[i].outcome]++;
+        if (conns[i].outcome != R_REFUSED) {
+            hist_record(&r->held, conns[i].t_end - conns[i].t_start);
+        }
+    }
+    free(pfds);
+    free(which);
+}
+
+static void result_init(result_t *r)
+{
+    int waiting;
+
+    memset(r, 0, sizeof(*r));
+    hist_init(&r->held);
+    hist_init(&r->probe);
+    r->rss_before = pool_sample(&waiting);
+}
+
+static void result_print(const char *name, int nconns, result_t *r)
+{
+    int waiting;
+
+    usleep(200000);
+    r->rss_after = pool_sample(&waiting);
+    printf("%-12s %5d %5llu %6llu %5llu %7llu %8.1f %8.1f %8.1f %6llu %7llu %8.1f",
+        name, nconns, r->outcomes[R_END], r->outcomes[R_CLOSED], r->outcomes[R_HELD], r->outcomes[R_REFUSED],
+        hist_percentile(&r->held, 0.5) / 1e6, hist_percentile(&r->held, 0.99) / 1e6, r->held.max / 1e6,
+        (unsigned long long)r->probe.total, r->starved, r->probe.max / 1e6);
+    if (master_pid) {
+        printf(" %7d %8.1f %7.1f %7.1f %7.1f", r->waiting_max, r->waiting_s,
+            r->rss_before / 1024.0, r->rss_peak / 1024.0, r->rss_after / 1024.0);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *addr = "127.0.0.1:9000";
+    char patterns[256] = "split,trickle,idle,half-header,big-content,big-padding,nv-length,body-stall";
+    int nconns = 1, split_ms = 10, trickle_ms = 1000, opt, i;
+    size_t trickle_bytes = 1, body_bytes = 1024;
+
+    while ((opt = getopt(argc, argv, "a:m:c:t:s:i:b:B:P:")) != -1) {
+        switch (opt) {
+        case 'a': addr = optarg; break;
+        case 'm': snprintf(patterns, sizeof(patterns), "%s", optarg); break;
+        case 'c': nconns = atoi(optarg); break;
+        case 't': hold_secs = atoi(optarg); break;
+        case 's': split_ms = atoi(optarg); break;
+        case 'i': trickle_ms = atoi(optarg); break;
+        case 'b': trickle_bytes = atol(optarg); break;
+        case 'B': body_bytes = atol(optarg); break;
+        case 'P': master_pid = atoi(optarg); break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind >= argc || nconns < 1 || trickle_bytes < 1 || body_bytes < 2 || body_bytes > MAX_REQUEST / 2) {
+usage:
+        printf("%s [-a host:port|/socket] [-m split,trickle,idle,half-header,big-content,big-padding,nv-length,body-stall] [-c conns] [-t secs] [-s ms] [-i ms] [-b bytes] [-B bytes] [-P pid] /path/to/script.php\n", argv[0]);
+        return 1;
+    }
+    if (fcgi_resolve(addr, &address) < 0) {
+        perror(addr);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    const char *script = argv[optind];
+    const char *uri = strrchr(script, '/') ? strrchr(script, '/') : script;
+    char content_length[32];
+    fcgi_param params[] = {
+        { "GATEWAY_INTERFACE", "FastCGI/1.0" },
+        { "REQUEST_METHOD", "GET" },
+        { "SCRIPT_FILENAME", script },
+        { "SCRIPT_NAME", uri },
+        { "REQUEST_URI", uri },
+        { "DOCUMENT_URI", uri },
+        { "QUERY_STRING", "" },
+        { "CONTENT_TYPE", "" },
+        { "CONTENT_LENGTH", "0" },
+        { "SERVER_SOFTWARE", "test-php-fpm-stall" },
+        { "SERVER_PROTOCOL", "HTTP/1.1" },
+        { "REMOTE_ADDR", "127.0.0.1" },
+        { "SERVER_NAME", "localhost" },
+        { "SERVER_PORT", "80" },
+    };
+    int nparams = sizeof(params) / sizeof(params[0]);
+
+    /* BEGIN_REQUEST 16 | PARAMS header 8, content, padding | empty PARAMS 8 | STDIN ... */
+    static char get[MAX_REQUEST], post[MAX_REQUEST], crafted[MAX_REQUEST], body[MAX_REQUEST / 2 + 1];
+    size_t get_len = encode_request(params, nparams, NULL, get);
+
+    memset(body, 'a', body_bytes);
+    body[1] = '=';
+    snprintf(content_length, sizeof(content_length), "%zu", body_bytes);
+    params[1].value = "POST";
+    params[7].value = "application/x-www-form-urlencoded";
+    params[8].value = content_length;
+    size_t post_len = encode_request(params, nparams, body, post);
+
+    const fcgi_header *ph = (const fcgi_header *)(get + 16);
+    size_t params_len = (ph->contentLengthB1 << 8) | ph->contentLengthB0;
+    if (get_len < 40 || post_len <= get_len || params_len < 100) {
+        fprintf(stderr, "encoding the request failed\n");
+        return 1;
+    }
+    probe_plan.data = get;
+    probe_plan.len = get_len;
+
+    printf("%s %s, -c %d, held up to %d s\n", addr, script, nconns, hold_secs);
+    printf("%-12s %5s %5s %6s %5s %7s %8s %8s %8s %6s %7s %8s",
+        "pattern", "conns", "end", "closed", "held", "refused", "p50 ms", "p99 ms", "max ms", "probes", "starved", "probe max");
+    if (master_pid) {
+        printf(" %7s %8s %7s %7s %7s", "waiting", "worker-s", "rss MB", "peak MB", "after");
+    }
+    printf("\n");
+
+    plan_t *plans = calloc(get_len > (size_t)nconns ? get_len : nconns, sizeof(plan_t));
+    stall_conn *conns = calloc(get_len > (size_t)nconns ? get_len : nconns, sizeof(stall_conn));
+    char *m, *save;
+    for (m = strtok_r(patterns, ",", &save); m; m = strtok_r(NULL, ",", &save)) {
+        plan_t p = { get, get_len, 0, 0, 0 };
+        size_t off;
+        result_t r;
+
+        result_init(&r);
+        if (strcmp(m, "split") == 0) {
+            /* -c cuts at a time, the ones not answered are listed */
+            size_t k, batch, failed = 0;
+            for (k = 1; k < get_len; k += batch) {
+                batch = get_len - k < (size_t)nconns ? get_len - k : (size_t)nconns;
+                for (i = 0; i < (int)batch; i++) {
+                    plans[i] = p;
+                    plans[i].split = k + i;
+                    plans[i].delay_ms = split_ms;
+                }
+                run(plans, batch, conns, &r);
+                for (i = 0; i < (int)batch; i++) {
+                    if (conns[i].outcome != R_END) {
+                        if (failed++ < 16) {
+                            fprintf(stderr, "split at %zu: %s\n", k + i, outcome_names[conns[i].outcome]);
+                        }
+                    }
+                }
+            }
+            result_print(m, nconns, &r);
+            continue;
+        }
+
+        if (strcmp(m, "trickle") == 0) {
+            p.chunk = trickle_bytes;
+            p.delay_ms = trickle_ms;
+        } else if (strcmp(m, "idle") == 0) {
+            p.len = 0;
+        } else if (strcmp(m, "half-header") == 0) {
+            p.len = sizeof(fcgi_header) / 2;
+        } else if (strcmp(m, "big-content") == 0) {
+            memcpy(crafted, get, 16);
+            off = 16 + put_record(crafted + 16, FCGI_PARAMS, FCGI_MAX_CONTENT, 0);
+            memcpy(crafted + off, get + 24, 100);
+            p.data = crafted;
+            p.len = off + 100;
+        } else if (strcmp(m, "big-padding") == 0) {
+            memcpy(crafted, get, 16);
+            off = 16 + put_record(crafted + 16, FCGI_PARAMS, params_len, 255);
+            memcpy(crafted + off, get + 24, params_len);
+            p.data = crafted;
+            p.len = off + params_len;
+        } else if (strcmp(m, "nv-length") == 0) {
+            static const char pair[8] = { (char)0xff, (char)0xff, (char)0xff, (char)0xff, 1, 'A', 'B', 'C' };
+            memcpy(crafted, get, 16);
+            off = 16 + put_record(crafted + 16, FCGI_PARAMS, sizeof(pair), 0);
+            memcpy(crafted + off, pair, sizeof(pair));
+            off += sizeof(pair);
+            off += put_record(crafted + off, FCGI_PARAMS, 0, 0);
+            off += put_record(crafted + off, FCGI_STDIN, 0, 0);
+            p.data = crafted;
+            p.len = off;
+        } else if (strcmp(m, "body-stall") == 0) {
+            /* up to and including the first STDIN header */
+            const fcgi_header *h = (const fcgi_header *)(post + 16);
+            p.data = post;
+            p.len = 16 + 8 + ((h->contentLengthB1 << 8) | h->contentLengthB0) + h->paddingLength + 8 + 8;
+        } else {
+            printf("unknown pattern %s\n", m);
+            continue;
+        }
+
+        for (i = 0; i < nconns; i++) {
+            plans[i] = p;
+        }
+        run(plans, nconns, conns, &r);
+        result_print(m, nconns, &r);
+    }
+
+    free(plans);
+    free(conns);
+    return 0;
+}